@@ -0,0 +1,240 @@
+/* Headless audio output for the CHIP-8 sound timer.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * The emulator only queues tone changes and advances a frontier; a
+ * separate thread turns those into a band-limited square wave, a block
+ * at a time, and writes it out as 16-bit mono PCM, either raw or in a
+ * WAV container.
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+
+#define SAMPLE_RATE 48000
+#define TONE_HZ 440
+#define AMPLITUDE 8000
+#define EVENT_QUEUE 256
+#define BLOCK 1024
+
+typedef struct EVENT EVENT;
+struct EVENT{
+	uint64_t sample;
+	bool on;
+};
+
+struct AUDIO{
+	FILE *f;
+	bool raw, failed;
+	uint64_t slotspersecond;
+
+	EVENT events[EVENT_QUEUE];
+	atomic_uint head, tail;
+	atomic_uint_fast64_t frontier;
+	atomic_bool done;
+
+	uint64_t position, written;
+	double phase;
+	bool on;
+	pthread_t thread;
+};
+
+static uint64_t
+tosample(const AUDIO *a, uint64_t slot)
+{
+	return slot * SAMPLE_RATE / a->slotspersecond;
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void
+put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v & 0xFFFF);
+	put16(p + 2, v >> 16);
+}
+
+/* A pipe cannot be rewound to fill in the sizes at the end, so the
+ * header starts out claiming the largest possible stream, which is
+ * what streaming WAV readers expect.
+ */
+static void
+writeheader(AUDIO *a, uint32_t bytes)
+{
+	uint8_t h[44];
+	memcpy(h, "RIFF", 4);
+	put32(h + 4, bytes > UINT32_MAX - 36? UINT32_MAX : bytes + 36);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put32(h + 16, 16);
+	put16(h + 20, 1);
+	put16(h + 22, 1);
+	put32(h + 24, SAMPLE_RATE);
+	put32(h + 28, SAMPLE_RATE * 2);
+	put16(h + 32, 2);
+	put16(h + 34, 16);
+	memcpy(h + 36, "data", 4);
+	put32(h + 40, bytes);
+	if (fwrite(h, 1, sizeof(h), a->f) != sizeof(h))
+		a->failed = true;
+}
+
+static void
+writeblock(AUDIO *a, const int16_t *block, size_t n)
+{
+	uint8_t buf[BLOCK * 2];
+	for (size_t i = 0; i < n; i++)
+		put16(buf + i * 2, (uint16_t)block[i]);
+	if (fwrite(buf, 2, n, a->f) != n)
+		a->failed = true;
+	a->written += n * 2;
+}
+
+static double
+polyblep(double t, double dt)
+{
+	if (t < dt){
+		t /= dt;
+		return t + t - t * t - 1;
+	}
+	if (t > 1 - dt){
+		t = (t - 1) / dt;
+		return t * t + t + t + 1;
+	}
+	return 0;
+}
+
+/* The naive square wave aliases badly at 48 kHz; PolyBLEP rounds off
+ * each edge over a sample to take most of that out. This is also the one
+ * place to swap in XO-CHIP pattern playback.
+ */
+static int16_t
+synth(AUDIO *a)
+{
+	if (!a->on)
+		return 0;
+
+	double dt = (double)TONE_HZ / SAMPLE_RATE;
+	double v = a->phase < 0.5? 1 : -1;
+	v += polyblep(a->phase, dt);
+	v -= polyblep(fmod(a->phase + 0.5, 1), dt);
+	if ((a->phase += dt) >= 1)
+		a->phase -= 1;
+	return (int16_t)(v * AMPLITUDE);
+}
+
+static void
+renderto(AUDIO *a, uint64_t end)
+{
+	int16_t block[BLOCK];
+	size_t n = 0;
+	while (a->position < end){
+		uint64_t stop = end;
+		unsigned tail = atomic_load_explicit(&a->tail, memory_order_relaxed);
+		if (tail != atomic_load_explicit(&a->head, memory_order_acquire)){
+			const EVENT *e = &a->events[tail % EVENT_QUEUE];
+			if (e->sample <= a->position){
+				if (e->on && !a->on)
+					a->phase = 0;
+				a->on = e->on;
+				atomic_store_explicit(&a->tail, tail + 1, memory_order_release);
+				continue;
+			}
+			if (e->sample < stop)
+				stop = e->sample;
+		}
+
+		for (; a->position < stop; a->position++){
+			block[n++] = synth(a);
+			if (n == BLOCK){
+				writeblock(a, block, n);
+				n = 0;
+			}
+		}
+	}
+	writeblock(a, block, n);
+}
+
+static void *
+audiothread(void *arg)
+{
+	AUDIO *a = arg;
+	struct timespec period = {.tv_nsec = 1000000000L / SAMPLE_RATE * BLOCK};
+	bool done = false;
+	while (!done){
+		done = atomic_load(&a->done);
+		renderto(a, atomic_load(&a->frontier));
+		fflush(a->f);
+		if (!done)
+			nanosleep(&period, NULL);
+	}
+	return NULL;
+}
+
+AUDIO *
+openaudio(const char *filename, bool raw, uint64_t slotspersecond)
+{
+	AUDIO *a = calloc(1, sizeof(AUDIO));
+	if (!a)
+		return NULL;
+	if (!(a->f = fopen(filename, "wb"))){
+		free(a);
+		return NULL;
+	}
+
+	a->raw = raw;
+	a->slotspersecond = slotspersecond;
+	if (!raw)
+		writeheader(a, UINT32_MAX);
+	if (pthread_create(&a->thread, NULL, audiothread, a) != 0){
+		fclose(a->f);
+		free(a);
+		return NULL;
+	}
+	return a;
+}
+
+/* Called from the emulation thread. Changes are dropped rather than
+ * waited on if the audio thread has fallen a whole queue behind.
+ */
+void
+settone(AUDIO *a, uint64_t slot, bool on)
+{
+	unsigned head = atomic_load_explicit(&a->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&a->tail, memory_order_acquire) < EVENT_QUEUE){
+		a->events[head % EVENT_QUEUE] = (EVENT){.sample = tosample(a, slot), .on = on};
+		atomic_store_explicit(&a->head, head + 1, memory_order_release);
+	}
+}
+
+void
+advanceaudio(AUDIO *a, uint64_t slot)
+{
+	atomic_store(&a->frontier, tosample(a, slot));
+}
+
+bool
+closeaudio(AUDIO *a)
+{
+	atomic_store(&a->done, true);
+	pthread_join(a->thread, NULL);
+	if (!a->raw && fseek(a->f, 0, SEEK_SET) == 0)
+		writeheader(a, a->written > UINT32_MAX? UINT32_MAX : (uint32_t)a->written);
+
+	bool ok = !a->failed;
+	if (fclose(a->f) != 0)
+		ok = false;
+	free(a);
+	return ok;
+}
@@ -0,0 +1,25 @@
+/* Headless audio output for the CHIP-8 sound timer.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Time is given to the audio side in instruction slots: slot n is the
+ * n'th instruction executed since startup, counting instructions that a
+ * tick would have run even if it stopped early. That is what makes the
+ * tone start and stop on the instruction that caused it rather than on
+ * a tick boundary.
+ */
+typedef struct AUDIO AUDIO;
+
+AUDIO *openaudio(const char *filename, bool raw, uint64_t slotspersecond);
+void settone(AUDIO *a, uint64_t slot, bool on);
+void advanceaudio(AUDIO *a, uint64_t slot);
+bool closeaudio(AUDIO *a);
+
+#endif
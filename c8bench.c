@@ -0,0 +1,430 @@
+/* Measure how running many machines scales across threads.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * Every combination of a number of machines, from one up to -n in powers
+ * of ten, and a number of threads, from one up to -j in powers of two,
+ * is run flat out for a while, each thread taking a frame of each of its
+ * machines in turn as a host serving many sessions would. The machines
+ * run the ROMs given, in turn, kept busy by pressing keys and restarted
+ * if they fault. Reported are the instructions and frames per second
+ * across all machines, how close the threads come to scaling perfectly
+ * over one thread, and the resident memory each machine costs.
+ *
+ * With -o the machines are only observed, as for training or search,
+ * and every so many frames each gives a half-size observation.
+ *
+ * Machines live in one mapping and are copied in by the thread that
+ * first runs them so their pages are its own. Only the part of a
+ * machine a ROM touches is ever faulted in. Machines are dealt out to
+ * threads in order, which mixes the ROMs on every thread; with -l they
+ * are grouped by a hash of their ROM instead, each thread pinned to a
+ * core, so that a ROM's image and decoded code stay in that core's
+ * caches. Grouping can leave some threads with dearer ROMs than others,
+ * so every EPOCH_NANOS the thread going slowest gives machines to the
+ * one going fastest if their rates differ by more than SKEW. Reported
+ * too is how often a thread ran the same ROM as in its previous frame,
+ * and how many machines were moved.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "chip8.h"
+
+#define LOAD_ADDR 512
+#define MAX_ROM (1 << 24)
+#define EPOCH_NANOS 100000000
+#define SKEW 1.25
+
+/* A thread's share of the machines, and its counts, alone on its cache
+ * lines so that counting is not itself a source of false sharing.
+ */
+typedef struct WORKER WORKER;
+struct WORKER{
+	alignas(64) size_t *ids;
+	size_t count;
+	pthread_t thread;
+	int cpu;
+	uint64_t cycles, frames, hits;
+	_Atomic uint64_t passes;
+};
+
+static CHIP8 **roms, *vms;
+static int nroms, *groups, engine = ENGINE_IFCHAIN, inspertick = 11, every;
+static bool locality;
+static const VIEW view = {.w = 64, .h = 32, .scale = 2};
+static atomic_bool stop, parking;
+static pthread_barrier_t ready, parked;
+
+static void
+die(const char *m)
+{
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static long
+resident(void)
+{
+	long size = 0, pages = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f){
+		if (fscanf(f, "%ld %ld", &size, &pages) != 2)
+			pages = 0;
+		fclose(f);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Fonts, then the ROM at LOAD_ADDR; a ROM bigger than memory is also
+ * kept whole for MegaChip mode to read the rest of.
+ */
+static CHIP8 *
+loadrom(const char *filename)
+{
+	CHIP8 *vm = calloc(1, sizeof(CHIP8));
+	uint8_t *image = calloc(MAX_ROM, 1);
+	FILE *f = fopen(filename, "rb");
+	if (!vm || !image)
+		die("out of memory\n");
+	if (!f)
+		die("could not read rom\n");
+	size_t n = fread(image + LOAD_ADDR, 1, MAX_ROM - LOAD_ADDR, f);
+	if (ferror(f) || !feof(f))
+		die(ferror(f)? "could not read rom\n" : "rom too large\n");
+	fclose(f);
+
+	loadfonts(vm->mem, 0);
+	memcpy(vm->mem + LOAD_ADDR, image + LOAD_ADDR, MEMORY_SIZE - LOAD_ADDR);
+	vm->pc = LOAD_ADDR;
+	vm->engine = engine;
+	vm->observing = every > 0;
+	if (LOAD_ADDR + n > MEMORY_SIZE){
+		vm->xmem = image;
+		vm->xsize = LOAD_ADDR + n;
+	} else
+		free(image);
+	return vm;
+}
+
+/* ROMs with the same contents, given twice, are one group. */
+static void
+grouproms(void)
+{
+	uint64_t *hashes = calloc(nroms, sizeof(uint64_t));
+	if (!hashes || !(groups = calloc(nroms, sizeof(int))))
+		die("out of memory\n");
+	for (int r = 0; r < nroms; r++){
+		const CHIP8 *vm = roms[r];
+		uint64_t h = 0xCBF29CE484222325;
+		for (int a = LOAD_ADDR; a < MEMORY_SIZE; a++)
+			h = (h ^ vm->mem[a]) * 0x100000001B3;
+		for (uint32_t a = MEMORY_SIZE; a < vm->xsize; a++)
+			h = (h ^ vm->xmem[a]) * 0x100000001B3;
+		hashes[r] = h;
+		groups[r] = r;
+		for (int q = 0; q < r && groups[r] == r; q++){
+			if (hashes[q] == h)
+				groups[r] = groups[q];
+		}
+	}
+	free(hashes);
+}
+
+static int
+group(size_t k)
+{
+	return groups[k % nroms];
+}
+
+static int
+bygroup(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	if (group(x) != group(y))
+		return group(x) - group(y);
+	return (x > y) - (x < y);
+}
+
+static void
+reset(CHIP8 *vm, size_t k)
+{
+	if (!copymachine(vm, roms[k % nroms]))
+		die("out of memory\n");
+}
+
+/* One frame: inspertick instructions and a tick of the timers. */
+static uint64_t
+frame(CHIP8 *vm, size_t k)
+{
+	uint64_t start = vm->cycles, left = inspertick;
+	while (left){
+		uint64_t before = vm->cycles;
+		int e = rununtil(vm, left);
+		left -= vm->cycles - before;
+		if (e == EVENT_KEYWAIT){
+			presskey(vm, vm->cycles & 15);
+			break;
+		}
+		if (e == EVENT_FAULT){
+			uint64_t done = vm->cycles - start;
+			reset(vm, k);
+			return done;
+		}
+	}
+	vm->keys = 1 << (vm->cycles >> 10 & 15);
+	ticktimers(vm);
+	return vm->cycles - start;
+}
+
+static void *
+worker(void *arg)
+{
+	WORKER *w = arg;
+	uint8_t seen[32 * 16];
+	int last = -1;
+	if (locality){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+	for (size_t k = 0; k < w->count; k++)
+		reset(&vms[w->ids[k]], w->ids[k]);
+	pthread_barrier_wait(&ready);
+	for (uint64_t pass = 0; !atomic_load_explicit(&stop, memory_order_relaxed); pass++){
+		bool look = every && pass % every == 0;
+		for (size_t k = 0; k < w->count && !atomic_load_explicit(&stop, memory_order_relaxed); k++){
+			size_t id = w->ids[k];
+			w->cycles += frame(&vms[id], id);
+			w->frames++;
+			w->hits += group(id) == last;
+			last = group(id);
+			if (look)
+				observe(&vms[id], &view, seen);
+		}
+		atomic_store_explicit(&w->passes, pass + 1, memory_order_relaxed);
+
+		/* stand still while machines are moved */
+		if (atomic_load_explicit(&parking, memory_order_acquire)){
+			pthread_barrier_wait(&parked);
+			pthread_barrier_wait(&parked);
+		}
+	}
+	releasecode();
+	return NULL;
+}
+
+/* Moves machines from the worker going slowest to the one going
+ * fastest, as many as would even them out if the slow one's machines
+ * all cost the same, taking them from the end of its last group. Only
+ * a skew seen in two epochs running counts, so that a thread held up
+ * once does not send machines back and forth. Returns how many were
+ * moved.
+ */
+static size_t
+rebalance(WORKER *workers, int nthreads, uint64_t *before, double seconds, bool *skewed)
+{
+	int slow = 0, fast = 0;
+	double rates[nthreads];
+	for (int t = 0; t < nthreads; t++){
+		uint64_t passes = atomic_load_explicit(&workers[t].passes, memory_order_relaxed);
+		rates[t] = (passes - before[t]) / seconds;
+		before[t] = passes;
+		slow = rates[t] < rates[slow]? t : slow;
+		fast = rates[t] > rates[fast]? t : fast;
+	}
+	WORKER *s = &workers[slow], *f = &workers[fast];
+	bool again = *skewed;
+	*skewed = rates[fast] >= rates[slow] * SKEW && s->count > 1;
+	if (!*skewed || !again)
+		return 0;
+	*skewed = false;
+	size_t n = s->count * (1 - rates[slow] / rates[fast]) / 2;
+	n = n < 1? 1 : n > s->count - 1? s->count - 1 : n;
+
+	atomic_store_explicit(&parking, true, memory_order_release);
+	pthread_barrier_wait(&parked);
+	memcpy(f->ids + f->count, s->ids + s->count - n, n * sizeof(size_t));
+	s->count -= n;
+	f->count += n;
+	qsort(f->ids, f->count, sizeof(size_t), bygroup);
+	atomic_store(&parking, false);
+	pthread_barrier_wait(&parked);
+	return n;
+}
+
+typedef struct RESULT RESULT;
+struct RESULT{
+	double mips, fps, affinity;
+	long bytes;
+	size_t moved;
+};
+
+static RESULT
+bench(size_t nvms, int nthreads, double seconds)
+{
+	RESULT r = {0};
+	size_t size = nvms * sizeof(CHIP8);
+	long before = resident(), ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	vms = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	WORKER *workers = aligned_alloc(64, nthreads * sizeof(WORKER));
+	size_t *order = malloc(nvms * sizeof(size_t));
+	if (vms == MAP_FAILED || !workers || !order)
+		die("out of memory\n");
+	memset(workers, 0, nthreads * sizeof(WORKER));
+
+	/* any worker may come to hold every machine */
+	for (size_t k = 0; k < nvms; k++)
+		order[k] = k;
+	if (locality)
+		qsort(order, nvms, sizeof(size_t), bygroup);
+
+	atomic_store(&stop, false);
+	atomic_store(&parking, false);
+	pthread_barrier_init(&ready, NULL, nthreads + 1);
+	pthread_barrier_init(&parked, NULL, nthreads + 1);
+	for (size_t t = 0, first = 0; t < (size_t)nthreads; t++){
+		WORKER *w = &workers[t];
+		w->count = nvms / nthreads + (t < nvms % nthreads);
+		w->cpu = t % ncpus;
+		if (!(w->ids = malloc(nvms * sizeof(size_t))))
+			die("out of memory\n");
+		memcpy(w->ids, order + first, w->count * sizeof(size_t));
+		first += w->count;
+		if (pthread_create(&w->thread, NULL, worker, w) != 0)
+			die("could not start thread\n");
+	}
+
+	struct timespec start;
+	uint64_t passes[nthreads];
+	bool skewed = false;
+	memset(passes, 0, sizeof(passes));
+	pthread_barrier_wait(&ready);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (double left = seconds; left > 0;){
+		double epoch = locality && nthreads > 1 && left > EPOCH_NANOS / 1e9? EPOCH_NANOS / 1e9 : left;
+		struct timespec pause = {(time_t)epoch, (long)((epoch - (time_t)epoch) * 1e9)};
+		nanosleep(&pause, NULL);
+		left -= epoch;
+		if (locality && nthreads > 1 && left > 0)
+			r.moved += rebalance(workers, nthreads, passes, epoch, &skewed);
+	}
+	atomic_store(&stop, true);
+
+	uint64_t cycles = 0, frames = 0, hits = 0;
+	for (int t = 0; t < nthreads; t++){
+		pthread_join(workers[t].thread, NULL);
+		cycles += workers[t].cycles;
+		frames += workers[t].frames;
+		hits += workers[t].hits;
+		free(workers[t].ids);
+	}
+	double took = elapsed(&start);
+	r.mips = cycles / took / 1e6;
+	r.fps = frames / took;
+	r.affinity = frames? (double)hits / frames : 0;
+	r.bytes = (resident() - before) / (long)nvms;
+
+	pthread_barrier_destroy(&ready);
+	pthread_barrier_destroy(&parked);
+	for (size_t k = 0; k < nvms; k++)
+		releasemega(&vms[k]);
+	munmap(vms, size);
+	free(workers);
+	free(order);
+	return r;
+}
+
+#define USAGE "usage: c8bench [-l] [-e ifchain|table|cached|jit] [-j THREADS] [-n MACHINES] [-o EVERY] [-s SPEED] [-t SECONDS] ROM...\n"
+int
+main(int argc, char **argv)
+{
+	long maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	long maxvms = 10000;
+	double seconds = 0.5;
+	int ch;
+	while ((ch = getopt(argc, argv, "hle:j:n:o:s:t:")) != -1) switch (ch){
+		case 'e':
+			engine = -1;
+			for (int e = 0; e < NENGINES; e++){
+				if (strcmp(optarg, enginenames[e]) == 0)
+					engine = e;
+			}
+			if (engine < 0)
+				die("invalid engine\n");
+			break;
+		case 'l':
+			locality = true;
+			break;
+		case 'j':
+			if ((maxthreads = atol(optarg)) <= 0)
+				die("invalid thread count\n");
+			break;
+		case 'n':
+			if ((maxvms = atol(optarg)) <= 0)
+				die("invalid machine count\n");
+			break;
+		case 'o':
+			if ((every = atoi(optarg)) <= 0)
+				die("invalid observation interval\n");
+			break;
+		case 's':
+			if ((inspertick = atoi(optarg)) <= 0)
+				die("invalid instructions per tick\n");
+			break;
+		case 't':
+			if ((seconds = atof(optarg)) <= 0)
+				die("invalid duration\n");
+			break;
+		default:
+			die(USAGE);
+			break;
+	}
+	argc -= optind; argv += optind;
+	if (argc < 1)
+		die(USAGE);
+
+	nroms = argc;
+	if (!(roms = calloc(nroms, sizeof(CHIP8 *))))
+		die("out of memory\n");
+	for (int k = 0; k < nroms; k++)
+		roms[k] = loadrom(argv[k]);
+	grouproms();
+
+	printf("%9s %7s %10s %12s %10s %10s %9s %6s\n", "machines", "threads", "MIPS", "frames/s", "scaling", "bytes/vm", "affinity", "moved");
+	for (long nvms = 1;; nvms = nvms * 10 > maxvms && nvms < maxvms? maxvms : nvms * 10){
+		double single = 0;
+		for (long nthreads = 1;; nthreads = nthreads * 2 > maxthreads && nthreads < maxthreads? maxthreads : nthreads * 2){
+			if (nthreads > maxthreads || nthreads > nvms)
+				break;
+			RESULT r = bench(nvms, nthreads, seconds);
+			if (nthreads == 1)
+				single = r.mips;
+			printf("%9ld %7ld %10.1f %12.0f %9.0f%% %10ld %8.0f%% %6zu\n", nvms, nthreads, r.mips, r.fps,
+			       100 * r.mips / (nthreads * single), r.bytes, 100 * r.affinity, r.moved);
+			fflush(stdout);
+		}
+		if (nvms >= maxvms)
+			break;
+	}
+	return EXIT_SUCCESS;
+}
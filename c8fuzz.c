@@ -0,0 +1,264 @@
+/* Grow a corpus of ROMs that reach new code in the core.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * Starting from the ROMs given, each round takes one from the corpus,
+ * mutates it a few times and runs it for a few frames, pressing keys,
+ * on each engine in turn. The core is built for this with the compiler
+ * calling __sanitizer_cov_trace_pc() at every branch, which marks the
+ * edge from the branch before by where in the core each was called
+ * from, and a ROM that marks an edge never seen before joins the
+ * corpus. Edges are in the core, not the ROM, so a ROM only counts for
+ * making the emulator do something new. Mutations go
+ * by the instruction encoding (see mutate.c), or with -b by the byte,
+ * for comparison; reported are runs and new edges per second, and how
+ * many runs faulted in their first frame and so taught nothing.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+#include "mutate.h"
+
+#define MAX_ROM (MEMORY_SIZE - MUTATE_LOAD_ADDR)
+#define MAX_STACKED 4
+#define EDGES (1 << 16)
+
+typedef struct ENTRY ENTRY;
+struct ENTRY{
+	uint8_t rom[MAX_ROM];
+	size_t size;
+};
+
+static ENTRY *corpus;
+static size_t ncorpus, capacity;
+static uint8_t edges[EDGES / 8];
+static uint64_t nedges, fresh;
+static uintptr_t previous;
+static int nframes = 60, inspertick = 11;
+static bool bytes;
+static const char *outdir;
+
+static void
+die(const char *m)
+{
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+below(uint32_t *seed, uint32_t n)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return (uint64_t)*seed * n >> 32;
+}
+
+static void
+add(const uint8_t *rom, size_t size)
+{
+	if (ncorpus == capacity){
+		capacity = capacity? capacity * 2 : 64;
+		if (!(corpus = realloc(corpus, capacity * sizeof(ENTRY))))
+			die("out of memory\n");
+	}
+	ENTRY *e = &corpus[ncorpus++];
+	memcpy(e->rom, rom, size);
+	e->size = size;
+
+	char name[4096];
+	if (outdir){
+		snprintf(name, sizeof(name), "%s/%06zu.ch8", outdir, ncorpus - 1);
+		FILE *f = fopen(name, "wb");
+		if (!f || fwrite(rom, 1, size, f) != size || fclose(f) != 0)
+			die("could not write corpus\n");
+	}
+}
+
+static void
+load(const char *filename)
+{
+	uint8_t rom[MAX_ROM + 1];
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		die("could not read rom\n");
+	size_t n = fread(rom, 1, sizeof(rom), f);
+	fclose(f);
+	if (n > MAX_ROM)
+		die("rom too large\n");
+	add(rom, n);
+}
+
+/* Byte-level mutations, as a fuzzer that knows nothing of CHIP-8 makes. */
+static size_t
+mutatebytes(uint8_t *rom, size_t size, size_t max, const uint8_t *other, size_t othersize, uint32_t *seed)
+{
+	size_t at = below(seed, size + 1);
+	switch (size? below(seed, 4) : 2){
+		case 0:
+			rom[at % size] ^= 1 << below(seed, 8);
+			break;
+		case 1:
+			rom[at % size] = below(seed, 256);
+			break;
+		case 2:
+			if (size < max){
+				memmove(rom + at + 1, rom + at, size - at);
+				rom[at] = below(seed, 256);
+				size++;
+			}
+			break;
+		case 3:
+			if (othersize){
+				size_t from = below(seed, othersize), n = 1 + below(seed, 32);
+				at %= size;
+				if (n > othersize - from) n = othersize - from;
+				if (n > size - at)        n = size - at;
+				memcpy(rom + at, other + from, n);
+			}
+			break;
+	}
+	return size;
+}
+
+/* The core's code, which the Makefile puts in a section of its own. */
+extern const char __start_corecov[], __stop_corecov[];
+
+void
+__sanitizer_cov_trace_pc(void)
+{
+	const char *pc = __builtin_return_address(0);
+	if (pc < __start_corecov || pc >= __stop_corecov)
+		return;
+	uintptr_t at = (uintptr_t)(pc - __start_corecov) & (EDGES - 1);
+	size_t edge = at ^ previous;
+	previous = at >> 1;
+	if (!(edges[edge / 8] >> edge % 8 & 1)){
+		edges[edge / 8] |= 1 << edge % 8;
+		fresh++;
+	}
+}
+
+/* Runs a ROM; returns how many edges it marked that were new. */
+static uint64_t
+run(const uint8_t *rom, size_t size, int engine, bool *dead)
+{
+	static CHIP8 vm;
+	releasemega(&vm);
+	memset(&vm, 0, sizeof(vm));
+	loadfonts(vm.mem, 0);
+	memcpy(vm.mem + MUTATE_LOAD_ADDR, rom, size);
+	vm.pc = MUTATE_LOAD_ADDR;
+	vm.engine = engine;
+	vm.observing = true;
+
+	fresh = 0;
+	*dead = false;
+	for (int f = 0; f < nframes; f++){
+		vm.keys = 1 << (f >> 2 & 15);
+		for (uint64_t left = inspertick; left;){
+			uint64_t before = vm.cycles;
+			int e = rununtil(&vm, left);
+			left -= vm.cycles - before;
+			if (e == EVENT_FAULT){
+				*dead = f == 0;
+				return fresh;
+			}
+			if (e == EVENT_KEYWAIT){
+				presskey(&vm, f & 15);
+				break;
+			}
+		}
+		ticktimers(&vm);
+	}
+	return fresh;
+}
+
+#define USAGE "usage: c8fuzz [-b] [-f FRAMES] [-o DIR] [-r SEED] [-s SPEED] [-t SECONDS] ROM...\n"
+int
+main(int argc, char **argv)
+{
+	uint32_t seed = 1;
+	double seconds = 10;
+	int ch;
+	while ((ch = getopt(argc, argv, "hbf:o:r:s:t:")) != -1) switch (ch){
+		case 'b':
+			bytes = true;
+			break;
+		case 'f':
+			if ((nframes = atoi(optarg)) <= 0)
+				die("invalid frame count\n");
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 'r':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			if ((inspertick = atoi(optarg)) <= 0)
+				die("invalid instructions per tick\n");
+			break;
+		case 't':
+			if ((seconds = atof(optarg)) <= 0)
+				die("invalid duration\n");
+			break;
+		default:
+			die(USAGE);
+			break;
+	}
+	argc -= optind; argv += optind;
+	if (argc < 1)
+		die(USAGE);
+
+	for (int k = 0; k < argc; k++)
+		load(argv[k]);
+	size_t seeds = ncorpus;
+	bool dead;
+	for (size_t k = 0; k < seeds; k++)
+		for (int engine = 0; engine < NENGINES; engine++)
+			nedges += run(corpus[k].rom, corpus[k].size, engine, &dead);
+
+	uint64_t runs = 0, deaths = 0, initial = nedges;
+	double start = now(), report = start + 1, t;
+	while ((t = now()) - start < seconds){
+		/* the corpus may move as it grows, so work on a copy */
+		uint8_t rom[MAX_ROM];
+		const ENTRY *e = &corpus[below(&seed, ncorpus)], *other = &corpus[below(&seed, ncorpus)];
+		size_t size = e->size;
+		memcpy(rom, e->rom, size);
+		for (uint32_t n = 1 + below(&seed, MAX_STACKED); n; n--)
+			size = (bytes? mutatebytes : mutaterom)(rom, size, MAX_ROM, other->rom, other->size, &seed);
+
+		uint64_t found = run(rom, size, runs % NENGINES, &dead);
+		runs++;
+		deaths += dead;
+		if (found){
+			nedges += found;
+			add(rom, size);
+		}
+		if (t >= report){
+			fprintf(stderr, "%.0fs: %llu runs, %zu in corpus, %llu edges\n", t - start,
+			        (unsigned long long)runs, ncorpus, (unsigned long long)nedges);
+			report += 1;
+		}
+	}
+
+	double took = now() - start;
+	printf("%s mutations: %.0f runs/s, %llu edges (%.1f new/s), %zu added to corpus, %.1f%% dead in the first frame\n",
+	       bytes? "byte" : "instruction", runs / took, (unsigned long long)nedges, (nedges - initial) / took,
+	       ncorpus - seeds, runs? 100.0 * deaths / runs : 0);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,435 @@
+/* Peephole optimization of ROMs.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * Over the control flow graph of the ROM (see cfg.c) this finds, by
+ * propagating constants forward and register liveness backward:
+ *
+ *   - jumps to jumps, which are threaded to the end of the chain, and
+ *     jumps to 00EE, which become 00EE;
+ *   - calls to a subroutine that only returns;
+ *   - ANNN that loads I with what it already holds, or that nothing
+ *     reads before it is loaded again;
+ *   - instructions whose results, VF included, are never read, and
+ *     6XNN that loads what VX already holds; and 8XY4 and 8XY5 whose
+ *     carry is never read and whose VY is known, which become 7XNN;
+ *   - with -T, countdown loops of 7XNN, 3X00 and a jump back, which
+ *     become 6X00 so they finish on their first pass.
+ *
+ * Nothing moves: the ROM keeps its size and every address that can be
+ * jumped to or read from keeps its contents, because I can be computed
+ * and data found anywhere. A dropped instruction is squeezed out of its
+ * basic block instead, moving the rest of the block up over it; a block
+ * that does not end by jumping away ends with a jump to where it used
+ * to fall through, so that takes two dropped instructions to pay off.
+ * Code that sprites or FX65 might read, ROMs that write over their own
+ * code, and MegaChip ROMs are left alone; with BNNN anywhere only jumps
+ * are threaded, as its targets are unknown.
+ *
+ * Dropping instructions makes a ROM take fewer of them to get from one
+ * wait on the delay timer to the next, which it cannot tell while it
+ * keeps to its timer; countdown loops, which do their waiting by the
+ * instruction, are only shortened with -T. Either way the result is run
+ * side by side with the original for FRAMES frames, pressing the same
+ * keys, at SPEED instructions per tick, and not written unless every
+ * frame shows and sounds the same (or with -f). Pass the ROM's own speed
+ * to check that it does not run ahead of where it ran before.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cfg.h"
+#include "chip8.h"
+
+#define LOAD_ADDR 512
+#define MAX_ROM (MEMORY_SIZE - LOAD_ADDR)
+#define MAX_PASSES 16
+#define MAX_CHAIN 16
+
+#define A(inst) ((inst) >> 12)
+#define X(inst) ((inst) >> 8 & 0xF)
+#define Y(inst) ((inst) >> 4 & 0xF)
+#define D(inst) ((inst) & 0xF)
+#define NN(inst) ((inst) & 0xFF)
+#define NNN(inst) ((inst) & 0xFFF)
+
+enum{
+	DROP_JUMP,
+	DROP_CALL,
+	DROP_I,
+	DROP_VF,
+	DROP_DEAD,
+	DROP_LOOP,
+	NDROPS
+};
+
+static const char *dropnames[NDROPS] = {
+	"jumps threaded", "empty calls dropped", "loads of I dropped",
+	"VF computations dropped", "dead instructions dropped", "countdown loops shortened"
+};
+
+static uint8_t mem[MEMORY_SIZE], original[MEMORY_SIZE];
+static size_t romsize;
+static CFG g;
+static REGS in[MEMORY_SIZE];
+static bool seen[MEMORY_SIZE], dropped[MEMORY_SIZE];
+static uint8_t kind[MEMORY_SIZE];
+static uint32_t liveout[MEMORY_SIZE];
+static bool readable[MEMORY_SIZE], writable[MEMORY_SIZE];
+static unsigned counts[NDROPS];
+static int saved;
+static bool timing;
+
+static void
+die(const char *m)
+{
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static void
+putword(uint16_t pc, uint16_t w)
+{
+	mem[pc] = w >> 8;
+	mem[pc + 1] = w & 0xFF;
+}
+
+/* Whether inst does nothing but write the registers in writes(). CXNN
+ * also steps the random number generator, so it is not.
+ */
+static bool
+pure(uint16_t inst)
+{
+	switch (A(inst)){
+		case 0x6: case 0x7: case 0xA:
+			return true;
+		case 0x8:
+			return D(inst) <= 7 || D(inst) == 0xE;
+		case 0xF:
+			return NN(inst) == 0x07 || NN(inst) == 0x1E || NN(inst) == 0x29 || NN(inst) == 0x65;
+	}
+	return false;
+}
+
+static void
+liveness(void)
+{
+	static uint16_t out[CFG_MAX_SUCCESSORS];
+	static uint32_t livein[MEMORY_SIZE];
+	memset(livein, 0, sizeof(livein));
+	memset(liveout, 0, sizeof(liveout));
+	for (bool changed = true; changed;){
+		changed = false;
+		for (int pc = MEMORY_SIZE - 2; pc >= 0; pc--){
+			if (!(g.flags[pc] & CFG_CODE))
+				continue;
+			uint16_t inst = fetchword(mem, pc);
+			uint32_t live = A(inst) == 0xB? CFG_REG_ALL : 0;
+			int n = successors(&g, mem, pc, out);
+			for (int k = 0; k < n; k++)
+				live |= livein[out[k]];
+			uint32_t before = reads(inst) | (live & ~writes(inst));
+			if (live != liveout[pc] || before != livein[pc]){
+				liveout[pc] = live;
+				livein[pc] = before;
+				changed = true;
+			}
+		}
+	}
+}
+
+static void
+touch(bool *where, int lo, int hi)
+{
+	for (int at = lo; at <= hi; at++)
+		where[at % MEMORY_SIZE] = true;
+}
+
+/* Marks the memory each instruction may read or write through I. */
+static void
+accesses(void)
+{
+	memset(readable, 0, sizeof(readable));
+	memset(writable, 0, sizeof(writable));
+	for (int pc = 0; pc < MEMORY_SIZE; pc++){
+		if (!(g.flags[pc] & CFG_CODE) || !seen[pc])
+			continue;
+		uint16_t inst = fetchword(mem, pc);
+		const REGS *s = &in[pc];
+		if (A(inst) == 0xD)
+			touch(readable, s->ilo, s->ihi + D(inst) - 1);
+		else if (inst >> 12 == 0xF && NN(inst) == 0x65)
+			touch(readable, s->ilo, s->ihi + X(inst));
+		else if (inst >> 12 == 0xF && NN(inst) == 0x55)
+			touch(writable, s->ilo, s->ihi + X(inst));
+		else if (inst >> 12 == 0xF && NN(inst) == 0x33)
+			touch(writable, s->ilo, s->ihi + 2);
+	}
+}
+
+/* Where a jump to t ends up, through any jumps t leads to. */
+static uint16_t
+follow(uint16_t t)
+{
+	for (int k = 0; k < MAX_CHAIN; k++){
+		uint16_t inst = fetchword(mem, t);
+		if (A(inst) != 0x1 || NNN(inst) == t || writable[t] || writable[t + 1])
+			break;
+		t = NNN(inst);
+	}
+	return t;
+}
+
+static bool
+thread(uint16_t pc, uint16_t inst)
+{
+	if ((A(inst) != 0x1 && A(inst) != 0x2) || readable[pc] || readable[pc + 1])
+		return false;
+	uint16_t t = follow(NNN(inst));
+	if (A(inst) == 0x1 && fetchword(mem, t) == 0x00EE)
+		putword(pc, 0x00EE);
+	else if (t != NNN(inst))
+		putword(pc, (inst & 0xF000) | t);
+	else
+		return false;
+	counts[DROP_JUMP]++;
+	return true;
+}
+
+/* Rewrites an instruction that can do the same more cheaply. */
+static bool
+rewrite(uint16_t pc, uint16_t inst)
+{
+	const REGS *s = &in[pc];
+	int x = X(inst), vy = s->v[Y(inst)];
+	if (readable[pc] || readable[pc + 1])
+		return false;
+	if (A(inst) == 0x8 && (D(inst) == 4 || D(inst) == 5) && x != 0xF && !(liveout[pc] & 1u << 0xF) && vy != CFG_ANY){
+		putword(pc, 0x7000 | x << 8 | ((D(inst) == 4? vy : -vy) & 0xFF));
+		counts[DROP_VF]++;
+		return true;
+	}
+	if (timing && A(inst) == 0x7 && x != 0xF && fetchword(mem, pc + 2) == (0x3000 | x << 8) &&
+	    fetchword(mem, pc + 4) == (0x1000 | pc)){
+		int step = NN(inst), gcd = step & -step;
+		if (step && (step & 1 || (s->v[x] != CFG_ANY && s->v[x] % gcd == 0))){
+			putword(pc, 0x6000 | x << 8);
+			counts[DROP_LOOP]++;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Why inst can be dropped, or NDROPS. Dropping a result that is never
+ * read and dropping a load of what is already there each rely on the
+ * other kind staying, so they are never chosen together: the first
+ * round chooses the unread, and the second the reloads.
+ */
+static int
+choose(uint16_t pc, uint16_t inst, bool reloads)
+{
+	const REGS *s = &in[pc];
+	uint32_t live = liveout[pc], def = writes(inst);
+	if (A(inst) == 0x2 && fetchword(mem, NNN(inst)) == 0x00EE)
+		return DROP_CALL;
+	if (reloads){
+		if (A(inst) == 0xA && s->ilo == NNN(inst) && s->ihi == NNN(inst))
+			return DROP_I;
+		if (A(inst) == 0x6 && s->v[X(inst)] == NN(inst))
+			return DROP_DEAD;
+	} else if (pure(inst) && !(live & def))
+		return A(inst) == 0xA? DROP_I : def & 1u << 0xF? DROP_VF : DROP_DEAD;
+	return NDROPS;
+}
+
+/* Squeezes the dropped instructions out of the block at leader. */
+static bool
+compact(uint16_t leader)
+{
+	uint16_t end = blockend(&g, mem, leader), last = end - 2, lastinst = fetchword(mem, last);
+	int ndropped = 0;
+	for (uint16_t pc = leader; pc < end; pc += 2){
+		if (readable[pc] || readable[pc + 1] || (pc > leader && g.flags[pc - 1] & CFG_CODE) || g.flags[pc + 1] & CFG_CODE)
+			return false;
+		ndropped += dropped[pc];
+	}
+	bool movable = !dropped[last] && (lastinst == 0x00EE || A(lastinst) == 0x1);
+	bool pinned = !dropped[last] && !movable && transfers(lastinst);
+	if (!ndropped || (!movable && ndropped < 2))
+		return false;
+
+	uint16_t insts[MEMORY_SIZE / 2], to = leader;
+	int n = 0;
+	for (uint16_t pc = leader; pc < end; pc += 2){
+		if (dropped[pc])
+			counts[kind[pc]]++;
+		else if (!(pinned && pc == last))
+			insts[n++] = fetchword(mem, pc);
+	}
+	for (int k = 0; k < n; k++, to += 2)
+		putword(to, insts[k]);
+	uint16_t filler = movable? lastinst : 0x1000 | (pinned? last : end);
+	for (; to < (pinned? last : end); to += 2)
+		putword(to, filler);
+	saved += movable? ndropped : ndropped - 1;
+	return true;
+}
+
+/* One round of analysis and rewriting; false once nothing changes. */
+static bool
+optimize(void)
+{
+	buildcfg(&g, mem, LOAD_ADDR);
+	if (g.megachip)
+		die("MegaChip ROMs are not optimized\n");
+	propagate(&g, mem, in, seen);
+	accesses();
+	for (int pc = 0; pc < MEMORY_SIZE; pc++)
+		if (g.flags[pc] & CFG_CODE && writable[pc])
+			die("the ROM writes over its own code\n");
+
+	bool changed = false;
+	for (int pc = 0; pc < MEMORY_SIZE; pc++)
+		if (g.flags[pc] & CFG_CODE)
+			changed |= thread(pc, fetchword(mem, pc));
+	if (changed || g.indirect)
+		return changed;
+
+	liveness();
+	for (int pc = 0; pc < MEMORY_SIZE; pc++)
+		if (g.flags[pc] & CFG_CODE)
+			changed |= rewrite(pc, fetchword(mem, pc));
+	for (int reloads = 0; reloads < 2 && !changed; reloads++){
+		for (int pc = 0; pc < MEMORY_SIZE; pc++){
+			kind[pc] = g.flags[pc] & CFG_CODE? choose(pc, fetchword(mem, pc), reloads) : NDROPS;
+			dropped[pc] = kind[pc] != NDROPS;
+		}
+		for (int pc = 0; pc < MEMORY_SIZE; pc++)
+			if ((g.flags[pc] & (CFG_CODE | CFG_LEADER)) == (CFG_CODE | CFG_LEADER))
+				changed |= compact(pc);
+	}
+	return changed;
+}
+
+static void
+boot(CHIP8 *vm, const uint8_t *image)
+{
+	releasemega(vm);
+	memset(vm, 0, sizeof(*vm));
+	memcpy(vm->mem, image, MEMORY_SIZE);
+	vm->pc = LOAD_ADDR;
+	vm->observing = true;
+}
+
+/* Runs a frame of a ROM; false once it has faulted. */
+static bool
+frame(CHIP8 *vm, int f, int inspertick)
+{
+	vm->keys = 1 << (f >> 3 & 15);
+	for (uint64_t left = inspertick; left;){
+		uint64_t before = vm->cycles;
+		int e = rununtil(vm, left);
+		left -= vm->cycles - before;
+		if (e == EVENT_FAULT)
+			return false;
+		if (e == EVENT_KEYWAIT){
+			presskey(vm, f & 15);
+			break;
+		}
+	}
+	ticktimers(vm);
+	return true;
+}
+
+/* The first frame at which the ROMs differ, or -1. */
+static int
+differ(int nframes, int inspertick)
+{
+	static CHIP8 a, b;
+	boot(&a, original);
+	boot(&b, mem);
+	for (int f = 0; f < nframes; f++){
+		bool ra = frame(&a, f, inspertick), rb = frame(&b, f, inspertick);
+		if (ra != rb || memcmp(a.display, b.display, sizeof(a.display)) || !a.sound != !b.sound)
+			return f;
+		if (!ra)
+			break;
+	}
+	return -1;
+}
+
+#define USAGE "usage: c8opt [-fT] [-c FRAMES] [-o OUTPUT] [-s SPEED] ROM\n"
+int
+main(int argc, char **argv)
+{
+	const char *output = NULL;
+	int nframes = 600, inspertick = 1000, ch;
+	bool force = false;
+	while ((ch = getopt(argc, argv, "hfTc:o:s:")) != -1) switch (ch){
+		case 'f':
+			force = true;
+			break;
+		case 'T':
+			timing = true;
+			break;
+		case 'c':
+			if ((nframes = atoi(optarg)) < 0)
+				die("invalid frame count\n");
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			if ((inspertick = atoi(optarg)) <= 0)
+				die("invalid instructions per tick\n");
+			break;
+		default:
+			die(USAGE);
+			break;
+	}
+	argc -= optind; argv += optind;
+	if (argc != 1)
+		die(USAGE);
+
+	FILE *f = fopen(argv[0], "rb");
+	if (!f)
+		die("could not read rom\n");
+	loadfonts(mem, 0);
+	uint8_t rom[MAX_ROM + 1];
+	romsize = fread(rom, 1, sizeof(rom), f);
+	fclose(f);
+	if (romsize > MAX_ROM)
+		die("rom too large\n");
+	memcpy(mem + LOAD_ADDR, rom, romsize);
+	memcpy(original, mem, MEMORY_SIZE);
+
+	int passes = 0;
+	while (passes < MAX_PASSES && optimize())
+		passes++;
+
+	printf("%u instructions in %u blocks after %d passes%s\n", g.ninsts, g.nblocks, passes,
+	       g.indirect? "; BNNN found, so only jumps were threaded" : "");
+	for (int k = 0; k < NDROPS; k++)
+		if (counts[k])
+			printf("%u %s\n", counts[k], dropnames[k]);
+	printf("%d instruction slots saved\n", saved);
+
+	int bad = nframes? differ(nframes, inspertick) : -1;
+	if (bad >= 0)
+		printf("differs from the original at frame %d\n", bad);
+	else if (nframes)
+		printf("same as the original for %d frames at %d instructions per tick\n", nframes, inspertick);
+	if (!output)
+		return bad < 0? EXIT_SUCCESS : EXIT_FAILURE;
+	if (bad >= 0 && !force)
+		die("not written\n");
+
+	if (!(f = fopen(output, "wb")) || fwrite(mem + LOAD_ADDR, 1, romsize, f) != romsize || fclose(f) != 0)
+		die("could not write rom\n");
+	return EXIT_SUCCESS;
+}
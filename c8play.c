@@ -0,0 +1,131 @@
+/* Play back a CHIP-8 display recording.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CURSES_INCLUDE_H
+	#define CURSES_INCLUDE_H <curses.h>
+#endif
+
+#include CURSES_INCLUDE_H
+
+#include "record.h"
+
+#define TICKS_PER_SECOND 60
+
+static void
+die(const char *m)
+{
+	endwin();
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+initscreen(void)
+{
+	if (!initscr())
+		die("could not open screen\n");
+	raw();
+	noecho();
+	nonl();
+	scrollok(stdscr, FALSE);
+	intrflush(stdscr, FALSE);
+	curs_set(0);
+}
+
+/* Wait until the given playback time, keeping an eye on the keyboard:
+ * escape quits and space pauses, which moves the start time along so
+ * that playback resumes where it left off.
+ */
+static bool
+waituntil(double *start, double due)
+{
+	bool paused = false;
+	for (;;){
+		double left = *start + due - now();
+		if (!paused && left <= 0)
+			return true;
+
+		timeout(paused || left > 0.1? 100 : (int)(left * 1000));
+		int c = getch();
+		if (c == 0x1b)
+			return false;
+		if (c == ' ')
+			paused = !paused;
+		if (paused)
+			*start += 0.1;
+	}
+}
+
+static void
+drawrows(const uint64_t rows[32], uint64_t shown[32])
+{
+	for (int row = 0; row < 32; row++){
+		uint64_t diff = rows[row] ^ shown[row];
+		for (int col = 0; diff && col < 64; col++){
+			if (diff >> (63 - col) & 1)
+				mvaddch(row, col, (rows[row] >> (63 - col) & 1? A_REVERSE : A_NORMAL)|' ');
+		}
+		shown[row] = rows[row];
+	}
+	refresh();
+}
+
+#define USAGE "usage: c8play [-s SPEED] RECORDING\n"
+int
+main(int argc, char **argv)
+{
+	double speed = 1;
+	int ch;
+	while ((ch = getopt(argc, argv, "hs:")) != -1) switch (ch){
+		case 's':
+			speed = atof(optarg);
+			if (speed < 0)
+				die("invalid speed\n");
+			break;
+		default:
+			die(USAGE);
+			break;
+	}
+	argc -= optind; argv += optind;
+
+	if (argc != 1)
+		die(USAGE);
+
+	PLAYER *p = openplayback(argv[0]);
+	if (!p)
+		die("could not open recording\n");
+
+	uint64_t rows[32], shown[32] = {0}, tick = 0;
+	double start = now();
+	int r;
+	initscreen();
+	while ((r = readframe(p, &tick, rows)) >= 0){
+		if (speed && !waituntil(&start, tick / (TICKS_PER_SECOND * speed)))
+			break;
+		if (!r)
+			break;
+		drawrows(rows, shown);
+	}
+	closeplayback(p);
+	if (r < 0)
+		die("damaged recording\n");
+
+	endwin();
+	return EXIT_SUCCESS;
+}
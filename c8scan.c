@@ -0,0 +1,265 @@
+/* Find where a ROM keeps its variables by comparing snapshots.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * Every address starts out a candidate, and each filter keeps only the
+ * addresses that pass it in every snapshot of the current range, so a
+ * few filters over snapshots taken between moves narrow 4K down to the
+ * score or the lives. The candidates are a byte mask over memory, and a
+ * filter goes sixteen addresses at a time where the host has SSE2,
+ * skipping those already ruled out and stopping on those ruled out as
+ * soon as they are.
+ */
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include "chip8.h"
+
+enum{
+	SCAN_CHANGED,   /* these four compare each snapshot with the one before */
+	SCAN_UNCHANGED,
+	SCAN_INCREASED,
+	SCAN_DECREASED,
+	SCAN_EQUAL,
+	SCAN_REGISTER
+};
+
+static uint8_t *mems;
+static uint8_t (*regs)[16];
+static size_t nsnaps, first, last;
+static alignas(16) uint8_t candidates[MEMORY_SIZE];
+
+static void
+die(const char *m)
+{
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+loadsnapshots(char **names, size_t n)
+{
+	CHIP8 *vm = calloc(1, sizeof(CHIP8));
+	mems = aligned_alloc(16, n * MEMORY_SIZE);
+	regs = malloc(n * sizeof(regs[0]));
+	if (!vm || !mems || !regs)
+		die("out of memory\n");
+
+	for (size_t s = 0; s < n; s++){
+		uint8_t buf[SNAPSHOT_SIZE];
+		FILE *f = fopen(names[s], "rb");
+		if (!f)
+			die("could not read snapshot\n");
+		bool ok = fread(buf, 1, SNAPSHOT_SIZE, f) == SNAPSHOT_SIZE && decodesnapshot(vm, buf);
+		fclose(f);
+		if (!ok){
+			fprintf(stderr, "%s: not a snapshot\n", names[s]);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(mems + s * MEMORY_SIZE, vm->mem, MEMORY_SIZE);
+		memcpy(regs[s], vm->v, 16);
+	}
+	releasemega(vm);
+	free(vm);
+	nsnaps = n;
+}
+
+#ifdef __SSE2__
+static __m128i
+pass16(int kind, __m128i prev, __m128i cur, __m128i want)
+{
+	__m128i bias = _mm_set1_epi8((char)0x80), same = _mm_cmpeq_epi8(prev, cur);
+	switch (kind){
+		case SCAN_CHANGED:   return _mm_xor_si128(same, _mm_set1_epi8(-1));
+		case SCAN_UNCHANGED: return same;
+		case SCAN_INCREASED: return _mm_cmpgt_epi8(_mm_xor_si128(cur, bias), _mm_xor_si128(prev, bias));
+		case SCAN_DECREASED: return _mm_cmpgt_epi8(_mm_xor_si128(prev, bias), _mm_xor_si128(cur, bias));
+		default:             return _mm_cmpeq_epi8(cur, want);
+	}
+}
+#else
+static bool
+pass(int kind, uint8_t prev, uint8_t cur, uint8_t want)
+{
+	switch (kind){
+		case SCAN_CHANGED:   return cur != prev;
+		case SCAN_UNCHANGED: return cur == prev;
+		case SCAN_INCREASED: return cur > prev;
+		case SCAN_DECREASED: return cur < prev;
+		default:             return cur == want;
+	}
+}
+#endif
+
+/* Applies a filter over the range; arg is the value for SCAN_EQUAL and
+ * the register for SCAN_REGISTER. Returns the candidates left.
+ */
+static size_t
+narrow(int kind, uint8_t arg)
+{
+	bool pairs = kind <= SCAN_DECREASED;
+	size_t from = pairs? first + 1 : first, count = 0;
+	for (size_t block = 0; block < MEMORY_SIZE; block += 16){
+		uint8_t *c = candidates + block;
+#ifdef __SSE2__
+		__m128i keep = _mm_load_si128((const __m128i *)c);
+		for (size_t s = from; s <= last && _mm_movemask_epi8(keep); s++){
+			const uint8_t *m = mems + s * MEMORY_SIZE + block;
+			__m128i cur = _mm_load_si128((const __m128i *)m);
+			__m128i prev = pairs? _mm_load_si128((const __m128i *)(m - MEMORY_SIZE)) : cur;
+			__m128i want = _mm_set1_epi8((char)(kind == SCAN_REGISTER? regs[s][arg] : arg));
+			keep = _mm_and_si128(keep, pass16(kind, prev, cur, want));
+		}
+		_mm_store_si128((__m128i *)c, keep);
+		count += __builtin_popcount(_mm_movemask_epi8(keep));
+#else
+		for (int k = 0; k < 16; k++){
+			for (size_t s = from; s <= last && c[k]; s++){
+				const uint8_t *m = mems + s * MEMORY_SIZE + block + k;
+				uint8_t want = kind == SCAN_REGISTER? regs[s][arg] : arg;
+				if (!pass(kind, pairs? m[-MEMORY_SIZE] : *m, *m, want))
+					c[k] = 0;
+			}
+			count += c[k] != 0;
+		}
+#endif
+	}
+	return count;
+}
+
+static size_t
+countcandidates(void)
+{
+	size_t count = 0;
+	for (int a = 0; a < MEMORY_SIZE; a++)
+		count += candidates[a] != 0;
+	return count;
+}
+
+static size_t
+list(long max)
+{
+	size_t shown = 0;
+	for (int a = 0; a < MEMORY_SIZE && (long)shown < max; a++){
+		if (!candidates[a])
+			continue;
+		printf("0x%03X:", a);
+		for (size_t s = first; s <= last && s < first + 16; s++)
+			printf(" %02X", mems[s * MEMORY_SIZE + a]);
+		puts(last - first >= 16? " ..." : "");
+		shown++;
+	}
+	return shown;
+}
+
+static bool
+parsebyte(const char *s, uint8_t *v)
+{
+	char *end;
+	long n = strtol(s, &end, 0);
+	if (!*s || *end || n < 0 || n > 255)
+		return false;
+	*v = n;
+	return true;
+}
+
+static int
+parsereg(const char *s)
+{
+	if ((s[0] != 'v' && s[0] != 'V') || !s[1] || s[2])
+		return -1;
+	char *end;
+	long r = strtol(s + 1, &end, 16);
+	return *end? -1 : r;
+}
+
+#define COMMANDS "commands:\n" \
+                 "    changed | unchanged      from each snapshot in the range to the next\n" \
+                 "    increased | decreased    likewise\n" \
+                 "    eq VALUE                 equal to a value in every snapshot in the range\n" \
+                 "    reg VX                   equal to a register in every snapshot in the range\n" \
+                 "    range FIRST LAST         the snapshots filters look at; all at first\n" \
+                 "    list [MAX]               candidates and their values over the range\n" \
+                 "    reset                    every address a candidate again\n"
+
+static void
+command(char *line)
+{
+	static const char *const names[] = {"changed", "unchanged", "increased", "decreased"};
+	char *words[4] = {0};
+	int nwords = 0, reg;
+	for (char *w = strtok(line, " \t\n"); w && nwords < 4; w = strtok(NULL, " \t\n"))
+		words[nwords++] = w;
+	if (!nwords)
+		return;
+
+	double start = now();
+	uint8_t value;
+	size_t left = 0;
+	int kind = -1;
+	for (int k = SCAN_CHANGED; k <= SCAN_DECREASED; k++){
+		if (strcmp(words[0], names[k]) == 0)
+			kind = k;
+	}
+	if (kind >= 0 && nwords == 1)
+		left = narrow(kind, 0);
+	else if (strcmp(words[0], "eq") == 0 && nwords == 2 && parsebyte(words[1], &value))
+		left = narrow(SCAN_EQUAL, value);
+	else if (strcmp(words[0], "reg") == 0 && nwords == 2 && (reg = parsereg(words[1])) >= 0)
+		left = narrow(SCAN_REGISTER, reg);
+	else if (strcmp(words[0], "range") == 0 && nwords == 3){
+		long a = atol(words[1]), b = atol(words[2]);
+		if (a < 0 || b < a || (size_t)b >= nsnaps){
+			fputs("invalid range\n", stderr);
+			return;
+		}
+		first = a;
+		last = b;
+		left = countcandidates();
+	} else if (strcmp(words[0], "list") == 0 && nwords <= 2){
+		list(nwords == 2? atol(words[1]) : 64);
+		left = countcandidates();
+	} else if (strcmp(words[0], "reset") == 0 && nwords == 1){
+		memset(candidates, 0xFF, sizeof(candidates));
+		left = MEMORY_SIZE;
+	} else{
+		fputs(COMMANDS, stderr);
+		return;
+	}
+	fflush(stdout);
+	fprintf(stderr, "%zu candidates in %.1fus\n", left, (now() - start) * 1e6);
+}
+
+#define USAGE "usage: c8scan SNAPSHOT...\n"
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		die(USAGE COMMANDS);
+
+	double start = now();
+	loadsnapshots(argv + 1, argc - 1);
+	memset(candidates, 0xFF, sizeof(candidates));
+	last = nsnaps - 1;
+	fprintf(stderr, "%zu snapshots loaded in %.3fs\n", nsnaps, now() - start);
+
+	char line[256];
+	while (fgets(line, sizeof(line), stdin))
+		command(line);
+	return EXIT_SUCCESS;
+}
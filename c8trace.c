@@ -0,0 +1,334 @@
+/* Answer questions about a CHIP-8 execution trace.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * The trace is mapped rather than read, and indexed in a single pass:
+ * for each register the records where it changed, for each address the
+ * records that wrote it, and for each address the records that executed
+ * it. Every list is in trace order, so a query is a binary search or a
+ * walk along one list rather than a scan of the whole trace.
+ */
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define REG_I 16
+#define REG_SP 17
+#define NREGS 18
+
+typedef struct LIST LIST;
+struct LIST{
+	uint64_t *at;
+	size_t n, cap;
+};
+
+typedef struct INDEX INDEX;
+struct INDEX{
+	const TRACEREC *recs;
+	size_t nrecs;
+	LIST changes[NREGS];
+	LIST writes[MEMORY_SIZE];
+	LIST visits[MEMORY_SIZE];
+};
+
+static void
+die(const char *m)
+{
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+push(LIST *l, uint64_t k)
+{
+	if (l->n == l->cap){
+		l->cap = l->cap? l->cap * 2 : 16;
+		if (!(l->at = realloc(l->at, l->cap * sizeof(uint64_t))))
+			die("out of memory\n");
+	}
+	l->at[l->n++] = k;
+}
+
+static unsigned
+regvalue(const TRACEREC *r, int reg)
+{
+	return reg < 16? r->v[reg] : reg == REG_I? r->i : r->sp;
+}
+
+static void
+buildindex(INDEX *ix, const TRACEREC *recs, size_t nrecs)
+{
+	ix->recs = recs;
+	ix->nrecs = nrecs;
+	for (size_t k = 0; k < nrecs; k++){
+		const TRACEREC *r = &recs[k];
+		push(&ix->visits[r->pc % MEMORY_SIZE], k);
+		for (int reg = 0; reg < NREGS; reg++){
+			if (k == 0 || regvalue(r, reg) != regvalue(r - 1, reg))
+				push(&ix->changes[reg], k);
+		}
+
+		/* FX33 and FX55 are the only writers, and leave I alone */
+		unsigned n = (r->inst & 0xF0FF) == 0xF033? 3 :
+		             (r->inst & 0xF0FF) == 0xF055? (r->inst >> 8 & 0xF) + 1u : 0;
+		for (unsigned a = 0; a < n; a++)
+			push(&ix->writes[(r->i + a) % MEMORY_SIZE], k);
+	}
+}
+
+/* The first record at or after the given cycle. */
+static size_t
+findcycle(const INDEX *ix, uint64_t cycle)
+{
+	size_t lo = 0, hi = ix->nrecs;
+	while (lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if (ix->recs[mid].cycle < cycle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* How many entries of the list come before the given record. */
+static size_t
+countbefore(const LIST *l, uint64_t k)
+{
+	size_t lo = 0, hi = l->n;
+	while (lo < hi){
+		size_t mid = lo + (hi - lo) / 2;
+		if (l->at[mid] < k)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void
+printrec(const TRACEREC *r)
+{
+	printf("cycle %lu frame %lu pc %03X %04X i %03X sp %u v",
+	       (unsigned long)r->cycle, (unsigned long)r->frame, r->pc, r->inst, r->i, r->sp);
+	for (int n = 0; n < 16; n++)
+		printf(" %02X", r->v[n]);
+	putchar('\n');
+}
+
+static bool
+parsenumber(const char *s, uint64_t *n)
+{
+	char *end;
+	if (!s || !isdigit((unsigned char)*s))
+		return false;
+	*n = strtoull(s, &end, 0);
+	return *end == 0;
+}
+
+static bool
+parseaddress(const char *s, uint64_t *n)
+{
+	return parsenumber(s, n) && *n < MEMORY_SIZE;
+}
+
+static int
+parsereg(const char *s)
+{
+	if (!s)
+		return -1;
+	if (strcasecmp(s, "I") == 0)
+		return REG_I;
+	if (strcasecmp(s, "SP") == 0)
+		return REG_SP;
+	if (toupper((unsigned char)s[0]) == 'V' && isxdigit((unsigned char)s[1]) && !s[2])
+		return (int)strtol(s + 1, NULL, 16);
+	return -1;
+}
+
+static bool
+compare(unsigned a, const char *op, uint64_t b)
+{
+	if (strcmp(op, "<") == 0) return a < b;
+	if (strcmp(op, "<=") == 0) return a <= b;
+	if (strcmp(op, ">") == 0) return a > b;
+	if (strcmp(op, ">=") == 0) return a >= b;
+	if (strcmp(op, "==") == 0 || strcmp(op, "=") == 0) return a == b;
+	return a != b;
+}
+
+static bool
+parsecompare(const char *op)
+{
+	static const char *ops[] = {"<", "<=", ">", ">=", "=", "==", "!=", NULL};
+	for (int n = 0; op && ops[n]; n++)
+		if (strcmp(op, ops[n]) == 0)
+			return true;
+	return false;
+}
+
+/* Print the records of a list that come before the given record, or
+ * only the last of them, and return how many were printed.
+ */
+static size_t
+printlist(const INDEX *ix, const LIST *l, uint64_t before, bool last)
+{
+	size_t n = countbefore(l, before);
+	size_t from = last && n? n - 1 : 0;
+	for (size_t k = from; k < n; k++)
+		printrec(&ix->recs[l->at[k]]);
+	return n - from;
+}
+
+/* Frames in which the register met the condition at some point, run
+ * together into ranges.
+ */
+static size_t
+printframes(const INDEX *ix, int reg, const char *op, uint64_t value)
+{
+	const LIST *l = &ix->changes[reg];
+	uint64_t from = 0, to = 0;
+	size_t count = 0;
+	bool open = false;
+	for (size_t k = 0; k < l->n; k++){
+		size_t end = k + 1 < l->n? l->at[k + 1] : ix->nrecs;
+		if (!compare(regvalue(&ix->recs[l->at[k]], reg), op, value))
+			continue;
+
+		uint64_t first = ix->recs[l->at[k]].frame, last = ix->recs[end - 1].frame;
+		if (open && first <= to + 1){
+			if (last > to){
+				count += last - to;
+				to = last;
+			}
+			continue;
+		}
+		if (open)
+			printf("frames %lu-%lu\n", (unsigned long)from, (unsigned long)to);
+		from = first;
+		to = last;
+		count += last - first + 1;
+		open = true;
+	}
+	if (open)
+		printf("frames %lu-%lu\n", (unsigned long)from, (unsigned long)to);
+	return count;
+}
+
+#define QUERIES "queries:\n" \
+                "    at CYCLE                  the record for a cycle\n" \
+                "    write ADDR [before CYCLE] writes to an address, or the last before a cycle\n" \
+                "    visits PC [before CYCLE]  executions of an address\n" \
+                "    changes REG               changes to V0-VF, I or SP\n" \
+                "    frames REG OP VALUE       frames where a register compares to a value\n"
+
+static void
+query(const INDEX *ix, char *line)
+{
+	char *words[8] = {0};
+	int nwords = 0;
+	for (char *w = strtok(line, " \t\n"); w && nwords < 8; w = strtok(NULL, " \t\n"))
+		words[nwords++] = w;
+	if (!nwords)
+		return;
+
+	double start = now();
+	uint64_t a, b = UINT64_MAX, before = ix->nrecs;
+	size_t found = 0;
+	int reg;
+	if (nwords == 4 && strcmp(words[2], "before") == 0){
+		if (!parsenumber(words[3], &b)){
+			fputs("invalid cycle\n", stderr);
+			return;
+		}
+		before = findcycle(ix, b);
+		nwords = 2;
+	}
+
+	if (strcmp(words[0], "at") == 0 && nwords == 2 && parsenumber(words[1], &a)){
+		size_t k = findcycle(ix, a);
+		if (k < ix->nrecs && ix->recs[k].cycle == a){
+			printrec(&ix->recs[k]);
+			found = 1;
+		}
+	} else if (strcmp(words[0], "write") == 0 && nwords == 2 && parseaddress(words[1], &a))
+		found = printlist(ix, &ix->writes[a], before, b != UINT64_MAX);
+	else if (strcmp(words[0], "visits") == 0 && nwords == 2 && parseaddress(words[1], &a))
+		found = printlist(ix, &ix->visits[a], before, false);
+	else if (strcmp(words[0], "changes") == 0 && nwords == 2 && (reg = parsereg(words[1])) >= 0)
+		found = printlist(ix, &ix->changes[reg], ix->nrecs, false);
+	else if (strcmp(words[0], "frames") == 0 && nwords == 4 && (reg = parsereg(words[1])) >= 0 &&
+	         parsecompare(words[2]) && parsenumber(words[3], &a))
+		found = printframes(ix, reg, words[2], a);
+	else{
+		fputs(QUERIES, stderr);
+		return;
+	}
+	fflush(stdout);
+	fprintf(stderr, "%zu found in %.3fms\n", found, (now() - start) * 1e3);
+}
+
+#define USAGE "usage: c8trace TRACE [QUERY]\n"
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		die(USAGE QUERIES);
+
+	int fd = open(argv[1], O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+		die("could not open trace\n");
+	if (st.st_size < TRACE_HEADER)
+		die("not a trace\n");
+
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		die("could not map trace\n");
+	if (memcmp(map, TRACE_MAGIC, TRACE_HEADER) != 0)
+		die("not a trace\n");
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	/* a trace cut short by a crash is still good up to its last record */
+	size_t nrecs = (st.st_size - TRACE_HEADER) / sizeof(TRACEREC);
+	static INDEX ix;
+	double start = now();
+	buildindex(&ix, (const TRACEREC *)(map + TRACE_HEADER), nrecs);
+	madvise(map, st.st_size, MADV_RANDOM);
+	fprintf(stderr, "%zu records indexed in %.3fs\n", nrecs, now() - start);
+
+	char line[256];
+	if (argc > 2){
+		line[0] = 0;
+		for (int n = 2; n < argc; n++){
+			strncat(line, argv[n], sizeof(line) - strlen(line) - 2);
+			strcat(line, " ");
+		}
+		query(&ix, line);
+	} else{
+		while (fgets(line, sizeof(line), stdin))
+			query(&ix, line);
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
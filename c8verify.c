@@ -0,0 +1,722 @@
+/* Check every CHIP-8 opcode against every engine.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * Each of the 65536 opcodes is run on a number of random machine
+ * states by every engine and by a reference model written here from
+ * the description of the instruction set rather than from core.c, and
+ * the resulting states are compared. The reference leaves out what the
+ * instruction set does not say, the random number generator and the
+ * dirty bits kept for the host; the engines are held to each other on
+ * those instead. The opcode is followed by a jump to itself so that the
+ * compiling engines get a block of two to work on. Some of the states
+ * for the instructions that MegaChip mode changes are in MegaChip mode,
+ * and some are only being observed.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chip8.h"
+
+#define CHUNK 256
+#define XMEM_SIZE 0x30000
+
+static int nstates = 16, only = -1;
+static long limit = 100;
+static atomic_int nextop;
+static atomic_long mismatches;
+static pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t ximage[XMEM_SIZE];
+static _Thread_local bool rolled;  /* the reference ran a CXNN */
+
+static void
+die(const char *m)
+{
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static uint64_t
+xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void
+refdraw(CHIP8 *vm, uint8_t x, uint8_t y, uint8_t n)
+{
+	uint8_t col0 = vm->v[x] % 64, row0 = vm->v[y] % 32;
+	vm->v[0xF] = 0;
+	for (int r = 0; r < n && row0 + r < 32 && vm->i + r < MEMORY_SIZE; r++){
+		uint8_t bits = vm->mem[vm->i + r];
+		for (int c = 0; c < 8 && col0 + c < 64; c++){
+			if (!(bits >> (7 - c) & 1))
+				continue;
+			uint64_t bit = 1ULL << (63 - (col0 + c));
+			if (vm->display[row0 + r] & bit)
+				vm->v[0xF] = 1;
+			vm->display[row0 + r] ^= bit;
+			if (!vm->observing)
+				vm->event = EVENT_DRAW;
+		}
+	}
+}
+
+static uint8_t
+refread(const CHIP8 *vm, uint32_t a)
+{
+	if (a < MEMORY_SIZE)
+		return vm->mem[a];
+	return a < vm->xsize? vm->xmem[a] : 0;
+}
+
+static void
+refcolor(CHIP8 *vm)
+{
+	MEGACHIP *m = vm->mega;
+	if (m->truecolor)
+		return;
+	m->truecolor = true;
+	for (int y = 0; y < MEGA_HEIGHT; y++)
+		for (int x = 0; x < MEGA_WIDTH; x++)
+			m->color[y][x] = m->palette[m->index[y][x]];
+}
+
+static void
+refclear(CHIP8 *vm)
+{
+	MEGACHIP *m = vm->mega;
+	if (!m->shown)
+		return;
+	m->shown = false;
+	m->truecolor = false;
+	for (int y = 0; y < MEGA_HEIGHT; y++)
+		for (int x = 0; x < MEGA_WIDTH; x++)
+			m->index[y][x] = 0;
+}
+
+static uint32_t
+refblend(int mode, uint32_t src, uint32_t dst)
+{
+	uint8_t s[3] = {src >> 16, src >> 8, src}, d[3] = {dst >> 16, dst >> 8, dst}, o[3];
+	for (int c = 0; c < 3; c++){
+		int v = mode == BLEND_25? (s[c] + 3 * d[c]) / 4 :
+		        mode == BLEND_50? (s[c] + d[c]) / 2 :
+		        mode == BLEND_75? (3 * s[c] + d[c]) / 4 :
+		        mode == BLEND_ADD? s[c] + d[c] :
+		        s[c] * d[c] / 255;
+		o[c] = v > 255? 255 : v;
+	}
+	return 0xFF000000u | (uint32_t)o[0] << 16 | o[1] << 8 | o[2];
+}
+
+static void
+refmegadraw(CHIP8 *vm, uint8_t x, uint8_t y)
+{
+	MEGACHIP *m = vm->mega;
+	uint32_t base = (uint32_t)vm->ihigh << 16 | vm->i;
+	uint8_t col0 = vm->v[x], row0 = vm->v[y], hit = 0;
+	refclear(vm);
+	if (m->blend)
+		refcolor(vm);
+	for (int r = 0; r < m->height && row0 + r < MEGA_HEIGHT; r++){
+		for (int c = 0; c < m->width && col0 + c < MEGA_WIDTH; c++){
+			uint8_t p = refread(vm, base + r * m->width + c);
+			if (!p)
+				continue;
+			if (m->index[row0 + r][col0 + c] == m->collide)
+				hit = 1;
+			m->index[row0 + r][col0 + c] = p;
+			uint32_t *q = &m->color[row0 + r][col0 + c];
+			if (m->truecolor)
+				*q = m->blend? refblend(m->blend, m->palette[p], *q) : m->palette[p];
+		}
+	}
+	vm->v[0xF] = hit;
+}
+
+static void
+refscroll(CHIP8 *vm, int down)
+{
+	MEGACHIP *m = vm->mega;
+	static _Thread_local uint8_t index[MEGA_HEIGHT][MEGA_WIDTH];
+	static _Thread_local uint32_t color[MEGA_HEIGHT][MEGA_WIDTH];
+	refclear(vm);
+	for (int y = 0; y < MEGA_HEIGHT; y++){
+		for (int x = 0; x < MEGA_WIDTH; x++){
+			int from = y - down;
+			bool in = from >= 0 && from < MEGA_HEIGHT;
+			index[y][x] = in? m->index[from][x] : 0;
+			color[y][x] = in? m->color[from][x] : m->palette[0];
+		}
+	}
+	memcpy(m->index, index, sizeof(index));
+	if (m->truecolor)
+		memcpy(m->color, color, sizeof(color));
+}
+
+static void
+refmega(CHIP8 *vm, uint16_t op)
+{
+	MEGACHIP *m = vm->mega;
+	uint8_t nn = op & 0xFF;
+	if (op == 0x0011){
+		if (!m && !(m = vm->mega = malloc(sizeof(*m))))
+			die("out of memory\n");
+		memset(m, 0, sizeof(*m));
+		m->shown = true;
+		vm->megachip = true;
+		vm->event = EVENT_DRAW;
+		return;
+	}
+	if (!vm->megachip){
+		vm->event = EVENT_FAULT;
+		return;
+	}
+	if (op == 0x0010){
+		releasemega(vm);
+		vm->megachip = false;
+		vm->ihigh = 0;
+		vm->event = EVENT_DRAW;
+	} else if ((op & 0xFFF0) == 0x00B0)
+		refscroll(vm, -(op & 0xF));
+	else if ((op & 0xFFF0) == 0x00C0)
+		refscroll(vm, op & 0xF);
+	else if (op >> 8 == 0x01){
+		vm->ihigh = nn;
+		vm->i = vm->mem[vm->pc % MEMORY_SIZE] << 8 | vm->mem[(vm->pc + 1) % MEMORY_SIZE];
+		vm->pc += 2;
+	} else if (op >> 8 == 0x02){
+		uint32_t base = (uint32_t)vm->ihigh << 16 | vm->i;
+		if (!m->shown)
+			refcolor(vm);
+		for (int c = 0; c < nn; c++){
+			uint32_t a = base + 4 * c;
+			m->palette[c + 1] = (uint32_t)refread(vm, a) << 24 | (uint32_t)refread(vm, a + 1) << 16 |
+			                    refread(vm, a + 2) << 8 | refread(vm, a + 3);
+		}
+	} else if (op >> 8 == 0x03)
+		m->width = nn? nn : 256;
+	else if (op >> 8 == 0x04)
+		m->height = nn? nn : 256;
+	else if (op >> 8 == 0x05)
+		m->alpha = nn;
+	else if (op == 0x0600 || op == 0x0601 || op == 0x0700)
+		;
+	else if (op >> 8 == 0x08 && nn <= BLEND_MULTIPLY)
+		m->blend = nn;
+	else if (op >> 8 == 0x09)
+		m->collide = nn;
+	else
+		vm->event = EVENT_FAULT;
+}
+
+/* One instruction, the plain way. */
+static void
+refstep(CHIP8 *vm)
+{
+	uint16_t op = vm->mem[vm->pc % MEMORY_SIZE] << 8 | vm->mem[(vm->pc + 1) % MEMORY_SIZE];
+	uint8_t x = op >> 8 & 0xF, y = op >> 4 & 0xF, n = op & 0xF, nn = op & 0xFF;
+	uint16_t nnn = op & 0xFFF;
+	uint8_t *v = vm->v, flag;
+	vm->pc += 2;
+
+	switch (op >> 12){
+		case 0x0:
+			if (op == 0x00E0){
+				if (vm->megachip)
+					vm->mega->shown = true;
+				else
+					memset(vm->display, 0, sizeof(vm->display));
+				if (!vm->observing)
+					vm->event = EVENT_DRAW;
+			} else if (op == 0x00EE){
+				if (vm->sp)
+					vm->pc = vm->stack[--vm->sp];
+				else
+					vm->event = EVENT_FAULT;
+			} else
+				refmega(vm, op);
+			return;
+		case 0x1: vm->pc = nnn; return;
+		case 0x2:
+			if (vm->sp >= STACK_SIZE){
+				vm->event = EVENT_FAULT;
+				return;
+			}
+			vm->stack[vm->sp++] = vm->pc;
+			vm->pc = nnn;
+			return;
+		case 0x3: if (v[x] == nn) vm->pc += 2; return;
+		case 0x4: if (v[x] != nn) vm->pc += 2; return;
+		case 0x5:
+			if (n)
+				vm->event = EVENT_FAULT;
+			else if (v[x] == v[y])
+				vm->pc += 2;
+			return;
+		case 0x6: v[x] = nn; return;
+		case 0x7: v[x] += nn; return;
+		case 0x8:
+			switch (n){
+				case 0x0: v[x] = v[y]; return;
+				case 0x1: v[x] |= v[y]; return;
+				case 0x2: v[x] &= v[y]; return;
+				case 0x3: v[x] ^= v[y]; return;
+				case 0x4: flag = v[x] + v[y] > 255; v[x] += v[y]; v[0xF] = flag; return;
+				case 0x5: flag = v[x] >= v[y]; v[x] -= v[y]; v[0xF] = flag; return;
+				case 0x6: flag = v[x] & 1; v[x] >>= 1; v[0xF] = flag; return;
+				case 0x7: flag = v[y] >= v[x]; v[x] = v[y] - v[x]; v[0xF] = flag; return;
+				case 0xE: flag = v[x] >> 7; v[x] <<= 1; v[0xF] = flag; return;
+			}
+			vm->event = EVENT_FAULT;
+			return;
+		case 0x9:
+			if (n)
+				vm->event = EVENT_FAULT;
+			else if (v[x] != v[y])
+				vm->pc += 2;
+			return;
+		case 0xA: vm->i = nnn; vm->ihigh = 0; return;
+		case 0xB: vm->pc = nnn + v[0]; return;
+		case 0xC: v[x] = nn; rolled = true; return;
+		case 0xD:
+			if (vm->megachip)
+				refmegadraw(vm, x, y);
+			else
+				refdraw(vm, x, y, n);
+			return;
+		case 0xE:
+			if (nn == 0x9E || nn == 0xA1){
+				bool down = v[x] < 16 && (vm->keys >> v[x] & 1);
+				if (down == (nn == 0x9E))
+					vm->pc += 2;
+				return;
+			}
+			vm->event = EVENT_FAULT;
+			return;
+		case 0xF:
+			switch (nn){
+				case 0x07: v[x] = vm->delay; return;
+				case 0x0A:
+					vm->pc -= 2;
+					vm->waiting = true;
+					vm->waitreg = x;
+					vm->event = EVENT_KEYWAIT;
+					return;
+				case 0x15: vm->delay = v[x]; return;
+				case 0x18:
+					if ((vm->sound == 0) != (v[x] == 0))
+						vm->event = EVENT_SOUND;
+					vm->sound = v[x];
+					return;
+				case 0x1E:
+					flag = vm->i + v[x] > 0xFFF;
+					if (vm->megachip && vm->i + v[x] > 0xFFFF)
+						vm->ihigh++;
+					vm->i += v[x];
+					v[0xF] = flag;
+					return;
+				case 0x29: vm->i = v[x] * 5; vm->ihigh = 0; return;
+				case 0x33:
+					vm->mem[vm->i % MEMORY_SIZE] = v[x] / 100;
+					vm->mem[(vm->i + 1) % MEMORY_SIZE] = v[x] / 10 % 10;
+					vm->mem[(vm->i + 2) % MEMORY_SIZE] = v[x] % 10;
+					return;
+				case 0x55:
+					for (int r = 0; r <= x; r++)
+						vm->mem[(vm->i + r) % MEMORY_SIZE] = v[r];
+					return;
+				case 0x65:
+					for (int r = 0; r <= x; r++)
+						v[r] = vm->mem[(vm->i + r) % MEMORY_SIZE];
+					return;
+			}
+			vm->event = EVENT_FAULT;
+			return;
+	}
+}
+
+static int
+refrun(CHIP8 *vm, uint64_t budget)
+{
+	if (vm->waiting)
+		return EVENT_KEYWAIT;
+	vm->event = EVENT_NONE;
+	while (budget--){
+		uint16_t pc = vm->pc;
+		refstep(vm);
+		if (vm->event == EVENT_FAULT){
+			vm->pc = pc;
+			vm->fault = "invalid instruction";
+			return EVENT_FAULT;
+		}
+		vm->cycles++;
+		if (vm->event)
+			return vm->event;
+	}
+	return EVENT_BUDGET;
+}
+
+static void
+copy(CHIP8 *to, const CHIP8 *from)
+{
+	if (!copymachine(to, from))
+		die("out of memory\n");
+}
+
+static void
+randommega(CHIP8 *vm, uint64_t *s)
+{
+	MEGACHIP *m = vm->mega = malloc(sizeof(*vm->mega));
+	uint64_t r = xorshift(s);
+	if (!m)
+		die("out of memory\n");
+	vm->megachip = true;
+	vm->ihigh = r % 4;
+	if (r >> 58 & 1)
+		vm->i |= 0xFF00;   /* for FX1E to carry */
+	m->width = r >> 8 & 1? 1 + (r >> 16) % 40 : (r >> 16) % 257;
+	m->height = r >> 9 & 1? 1 + (r >> 24) % 40 : (r >> 24) % 257;
+	m->blend = (r >> 32) % 6;
+	m->collide = (r >> 40) % 4;
+	m->alpha = r >> 48;
+	m->shown = r >> 56 & 1;
+	m->truecolor = r >> 57 & 1 || m->blend;
+	for (int c = 0; c < 256; c++)
+		m->palette[c] = xorshift(s);
+
+	/* sparse and few colors, so that sprites do collide */
+	for (int y = 0; y < MEGA_HEIGHT; y++){
+		for (int x = 0; x < MEGA_WIDTH; x += 8){
+			uint64_t p = xorshift(s);
+			for (int b = 0; b < 8; b++)
+				m->index[y][x + b] = (p >> (8 * b) & 0xFF) < 160? 0 : p >> (8 * b) & 3;
+		}
+	}
+	for (int y = 0; y < MEGA_HEIGHT; y++)
+		for (int x = 0; x < MEGA_WIDTH; x++)
+			m->color[y][x] = m->truecolor? (uint32_t)xorshift(s) : m->palette[m->index[y][x]];
+}
+
+/* A random machine, reproducible from the opcode and state number. */
+static void
+randomstate(CHIP8 *vm, uint16_t op, int k)
+{
+	uint64_t s = (uint64_t)op << 32 | (uint32_t)k | 1ULL << 63;
+	for (int i = 0; i < 8; i++)
+		xorshift(&s);
+
+	releasemega(vm);
+	memset(vm, 0, sizeof(*vm));
+	vm->xmem = ximage;
+	vm->xsize = XMEM_SIZE;
+	for (size_t a = 0; a < MEMORY_SIZE; a += 8){
+		uint64_t r = xorshift(&s);
+		memcpy(vm->mem + a, &r, 8);
+	}
+	for (int row = 0; row < 32; row++)
+		vm->display[row] = xorshift(&s);
+	for (int i = 0; i < 16; i++)
+		vm->v[i] = xorshift(&s);
+	for (int i = 0; i < STACK_SIZE; i++)
+		vm->stack[i] = xorshift(&s) % MEMORY_SIZE;
+
+	uint64_t r = xorshift(&s);
+	vm->sp = r % (STACK_SIZE + 1);
+	vm->i = (r >> 8) % MEMORY_SIZE;
+	vm->delay = r >> 20;
+	vm->sound = r & 1ULL << 28? r >> 32 : 0;
+	vm->keys = r >> 40;
+	vm->seed = xorshift(&s);
+	vm->pc = xorshift(&s) % (MEMORY_SIZE - 3);
+
+	/* small values of the registers and I find the edge cases */
+	if (k % 4 == 1)
+		for (int i = 0; i < 16; i++)
+			vm->v[i] %= 18;
+	if (k % 4 == 2)
+		vm->i = MEMORY_SIZE - 1 - r % 8;
+	if (k % 8 == 5)
+		vm->observing = true;
+	if (k % 8 == 7 && (op >> 12 == 0x0 || op >> 12 == 0xA || op >> 12 == 0xD || op >> 12 == 0xF))
+		randommega(vm, &s);
+
+	uint16_t self = (vm->pc + 2) | 0x1000;
+	vm->mem[vm->pc] = op >> 8;
+	vm->mem[vm->pc + 1] = op & 0xFF;
+	vm->mem[vm->pc + 2] = self >> 8;
+	vm->mem[vm->pc + 3] = self & 0xFF;
+}
+
+#define DIFF(field, fmt) \
+	if (a->field != b->field && n < len) \
+		n += snprintf(buf + n, len - n, " " #field " " fmt "/" fmt, a->field, b->field);
+
+/* With all, the seed and the dirty bits too. */
+static void
+describe(const CHIP8 *a, const CHIP8 *b, bool all, char *buf, size_t len)
+{
+	size_t n = 0;
+	buf[0] = 0;
+	DIFF(pc, "%03X") DIFF(i, "%03X") DIFF(sp, "%u")
+	DIFF(delay, "%u") DIFF(sound, "%u")
+	DIFF(waiting, "%d") DIFF(waitreg, "%u")
+	DIFF(event, "%d") DIFF(cycles, "%lu")
+	if (all){
+		DIFF(seed, "%08X") DIFF(dirty, "%d")
+		DIFF(dirtypages, "%016lX") DIFF(dirtyrows, "%08X")
+	}
+	for (int r = 0; r < 16; r++){
+		if (a->v[r] != b->v[r] && n < len)
+			n += snprintf(buf + n, len - n, " v%X %02X/%02X", r, a->v[r], b->v[r]);
+	}
+	for (int r = 0; r < STACK_SIZE; r++){
+		if (a->stack[r] != b->stack[r] && n < len)
+			n += snprintf(buf + n, len - n, " stack[%d] %03X/%03X", r, a->stack[r], b->stack[r]);
+	}
+	for (int m = 0, shown = 0; m < MEMORY_SIZE && shown < 4; m++){
+		if (a->mem[m] != b->mem[m] && n < len){
+			n += snprintf(buf + n, len - n, " mem[%03X] %02X/%02X", m, a->mem[m], b->mem[m]);
+			shown++;
+		}
+	}
+	if (memcmp(a->display, b->display, sizeof(a->display)) != 0 && n < len)
+		n += snprintf(buf + n, len - n, " display");
+	DIFF(megachip, "%d") DIFF(ihigh, "%02X")
+	if (a->megachip && b->megachip){
+		DIFF(mega->width, "%u") DIFF(mega->height, "%u") DIFF(mega->blend, "%u")
+		DIFF(mega->collide, "%u") DIFF(mega->alpha, "%u") DIFF(mega->shown, "%d")
+		DIFF(mega->truecolor, "%d")
+		for (int r = 0; all && r < MEGA_HEIGHT / 64; r++){
+			if (a->dirtymega[r] != b->dirtymega[r] && n < len)
+				n += snprintf(buf + n, len - n, " dirtymega[%d] %016lX/%016lX", r, a->dirtymega[r], b->dirtymega[r]);
+		}
+		if (memcmp(a->mega->palette, b->mega->palette, sizeof(a->mega->palette)) != 0 && n < len)
+			n += snprintf(buf + n, len - n, " mega.palette");
+		for (int p = 0; p < MEGA_HEIGHT * MEGA_WIDTH; p++){
+			int y = p / MEGA_WIDTH, x = p % MEGA_WIDTH;
+			if (a->mega->index[y][x] != b->mega->index[y][x] && n < len){
+				n += snprintf(buf + n, len - n, " mega.index[%d][%d] %u/%u", y, x, a->mega->index[y][x], b->mega->index[y][x]);
+				break;
+			}
+		}
+		for (int p = 0; a->mega->truecolor && p < MEGA_HEIGHT * MEGA_WIDTH; p++){
+			int y = p / MEGA_WIDTH, x = p % MEGA_WIDTH;
+			if (a->mega->color[y][x] != b->mega->color[y][x] && n < len){
+				n += snprintf(buf + n, len - n, " mega.color[%d][%d] %08X/%08X", y, x, a->mega->color[y][x], b->mega->color[y][x]);
+				break;
+			}
+		}
+	}
+	if (!!a->fault != !!b->fault && n < len)
+		snprintf(buf + n, len - n, " fault %s/%s", a->fault? a->fault : "-", b->fault? b->fault : "-");
+}
+
+static bool
+samemega(const MEGACHIP *a, const MEGACHIP *b)
+{
+	return a->width == b->width && a->height == b->height && a->blend == b->blend &&
+	       a->collide == b->collide && a->alpha == b->alpha && a->shown == b->shown &&
+	       a->truecolor == b->truecolor &&
+	       memcmp(a->palette, b->palette, sizeof(a->palette)) == 0 &&
+	       memcmp(a->index, b->index, sizeof(a->index)) == 0 &&
+	       (!a->truecolor || memcmp(a->color, b->color, sizeof(a->color)) == 0);
+}
+
+/* The machine as the instruction set describes it. */
+static bool
+samestate(const CHIP8 *a, const CHIP8 *b)
+{
+	return a->pc == b->pc && a->i == b->i && a->sp == b->sp && a->delay == b->delay &&
+	       a->sound == b->sound && a->waiting == b->waiting &&
+	       a->waitreg == b->waitreg && a->event == b->event &&
+	       a->cycles == b->cycles && a->keys == b->keys && !!a->fault == !!b->fault &&
+	       memcmp(a->v, b->v, sizeof(a->v)) == 0 &&
+	       memcmp(a->stack, b->stack, sizeof(a->stack)) == 0 &&
+	       memcmp(a->mem, b->mem, sizeof(a->mem)) == 0 &&
+	       memcmp(a->display, b->display, sizeof(a->display)) == 0 &&
+	       a->megachip == b->megachip && a->ihigh == b->ihigh && (!a->megachip || samemega(a->mega, b->mega));
+}
+
+/* And what only the host keeps: the seed behind CXNN and the dirty bits. */
+static bool
+same(const CHIP8 *a, const CHIP8 *b)
+{
+	return samestate(a, b) && a->seed == b->seed && a->dirty == b->dirty &&
+	       a->dirtypages == b->dirtypages && a->dirtyrows == b->dirtyrows &&
+	       memcmp(a->dirtymega, b->dirtymega, sizeof(a->dirtymega)) == 0;
+}
+
+/* Whether the dirty bits name every page, display row and MegaChip row
+ * that now differs from start. Rows that are only observed are not kept.
+ */
+static bool
+covered(const CHIP8 *start, const CHIP8 *vm)
+{
+	for (int p = 0; p < MEMORY_SIZE / PAGE_SIZE; p++)
+		if (!(vm->dirtypages >> p & 1) && memcmp(vm->mem + p * PAGE_SIZE, start->mem + p * PAGE_SIZE, PAGE_SIZE) != 0)
+			return false;
+	for (int y = 0; y < 32 && !vm->observing; y++)
+		if (vm->display[y] != start->display[y] && (!vm->dirty || !(vm->dirtyrows >> y & 1)))
+			return false;
+	if (!start->megachip || !vm->megachip)
+		return true;
+	const MEGACHIP *a = start->mega, *b = vm->mega;
+	bool colors = a->truecolor && b->truecolor;
+	for (int y = 0; y < MEGA_HEIGHT; y++)
+		if (!(vm->dirtymega[y / 64] >> (y % 64) & 1) &&
+		    (memcmp(a->index[y], b->index[y], sizeof(a->index[y])) != 0 ||
+		     (colors && memcmp(a->color[y], b->color[y], sizeof(a->color[y])) != 0)))
+			return false;
+	return true;
+}
+
+static void
+report(uint16_t op, int k, const CHIP8 *start, const char *fmt, ...)
+{
+	if (atomic_fetch_add(&mismatches, 1) >= limit)
+		return;
+	va_list ap;
+	va_start(ap, fmt);
+	pthread_mutex_lock(&outlock);
+	printf("%04X state %d pc %03X i %03X: ", op, k, start->pc, start->i);
+	vprintf(fmt, ap);
+	pthread_mutex_unlock(&outlock);
+	va_end(ap);
+}
+
+/* Each engine must agree with the reference and cover its changes with
+ * its dirty bits, and every engine after the first must also match the
+ * first exactly, seed and dirty bits included. All the reference knows
+ * of CXNN is which bits NN lets through, which is checked when it is the
+ * opcode; when a jump lands on one, only the engines are compared.
+ */
+static void
+verify(uint16_t op, CHIP8 *vms)
+{
+	CHIP8 *start = &vms[0], *ref = &vms[1], *first = &vms[2];
+	uint8_t x = op >> 8 & 0xF, nn = op & 0xFF;
+	char buf[512];
+	for (int k = 0; k < nstates; k++){
+		randomstate(start, op, k);
+		copy(ref, start);
+		rolled = false;
+		int want = refrun(ref, 2), firstgot = 0;
+		bool known = !rolled || op >> 12 == 0xC;
+
+		for (int e = 0; e < NENGINES; e++){
+			CHIP8 *vm = e? &vms[3] : first;
+			copy(vm, start);
+			vm->engine = e;
+			int got = rununtil(vm, 2);
+
+			if (op >> 12 == 0xC && !(vm->v[x] & ~nn))
+				ref->v[x] = vm->v[x];
+			if (known && (got != want || !samestate(vm, ref))){
+				describe(vm, ref, false, buf, sizeof(buf));
+				report(op, k, start, "%s returned %d, reference %d;%s\n", enginenames[e], got, want, buf);
+				return;
+			}
+			if (!covered(start, vm)){
+				report(op, k, start, "%s left a change out of its dirty bits\n", enginenames[e]);
+				return;
+			}
+			if (!e)
+				firstgot = got;
+			else if (got != firstgot || !same(vm, first)){
+				describe(vm, first, true, buf, sizeof(buf));
+				report(op, k, start, "%s returned %d, %s %d;%s\n", enginenames[e], got, enginenames[0], firstgot, buf);
+				return;
+			}
+		}
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	CHIP8 *vms = calloc(4, sizeof(CHIP8));
+	(void)arg;
+	if (!vms)
+		die("out of memory\n");
+	for (;;){
+		int base = atomic_fetch_add(&nextop, CHUNK);
+		if (base > 0xFFFF)
+			break;
+		for (int op = base; op < base + CHUNK; op++){
+			if (only < 0 || op == only)
+				verify(op, vms);
+		}
+	}
+	for (int k = 0; k < 4; k++)
+		releasemega(&vms[k]);
+	free(vms);
+	releasecode();
+	return NULL;
+}
+
+#define USAGE "usage: c8verify [-j THREADS] [-m MAXREPORTS] [-n STATES] [-o OPCODE]\n"
+int
+main(int argc, char **argv)
+{
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	int ch;
+	while ((ch = getopt(argc, argv, "hj:m:n:o:")) != -1) switch (ch){
+		case 'j':
+			if ((nthreads = atol(optarg)) <= 0)
+				die("invalid thread count\n");
+			break;
+		case 'm':
+			limit = atol(optarg);
+			break;
+		case 'n':
+			if ((nstates = atoi(optarg)) <= 0)
+				die("invalid state count\n");
+			break;
+		case 'o':
+			only = (int)strtol(optarg, NULL, 16) & 0xFFFF;
+			break;
+		default:
+			die(USAGE);
+			break;
+	}
+	if (optind != argc)
+		die(USAGE);
+	if (nthreads < 1)
+		nthreads = 1;
+	for (size_t a = 0; a < XMEM_SIZE; a++)
+		ximage[a] = xorshift(&seed);
+
+	struct timespec start, end;
+	pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+	if (!threads)
+		die("out of memory\n");
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long t = 0; t < nthreads; t++){
+		if (pthread_create(&threads[t], NULL, worker, NULL) != 0)
+			die("could not start thread\n");
+	}
+	for (long t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	long bad = atomic_load(&mismatches);
+	printf("%d opcodes x %d states x %d engines on %ld threads: %ld mismatched in %.2fs\n",
+	       only < 0? 65536 : 1, nstates, NENGINES, nthreads, bad,
+	       (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	free(threads);
+	return bad? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,978 @@
+/* The most instructions a ROM can run between frames.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * A ROM keeps to its frames by waiting: for a key with FX0A, or in a
+ * loop that polls the delay timer or the keys and does nothing else.
+ * Those waits are its sync points. Between two of them it has to get
+ * its work done within the instructions per tick it is run at, or a
+ * frame goes by with the work half done. This finds, over the control
+ * flow graph (see cfg.c), the longest run of instructions from a sync
+ * point, or the start, to the next sync point, and prints the path it
+ * takes: that is the speed the ROM needs never to drop a frame.
+ *
+ * Subroutines are summed up once, callees first, by their longest run
+ * from entry to return, to a sync point and from a sync point to return,
+ * so a subroutine called from two places costs each its own; recursion
+ * has no bound. Loops are folded innermost first into their header. A
+ * loop is bounded by a counter: a register that only one 7XNN in the
+ * loop changes, tested by a skip that leaves the loop, with both on every
+ * way around; its start comes from the constants known on the way in,
+ * and if it is not known every start is tried. Loops with no such
+ * counter, or with more than one way in, have no bound and are listed,
+ * as they can stall a frame for ever. MegaChip ROMs are not analyzed,
+ * and BNNN ends a run, as where it goes is not known.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cfg.h"
+#include "chip8.h"
+
+#define LOAD_ADDR 512
+#define MAX_ROM (MEMORY_SIZE - LOAD_ADDR)
+#define MAX_UNBOUNDED 64
+
+#define NONE (-1)
+#define INF (INT64_MAX / 4)
+
+#define A(inst) ((inst) >> 12)
+#define X(inst) ((inst) >> 8 & 0xF)
+#define Y(inst) ((inst) >> 4 & 0xF)
+#define NN(inst) ((inst) & 0xFF)
+#define NNN(inst) ((inst) & 0xFFF)
+
+typedef int64_t COST;
+
+/* How a run ends. */
+enum{
+	END_RETURN, /* 00EE, back to a caller */
+	END_SYNC,   /* at a sync point */
+	END_STOP,   /* by faulting, at BNNN, returning from the ROM itself, or
+	             * never, in a loop with no way out */
+	NENDS
+};
+
+enum{
+	SYNC_NONE,
+	SYNC_TIMER,
+	SYNC_KEY,
+	SYNC_HALT
+};
+
+static const char *syncnames[] = {
+	"", "waits on the delay timer", "waits for a key", "loops doing nothing"
+};
+
+typedef struct EDGE EDGE;
+struct EDGE{
+	uint16_t to;
+	COST w;
+};
+
+/* An instruction, or a loop folded into its header. A run that reaches
+ * it can go on along its edges, each costing w, or end there at the
+ * cost in ends[]. base is what a run starting here has already spent.
+ */
+typedef struct NODE NODE;
+struct NODE{
+	EDGE *edges;
+	int nedges, capacity;
+	COST ends[NENDS];
+	bool member, merged, start;
+	COST base;
+
+	bool loop;
+	unsigned bound;         /* 0 if it has none */
+	COST each;
+
+	bool solved;
+	COST best[NENDS];
+	int next[NENDS];        /* the edge best[] takes, or -1 to end here */
+};
+
+/* What a subroutine costs the runs through it. */
+typedef struct FUNC FUNC;
+struct FUNC{
+	bool visited, recursive;
+	uint16_t *callees;
+	int ncallees;
+	uint32_t writes;
+	COST through, tosync, tostop, fromsync, inner;
+	uint16_t worst;         /* where inner starts */
+};
+
+typedef struct UNBOUNDED UNBOUNDED;
+struct UNBOUNDED{
+	uint16_t pc;
+	const char *what, *why;
+};
+
+static uint8_t mem[MEMORY_SIZE];
+static CFG g;
+static REGS in[MEMORY_SIZE];
+static bool seen[MEMORY_SIZE];
+static uint8_t syncs[MEMORY_SIZE];
+static FUNC funcs[MEMORY_SIZE];
+static uint16_t order[MEMORY_SIZE];
+static int norder;
+static NODE nodes[MEMORY_SIZE];
+static uint16_t rep[MEMORY_SIZE];
+static UNBOUNDED unbounded[MAX_UNBOUNDED];
+static int nunbounded;
+static bool indirect;
+
+static void
+die(const char *m)
+{
+	fputs(m, stderr);
+	exit(EXIT_FAILURE);
+}
+
+static COST
+plus(COST a, COST b)
+{
+	if (a == NONE || b == NONE)
+		return NONE;
+	return a >= INF || b >= INF || a + b >= INF? INF : a + b;
+}
+
+static COST
+most(COST a, COST b)
+{
+	return a > b? a : b;
+}
+
+static void
+report(uint16_t pc, const char *what, const char *why)
+{
+	for (int k = 0; k < nunbounded; k++)
+		if (unbounded[k].pc == pc)
+			return;
+	if (nunbounded < MAX_UNBOUNDED)
+		unbounded[nunbounded++] = (UNBOUNDED){pc, what, why};
+}
+
+/* Where pc goes next without leaving its subroutine: a call goes on to
+ * the instruction after it.
+ */
+static int
+within(uint16_t pc, uint16_t out[CFG_MAX_SUCCESSORS])
+{
+	uint16_t inst = fetchword(mem, pc);
+	if (inst == 0x00EE)
+		return 0;
+	if (A(inst) == 0x2){
+		out[0] = pc + 2;
+		return pc + 3 < MEMORY_SIZE;
+	}
+	return successors(&g, mem, pc, out);
+}
+
+static bool
+polls(uint16_t inst)
+{
+	return A(inst) == 0xE || (A(inst) == 0xF && NN(inst) == 0x07);
+}
+
+/* Whether inst can be part of a loop that only waits. */
+static bool
+idles(uint16_t inst)
+{
+	switch (A(inst)){
+		case 0x1: case 0x3: case 0x4: case 0x5: case 0x9:
+			return true;
+	}
+	return polls(inst);
+}
+
+/* Whether from pc there is a way back to pc through instructions that
+ * idle, and with avoid set, one that does not poll anything.
+ */
+static bool
+cycles(uint16_t pc, bool avoid)
+{
+	static uint16_t work[MEMORY_SIZE], out[CFG_MAX_SUCCESSORS];
+	static bool visited[MEMORY_SIZE];
+	int nwork = 0;
+	memset(visited, 0, sizeof(visited));
+	work[nwork++] = pc;
+	while (nwork){
+		uint16_t at = work[--nwork];
+		int n = within(at, out);
+		for (int k = 0; k < n; k++){
+			uint16_t to = out[k], inst = fetchword(mem, to);
+			if (to == pc)
+				return true;
+			if (visited[to] || !idles(inst) || (avoid && polls(inst)))
+				continue;
+			visited[to] = true;
+			work[nwork++] = to;
+		}
+	}
+	return false;
+}
+
+static void
+findsyncs(void)
+{
+	for (int pc = 0; pc < MEMORY_SIZE; pc++){
+		if (!(g.flags[pc] & CFG_CODE))
+			continue;
+		uint16_t inst = fetchword(mem, pc);
+		if (A(inst) == 0xF && NN(inst) == 0x0A)
+			syncs[pc] = SYNC_KEY;
+		else if (polls(inst) && cycles(pc, false))
+			syncs[pc] = A(inst) == 0xE? SYNC_KEY : SYNC_TIMER;
+		else if (idles(inst) && !polls(inst) && cycles(pc, true))
+			syncs[pc] = SYNC_HALT;
+	}
+}
+
+/* Orders the subroutines so that each comes after those it calls. */
+static void
+visit(uint16_t entry)
+{
+	static uint16_t out[CFG_MAX_SUCCESSORS];
+	FUNC *f = &funcs[entry];
+	if (f->visited)
+		return;
+	f->visited = true;
+
+	uint16_t *work = malloc(MEMORY_SIZE * sizeof(*work));
+	bool *reached = calloc(MEMORY_SIZE, sizeof(*reached));
+	if (!work || !reached)
+		die("out of memory\n");
+	int nwork = 0;
+	work[nwork++] = entry;
+	reached[entry] = true;
+	while (nwork){
+		uint16_t pc = work[--nwork], inst = fetchword(mem, pc);
+		if (A(inst) == 0x2){
+			if (!(f->ncallees & (f->ncallees - 1)) &&
+			    !(f->callees = realloc(f->callees, (f->ncallees? f->ncallees * 2 : 1) * sizeof(*f->callees))))
+				die("out of memory\n");
+			f->callees[f->ncallees++] = NNN(inst);
+		}
+		int n = within(pc, out);
+		for (int k = 0; k < n; k++)
+			if (!reached[out[k]]){
+				reached[out[k]] = true;
+				work[nwork++] = out[k];
+			}
+	}
+	free(work);
+	free(reached);
+	for (int k = 0; k < f->ncallees; k++)
+		visit(f->callees[k]);
+	order[norder++] = entry;
+}
+
+/* Whether the subroutine at entry calls itself, however indirectly. */
+static bool
+recurses(uint16_t entry)
+{
+	static uint16_t work[MEMORY_SIZE];
+	static bool reached[MEMORY_SIZE];
+	memset(reached, 0, sizeof(reached));
+	int nwork = 0;
+	work[nwork++] = entry;
+	while (nwork){
+		const FUNC *f = &funcs[work[--nwork]];
+		for (int k = 0; k < f->ncallees; k++){
+			uint16_t c = f->callees[k];
+			if (c == entry)
+				return true;
+			if (!reached[c]){
+				reached[c] = true;
+				work[nwork++] = c;
+			}
+		}
+	}
+	return false;
+}
+
+static void
+addedge(uint16_t from, uint16_t to, COST w)
+{
+	NODE *n = &nodes[from];
+	for (int k = 0; k < n->nedges; k++)
+		if (n->edges[k].to == to){
+			n->edges[k].w = most(n->edges[k].w, w);
+			return;
+		}
+	if (n->nedges == n->capacity){
+		n->capacity = n->capacity? n->capacity * 2 : 4;
+		if (!(n->edges = realloc(n->edges, n->capacity * sizeof(EDGE))))
+			die("out of memory\n");
+	}
+	n->edges[n->nedges++] = (EDGE){to, w};
+}
+
+static void
+setend(NODE *n, int end, COST c)
+{
+	n->ends[end] = most(n->ends[end], c);
+}
+
+static void
+startat(uint16_t pc, COST base)
+{
+	nodes[pc].start = true;
+	nodes[pc].base = most(nodes[pc].base, base);
+}
+
+/* Lays out the instructions of the subroutine at entry as nodes. */
+static int
+build(uint16_t entry, bool top, uint16_t *list)
+{
+	static uint16_t out[CFG_MAX_SUCCESSORS];
+	for (int pc = 0; pc < MEMORY_SIZE; pc++){
+		free(nodes[pc].edges);
+		memset(&nodes[pc], 0, sizeof(NODE));
+		for (int k = 0; k < NENDS; k++)
+			nodes[pc].ends[k] = nodes[pc].best[k] = NONE;
+		nodes[pc].base = NONE;
+		rep[pc] = pc;
+	}
+
+	int n = 0;
+	list[n++] = entry;
+	nodes[entry].member = true;
+	startat(entry, 0);
+	for (int at = 0; at < n; at++){
+		uint16_t pc = list[at], inst = fetchword(mem, pc);
+		NODE *p = &nodes[pc];
+		int nout = within(pc, out);
+		bool cut = syncs[pc] != SYNC_NONE;
+
+		if (cut){
+			setend(p, END_SYNC, 1);
+			for (int k = 0; k < nout; k++)
+				startat(out[k], 0);
+		} else if (inst == 0x00EE)
+			setend(p, top? END_STOP : END_RETURN, 1);
+		else if (A(inst) == 0xB || !nout){
+			setend(p, END_STOP, 1);
+			indirect |= A(inst) == 0xB;
+		} else if (A(inst) == 0x2){
+			const FUNC *f = &funcs[NNN(inst)];
+			if (f->recursive){
+				report(NNN(inst), "subroutine", "calls itself");
+				setend(p, END_STOP, INF);
+				nout = 0;
+			}
+			setend(p, END_SYNC, plus(1, f->tosync));
+			setend(p, END_STOP, plus(1, f->tostop));
+			if (nout && f->through != NONE)
+				addedge(pc, out[0], plus(1, f->through));
+			if (nout && f->fromsync != NONE)
+				startat(out[0], f->fromsync);
+			if (f->through == NONE && f->fromsync == NONE)
+				nout = 0;
+		} else
+			for (int k = 0; k < nout; k++)
+				addedge(pc, out[k], 1);
+
+		for (int k = 0; k < nout; k++)
+			if (!nodes[out[k]].member){
+				nodes[out[k]].member = true;
+				list[n++] = out[k];
+			}
+	}
+	return n;
+}
+
+/* Tarjan's strongly connected components over the nodes in list, not
+ * following edges into skip; each is appended to comps, with its size
+ * after it in sizes.
+ */
+static int tindex[MEMORY_SIZE], tlow[MEMORY_SIZE], tregion[MEMORY_SIZE], tcounter, tregions;
+static bool tstacked[MEMORY_SIZE];
+static uint16_t tstack[MEMORY_SIZE];
+static int tdepth;
+
+static void
+connect(uint16_t v, int skip, uint16_t *comps, int *ncomps, int *sizes, int *nsizes)
+{
+	tindex[v] = tlow[v] = ++tcounter;
+	tstack[tdepth++] = v;
+	tstacked[v] = true;
+	const NODE *n = &nodes[v];
+	for (int k = 0; k < n->nedges; k++){
+		uint16_t w = n->edges[k].to;
+		if (w == skip || tregion[w] != tregions || nodes[w].merged)
+			continue;
+		if (!tindex[w]){
+			connect(w, skip, comps, ncomps, sizes, nsizes);
+			tlow[v] = tlow[v] < tlow[w]? tlow[v] : tlow[w];
+		} else if (tstacked[w])
+			tlow[v] = tlow[v] < tindex[w]? tlow[v] : tindex[w];
+	}
+	if (tlow[v] != tindex[v])
+		return;
+	int size = 0;
+	uint16_t w;
+	do{
+		w = tstack[--tdepth];
+		tstacked[w] = false;
+		comps[(*ncomps)++] = w;
+		size++;
+	} while (w != v);
+	sizes[(*nsizes)++] = size;
+}
+
+static int
+components(const uint16_t *list, int n, int skip, uint16_t *comps, int *sizes)
+{
+	int ncomps = 0, nsizes = 0;
+	tregions++;
+	for (int k = 0; k < n; k++){
+		tregion[list[k]] = tregions;
+		tindex[list[k]] = 0;
+	}
+	for (int k = 0; k < n; k++)
+		if (!nodes[list[k]].merged && !tindex[list[k]])
+			connect(list[k], skip, comps, &ncomps, sizes, &nsizes);
+	return nsizes;
+}
+
+static bool
+selfloop(uint16_t v)
+{
+	for (int k = 0; k < nodes[v].nedges; k++)
+		if (nodes[v].edges[k].to == v)
+			return true;
+	return false;
+}
+
+static bool incomp[MEMORY_SIZE];
+
+/* Whether, in the loop at h with back edges ignored, from reaches to
+ * without passing through avoid.
+ */
+static bool
+reaches(uint16_t from, uint16_t to, int avoid, uint16_t h)
+{
+	static uint16_t work[MEMORY_SIZE];
+	static bool visited[MEMORY_SIZE];
+	memset(visited, 0, sizeof(visited));
+	int nwork = 0;
+	work[nwork++] = from;
+	visited[from] = true;
+	while (nwork){
+		const NODE *n = &nodes[work[--nwork]];
+		for (int k = 0; k < n->nedges; k++){
+			uint16_t w = n->edges[k].to;
+			if (w == to)
+				return true;
+			if (w == h || w == avoid || !incomp[w] || visited[w])
+				continue;
+			visited[w] = true;
+			work[nwork++] = w;
+		}
+	}
+	return false;
+}
+
+/* Whether every way around the loop at h passes through pc. */
+static bool
+always(uint16_t pc, uint16_t h)
+{
+	return pc == h || !reaches(h, h, pc, h);
+}
+
+/* The value of register x on the way into the loop at h. */
+static int
+entering(uint16_t h, int x)
+{
+	static uint16_t out[CFG_MAX_SUCCESSORS];
+	int v = h == g.entry? 0 : NONE;
+	for (int pc = 0; pc < MEMORY_SIZE; pc++){
+		if (!(g.flags[pc] & CFG_CODE) || !seen[pc] || incomp[rep[pc]])
+			continue;
+		uint16_t inst = fetchword(mem, pc);
+		int n = inst == 0x00EE? 0 : successors(&g, mem, pc, out);
+		bool into = false;
+		for (int k = 0; k < n; k++)
+			into |= out[k] == h;
+		REGS s = in[pc];
+		if (A(inst) == 0x2 && pc + 2 == h){
+			into = true;
+			if (funcs[NNN(inst)].writes >> x & 1)
+				s.v[x] = CFG_ANY;
+		} else
+			stepregs(&s, inst);
+		if (into)
+			v = v == NONE || v == s.v[x]? s.v[x] : CFG_ANY;
+	}
+	return v == NONE? CFG_ANY : v;
+}
+
+/* The most times around the loop at h that counter x, stepped by step
+ * at pc, lets the test at u go before it leaves; 0 if there is none.
+ */
+static unsigned
+count(uint16_t h, int x, int step, uint16_t pc, uint16_t u, uint16_t test, bool leaveswhenequal)
+{
+	int than;
+	if (A(test) == 0x3 || A(test) == 0x4)
+		than = NN(test);
+	else{
+		than = entering(h, Y(test));
+		if (than == CFG_ANY)
+			return 0;
+	}
+	int start = entering(h, x), off = u != h && (pc == h || reaches(pc, u, -1, h));
+	unsigned worst = 0;
+	for (int x0 = start == CFG_ANY? 0 : start; x0 <= (start == CFG_ANY? 255 : start); x0++){
+		unsigned k;
+		for (k = 0; k <= 256; k++){
+			int v = (x0 + (k + off) * step) & 0xFF;
+			if ((v == than) == leaveswhenequal)
+				break;
+		}
+		if (k > 256)
+			return 0;
+		worst = k + 1 > worst? k + 1 : worst;
+	}
+	return worst;
+}
+
+/* How many times the loop of the n nodes in comp, with header h, can go
+ * around; 0 if that has no bound, with why set.
+ */
+static unsigned
+bound(const uint16_t *comp, int n, uint16_t h, const char **why)
+{
+	int writers[16] = {0};
+	bool exits = false;
+	for (int pc = 0; pc < MEMORY_SIZE; pc++){
+		if (!incomp[rep[pc]] || !(g.flags[pc] & CFG_CODE))
+			continue;
+		uint16_t inst = fetchword(mem, pc);
+		uint32_t w = A(inst) == 0x2? funcs[NNN(inst)].writes : writes(inst);
+		for (int x = 0; x < 16; x++)
+			writers[x] += w >> x & 1;
+	}
+	for (int k = 0; k < n; k++){
+		const NODE *p = &nodes[comp[k]];
+		for (int e = 0; e < NENDS; e++)
+			exits |= p->ends[e] != NONE;
+		for (int j = 0; j < p->nedges; j++)
+			exits |= !incomp[p->edges[j].to];
+	}
+	if (!exits){
+		*why = "never leaves";
+		return 0;
+	}
+
+	unsigned best = 0;
+	bool counters = false;
+	for (int i = 0; i < n; i++){
+		uint16_t pc = comp[i], inst = fetchword(mem, pc);
+		int x = X(inst);
+		if (nodes[pc].loop || A(inst) != 0x7 || !NN(inst) || writers[x] != 1 || !always(pc, h))
+			continue;
+		for (int j = 0; j < n; j++){
+			uint16_t u = comp[j], test = fetchword(mem, u);
+			bool pair = A(test) == 0x5 || A(test) == 0x9;
+			if (nodes[u].loop || X(test) != x || !always(u, h))
+				continue;
+			if (!(A(test) == 0x3 || A(test) == 0x4 || (pair && (test & 0xF) == 0 && Y(test) != x && !writers[Y(test)])))
+				continue;
+			bool near = incomp[rep[(u + 2) % MEMORY_SIZE]], far = incomp[rep[(u + 4) % MEMORY_SIZE]];
+			if (near == far)
+				continue;
+			/* 3XNN and 5XY0 skip when equal, and the skip is to far */
+			bool skipsequal = A(test) == 0x3 || A(test) == 0x5;
+			counters = true;
+			unsigned b = count(h, x, NN(inst), pc, u, test, skipsequal == !far);
+			if (b && (!best || b < best))
+				best = b;
+		}
+	}
+	if (!best)
+		*why = counters? "has a counter that may never reach its exit" : "has no counter that decides its exit";
+	return best;
+}
+
+static void fold(const uint16_t *list, int n, int skip);
+
+/* Folds the loop of the n nodes in comp into its header. */
+static void
+foldloop(uint16_t *comp, int n)
+{
+	static bool entry[MEMORY_SIZE];
+	memset(incomp, 0, sizeof(incomp));
+	memset(entry, 0, sizeof(entry));
+	for (int k = 0; k < n; k++)
+		incomp[comp[k]] = true;
+	for (int pc = 0; pc < MEMORY_SIZE; pc++){
+		const NODE *p = &nodes[pc];
+		if (p->member && !p->merged && !incomp[pc])
+			for (int k = 0; k < p->nedges; k++)
+				entry[p->edges[k].to] = true;
+	}
+	uint16_t h = comp[0];
+	int entries = 0;
+	for (int k = 0; k < n; k++)
+		if (incomp[comp[k]] && (entry[comp[k]] || nodes[comp[k]].start)){
+			h = comp[k];
+			entries++;
+		}
+	if (entries != 1)
+		for (int k = 0; k < n; k++)
+			h = comp[k] < h? comp[k] : h;
+
+	fold(comp, n, h);
+	memset(incomp, 0, sizeof(incomp));
+	int live = 0;
+	for (int k = 0; k < n; k++)
+		if (!nodes[comp[k]].merged){
+			incomp[comp[k]] = true;
+			comp[live++] = comp[k];
+		}
+	n = live;
+
+	const char *why = "has more than one way in";
+	unsigned times = entries != 1? 0 : bound(comp, n, h, &why);
+	if (!times)
+		report(h, "loop", why);
+
+	/* longest from h to each node, by a pass in topological order */
+	static uint16_t topo[MEMORY_SIZE];
+	static COST fwd[MEMORY_SIZE];
+	static int pending[MEMORY_SIZE];
+	for (int k = 0; k < n; k++){
+		fwd[comp[k]] = NONE;
+		pending[comp[k]] = 0;
+	}
+	for (int k = 0; k < n; k++)
+		for (int j = 0; j < nodes[comp[k]].nedges; j++){
+			uint16_t w = nodes[comp[k]].edges[j].to;
+			if (incomp[w] && w != h)
+				pending[w]++;
+		}
+	int ntopo = 0;
+	topo[ntopo++] = h;
+	fwd[h] = 0;
+	for (int at = 0; at < ntopo; at++){
+		const NODE *p = &nodes[topo[at]];
+		for (int j = 0; j < p->nedges; j++){
+			uint16_t w = p->edges[j].to;
+			if (!incomp[w] || w == h)
+				continue;
+			fwd[w] = most(fwd[w], plus(fwd[topo[at]], p->edges[j].w));
+			if (!--pending[w])
+				topo[ntopo++] = w;
+		}
+	}
+
+	COST each = NONE, ends[NENDS] = {NONE, NONE, NONE};
+	static COST exits[MEMORY_SIZE];
+	static uint16_t targets[MEMORY_SIZE];
+	int ntargets = 0;
+	for (int at = 0; at < ntopo; at++){
+		uint16_t v = topo[at];
+		const NODE *p = &nodes[v];
+		for (int e = 0; e < NENDS; e++)
+			ends[e] = most(ends[e], plus(fwd[v], p->ends[e]));
+		for (int j = 0; j < p->nedges; j++){
+			uint16_t w = p->edges[j].to;
+			COST c = plus(fwd[v], p->edges[j].w);
+			if (w == h)
+				each = most(each, c);
+			else if (!incomp[w]){
+				int t;
+				for (t = 0; t < ntargets && targets[t] != w; t++)
+					;
+				if (t == ntargets){
+					targets[ntargets++] = w;
+					exits[t] = NONE;
+				}
+				exits[t] = most(exits[t], c);
+			}
+		}
+	}
+
+	COST around = times? (each >= INF? INF : most(0, each) * (times - 1)) : INF;
+	NODE *hn = &nodes[h];
+	free(hn->edges);
+	hn->edges = NULL;
+	hn->nedges = hn->capacity = 0;
+	for (int e = 0; e < NENDS; e++)
+		hn->ends[e] = plus(around, ends[e]);
+	/* a run that goes in and never comes out has no bound either */
+	if (!ntargets && ends[END_RETURN] == NONE && ends[END_SYNC] == NONE && ends[END_STOP] == NONE)
+		hn->ends[END_STOP] = INF;
+	for (int t = 0; t < ntargets; t++)
+		addedge(h, targets[t], plus(around, exits[t]));
+	hn->loop = true;
+	hn->bound = times;
+	hn->each = each;
+	for (int k = 0; k < n; k++){
+		NODE *p = &nodes[comp[k]];
+		if (comp[k] == h)
+			continue;
+		p->merged = true;
+		if (p->start){
+			hn->start = true;
+			hn->base = most(hn->base, p->base);
+		}
+	}
+	/* a loop with more than one way in is entered at its header */
+	for (int pc = 0; pc < MEMORY_SIZE; pc++){
+		NODE *p = &nodes[pc];
+		if (!p->member || p->merged || incomp[pc])
+			continue;
+		for (int k = 0; k < p->nedges; k++)
+			if (incomp[p->edges[k].to] && p->edges[k].to != h){
+				COST w = p->edges[k].w;
+				p->edges[k--] = p->edges[--p->nedges];
+				addedge(pc, h, w);
+			}
+	}
+	for (int pc = 0; pc < MEMORY_SIZE; pc++)
+		if (incomp[rep[pc]])
+			rep[pc] = h;
+}
+
+/* Folds every loop among the n nodes in list, innermost first, not
+ * following edges into skip.
+ */
+static void
+fold(const uint16_t *list, int n, int skip)
+{
+	uint16_t *comps = malloc(n * sizeof(*comps));
+	int *sizes = malloc(n * sizeof(*sizes));
+	if (!comps || !sizes)
+		die("out of memory\n");
+	int nsizes = components(list, n, skip, comps, sizes);
+	for (int k = 0, at = 0; k < nsizes; at += sizes[k++])
+		if (sizes[k] > 1 || selfloop(comps[at]))
+			foldloop(comps + at, sizes[k]);
+	free(comps);
+	free(sizes);
+}
+
+static void
+solve(uint16_t v)
+{
+	NODE *p = &nodes[v];
+	if (p->solved)
+		return;
+	p->solved = true;
+	for (int e = 0; e < NENDS; e++){
+		p->best[e] = p->ends[e];
+		p->next[e] = -1;
+	}
+	for (int k = 0; k < p->nedges; k++){
+		solve(p->edges[k].to);
+		for (int e = 0; e < NENDS; e++){
+			COST c = plus(p->edges[k].w, nodes[p->edges[k].to].best[e]);
+			if (c > p->best[e]){
+				p->best[e] = c;
+				p->next[e] = k;
+			}
+		}
+	}
+}
+
+/* The longest run that ends inside the subroutine. */
+static COST
+longest(const NODE *p, int *end)
+{
+	*end = p->best[END_SYNC] >= p->best[END_STOP]? END_SYNC : END_STOP;
+	return p->best[*end];
+}
+
+/* Sums up the subroutine at entry, or with top the ROM itself. */
+static void
+analyze(uint16_t entry, bool top, uint16_t *list)
+{
+	FUNC *f = &funcs[entry];
+	int n = build(entry, top, list);
+	for (int k = 0; k < n; k++){
+		uint16_t inst = fetchword(mem, list[k]);
+		f->writes |= A(inst) == 0x2? funcs[NNN(inst)].writes : writes(inst);
+	}
+	fold(list, n, -1);
+	for (int k = 0; k < n; k++)
+		if (!nodes[list[k]].merged)
+			solve(list[k]);
+
+	const NODE *e = &nodes[entry];
+	f->through = e->best[END_RETURN];
+	f->tosync = e->best[END_SYNC];
+	f->tostop = e->best[END_STOP];
+	f->fromsync = f->inner = NONE;
+	for (int k = 0; k < n; k++){
+		const NODE *p = &nodes[list[k]];
+		int end;
+		if (!p->start || p->merged || (list[k] == entry && !top))
+			continue;
+		f->fromsync = most(f->fromsync, plus(p->base, p->best[END_RETURN]));
+		COST c = plus(p->base, longest(p, &end));
+		if (c > f->inner){
+			f->inner = c;
+			f->worst = list[k];
+		}
+	}
+	if (f->recursive){
+		f->writes = CFG_REG_ALL;
+		f->through = f->tosync = f->tostop = f->fromsync = INF;
+	}
+}
+
+static void
+printcost(COST c)
+{
+	if (c >= INF)
+		printf("no bound");
+	else
+		printf("%lld", (long long)c);
+}
+
+static void
+flush(int first, int last, int count)
+{
+	if (count)
+		printf("  0x%03X-0x%03X: %d instructions\n", first, last, count);
+}
+
+/* Prints the run from start, as analyze() left the nodes. */
+static void
+printpath(uint16_t start)
+{
+	int end, first = 0, last = 0, count = 0;
+	uint16_t v = start;
+	COST total = plus(nodes[v].base, longest(&nodes[v], &end));
+	if (total >= INF)
+		printf("worst run: no bound, from 0x%03X\n", start);
+	else
+		printf("worst run: %lld instructions from 0x%03X\n", (long long)total, start);
+	if (nodes[v].base > 0){
+		printf("  the rest of a subroutine that synced: ");
+		printcost(nodes[v].base);
+		printf("\n");
+	}
+
+	for (;;){
+		const NODE *p = &nodes[v];
+		uint16_t inst = fetchword(mem, v);
+		int k = p->next[end];
+		if (!p->loop && A(inst) != 0x2){
+			if (!count)
+				first = v;
+			last = v;
+			count++;
+			if (k >= 0 && p->edges[k].to == v + 2){
+				v += 2;
+				continue;
+			}
+		}
+		flush(first, last, count);
+		count = 0;
+		if (p->loop){
+			printf("  loop at 0x%03X: ", v);
+			if (p->bound)
+				printf("%u times around, at most %lld instructions each\n", p->bound, (long long)p->each);
+			else
+				printf("no bound\n");
+		} else if (A(inst) == 0x2)
+			printf("  0x%03X calls 0x%03X\n", v, NNN(inst));
+		if (k >= 0){
+			v = p->edges[k].to;
+			continue;
+		}
+		if (p->loop)
+			printf("  ends inside the loop\n");
+		else if (A(inst) == 0x2)
+			printf("  ends inside 0x%03X\n", NNN(inst));
+		else if (syncs[v])
+			printf("  0x%03X %s\n", v, syncnames[syncs[v]]);
+		else if (A(inst) == 0xB)
+			printf("  0x%03X jumps by V0\n", v);
+		else if (inst == 0x00EE)
+			printf("  0x%03X returns from the ROM\n", v);
+		else
+			printf("  0x%03X faults\n", v);
+		break;
+	}
+}
+
+#define USAGE "usage: c8wcet ROM\n"
+int
+main(int argc, char **argv)
+{
+	int ch;
+	while ((ch = getopt(argc, argv, "h")) != -1) switch (ch){
+		default:
+			die(USAGE);
+			break;
+	}
+	argc -= optind; argv += optind;
+	if (argc != 1)
+		die(USAGE);
+
+	FILE *f = fopen(argv[0], "rb");
+	if (!f)
+		die("could not read rom\n");
+	loadfonts(mem, 0);
+	uint8_t rom[MAX_ROM + 1];
+	size_t size = fread(rom, 1, sizeof(rom), f);
+	fclose(f);
+	if (size > MAX_ROM)
+		die("rom too large\n");
+	memcpy(mem + LOAD_ADDR, rom, size);
+
+	buildcfg(&g, mem, LOAD_ADDR);
+	if (g.megachip)
+		die("MegaChip ROMs are not analyzed\n");
+	propagate(&g, mem, in, seen);
+	findsyncs();
+	visit(g.entry);
+	for (int k = 0; k < norder; k++)
+		funcs[order[k]].recursive = recurses(order[k]);
+
+	static uint16_t list[MEMORY_SIZE];
+	COST worst = NONE;
+	uint16_t where = g.entry, func = g.entry;
+	for (int k = 0; k < norder; k++){
+		uint16_t entry = order[k];
+		analyze(entry, entry == g.entry, list);
+		if (funcs[entry].inner > worst){
+			worst = funcs[entry].inner;
+			where = funcs[entry].worst;
+			func = entry;
+		}
+	}
+
+	int nsyncs = 0;
+	for (int pc = 0; pc < MEMORY_SIZE; pc++)
+		if (syncs[pc]){
+			printf("sync point 0x%03X %s\n", pc, syncnames[syncs[pc]]);
+			nsyncs++;
+		}
+	if (!nsyncs)
+		printf("no sync points\n");
+	for (int k = 0; k < nunbounded; k++)
+		printf("%s at 0x%03X %s\n", unbounded[k].what, unbounded[k].pc, unbounded[k].why);
+	if (indirect)
+		printf("BNNN found: runs end there, so this is a lower bound\n");
+
+	if (worst == NONE)
+		die("no runs found\n");
+	analyze(func, func == g.entry, list);
+	printpath(where);
+	if (worst >= INF)
+		printf("no speed is enough to keep every frame\n");
+	else
+		printf("%lld instructions per tick keep every frame\n", (long long)worst);
+	return worst >= INF? EXIT_FAILURE : EXIT_SUCCESS;
+}
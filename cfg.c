@@ -0,0 +1,311 @@
+/* The control flow of a ROM.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#include <string.h>
+
+#include "cfg.h"
+
+#define A(inst) ((inst) >> 12)
+#define X(inst) ((inst) >> 8 & 0xF)
+#define Y(inst) ((inst) >> 4 & 0xF)
+#define D(inst) ((inst) & 0xF)
+#define NN(inst) ((inst) & 0xFF)
+#define NNN(inst) ((inst) & 0xFFF)
+
+uint16_t
+fetchword(const uint8_t mem[MEMORY_SIZE], uint16_t pc)
+{
+	return mem[pc % MEMORY_SIZE] << 8 | mem[(pc + 1) % MEMORY_SIZE];
+}
+
+/* Whether inst runs outside MegaChip mode, by the same decoding as
+ * execute() in core.c.
+ */
+static bool
+valid(uint16_t inst)
+{
+	uint8_t d = inst & 0xF, nn = inst & 0xFF;
+	switch (A(inst)){
+		case 0x0: return inst == 0x00E0 || inst == 0x00EE || inst == 0x0011;
+		case 0x5: case 0x9: return d == 0;
+		case 0x8: return d <= 7 || d == 0xE;
+		case 0xE: return nn == 0x9E || nn == 0xA1;
+		case 0xF:
+			switch (nn){
+				case 0x07: case 0x0A: case 0x15: case 0x18: case 0x1E:
+				case 0x29: case 0x33: case 0x55: case 0x65:
+					return true;
+			}
+			return false;
+	}
+	return true;
+}
+
+bool
+transfers(uint16_t inst)
+{
+	switch (A(inst)){
+		case 0x1: case 0x2: case 0x3: case 0x4: case 0x5:
+		case 0x9: case 0xB: case 0xE:
+			return true;
+		case 0x0:
+			return inst == 0x00EE;
+	}
+	return !valid(inst);
+}
+
+/* The successors of pc other than the returns of 00EE. */
+static int
+local(uint16_t inst, uint16_t pc, uint16_t out[])
+{
+	if (!valid(inst))
+		return 0;
+	switch (A(inst)){
+		case 0x0:
+			if (inst == 0x00EE)
+				return 0;
+			break;
+		case 0x1: case 0x2:
+			out[0] = NNN(inst);
+			return 1;
+		case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+			out[0] = pc + 2;
+			out[1] = pc + 4;
+			return 2;
+		case 0xB:
+			return 0;
+	}
+	out[0] = pc + 2;
+	return 1;
+}
+
+static void
+mark(CFG *g, uint16_t pc, uint8_t flags, uint16_t *work, int *nwork)
+{
+	if (pc + 1 >= MEMORY_SIZE)
+		return;
+	g->flags[pc] |= flags;
+	if (!(g->flags[pc] & CFG_CODE)){
+		g->flags[pc] |= CFG_CODE;
+		work[(*nwork)++] = pc;
+	}
+}
+
+void
+buildcfg(CFG *g, const uint8_t mem[MEMORY_SIZE], uint16_t entry)
+{
+	static uint16_t work[MEMORY_SIZE];
+	int nwork = 0;
+	memset(g, 0, sizeof(*g));
+	g->entry = entry;
+	mark(g, entry, CFG_LEADER, work, &nwork);
+
+	while (nwork){
+		uint16_t pc = work[--nwork], inst = fetchword(mem, pc), out[2];
+		g->ninsts++;
+		if (A(inst) == 0xB)
+			g->indirect = true;
+		if (inst == 0x0011)
+			g->megachip = true;
+
+		int n = local(inst, pc, out);
+		bool branches = transfers(inst);
+		for (int k = 0; k < n; k++)
+			mark(g, out[k], branches? CFG_LEADER : 0, work, &nwork);
+		if (A(inst) == 0x2 && n){
+			g->flags[out[0]] |= CFG_CALLED;
+			mark(g, pc + 2, CFG_LEADER | CFG_RETURN, work, &nwork);
+		}
+	}
+	for (int pc = 0; pc < MEMORY_SIZE; pc++)
+		g->nblocks += (g->flags[pc] & (CFG_CODE | CFG_LEADER)) == (CFG_CODE | CFG_LEADER);
+}
+
+int
+successors(const CFG *g, const uint8_t mem[MEMORY_SIZE], uint16_t pc, uint16_t out[CFG_MAX_SUCCESSORS])
+{
+	uint16_t inst = fetchword(mem, pc);
+	if (inst != 0x00EE){
+		int n = local(inst, pc, out), k = 0;
+		for (int j = 0; j < n; j++)
+			if (out[j] + 1 < MEMORY_SIZE)
+				out[k++] = out[j];
+		return k;
+	}
+
+	int n = 0;
+	for (int at = 0; at < MEMORY_SIZE; at++)
+		if ((g->flags[at] & (CFG_CODE | CFG_RETURN)) == (CFG_CODE | CFG_RETURN))
+			out[n++] = at;
+	return n;
+}
+
+uint16_t
+blockend(const CFG *g, const uint8_t mem[MEMORY_SIZE], uint16_t leader)
+{
+	uint16_t pc = leader;
+	while (!transfers(fetchword(mem, pc))){
+		pc += 2;
+		if (pc + 1 >= MEMORY_SIZE || !(g->flags[pc] & CFG_CODE) || g->flags[pc] & CFG_LEADER)
+			return pc;
+	}
+	return pc + 2;
+}
+
+uint32_t
+reads(uint16_t inst)
+{
+	uint32_t x = 1u << X(inst), y = 1u << Y(inst);
+	switch (A(inst)){
+		case 0x3: case 0x4: case 0x7: case 0xE: return x;
+		case 0x5: case 0x9:                     return x | y;
+		case 0x8:                               return D(inst) == 0? y : D(inst) == 6 || D(inst) == 0xE? x : x | y;
+		case 0xB:                               return CFG_REG_ALL;
+		case 0xD:                               return x | y | CFG_REG_I;
+		case 0xF:
+			switch (NN(inst)){
+				case 0x15: case 0x18: case 0x29: return x;
+				case 0x1E: case 0x33:            return x | CFG_REG_I;
+				case 0x55:                       return ((2u << X(inst)) - 1) | CFG_REG_I;
+				case 0x65:                       return CFG_REG_I;
+			}
+	}
+	return 0;
+}
+
+uint32_t
+writes(uint16_t inst)
+{
+	uint32_t x = 1u << X(inst);
+	switch (A(inst)){
+		case 0x6: case 0x7: case 0xC: return x;
+		case 0x8:                     return D(inst) <= 3? x : x | 1u << 0xF;
+		case 0xA:                     return CFG_REG_I;
+		case 0xD:                     return 1u << 0xF;
+		case 0xF:
+			switch (NN(inst)){
+				case 0x07: case 0x0A: return x;
+				case 0x1E:            return CFG_REG_I | 1u << 0xF;
+				case 0x29:            return CFG_REG_I;
+				case 0x65:            return (2u << X(inst)) - 1;
+			}
+	}
+	return 0;
+}
+
+static void
+setrange(REGS *s, int lo, int hi)
+{
+	if (hi > 0xFFF){
+		lo = 0;
+		hi = 0xFFF;
+	}
+	s->ilo = lo;
+	s->ihi = hi;
+}
+
+void
+stepregs(REGS *s, uint16_t inst)
+{
+	int *vx = &s->v[X(inst)], vy = s->v[Y(inst)], *vf = &s->v[0xF];
+	bool known = *vx != CFG_ANY && vy != CFG_ANY;
+	int r = CFG_ANY, c = CFG_ANY;
+	switch (A(inst)){
+		case 0x6: *vx = NN(inst); break;
+		case 0x7: if (*vx != CFG_ANY) *vx = (*vx + NN(inst)) & 0xFF; break;
+		case 0x8:
+			switch (D(inst)){
+				case 0x0: r = vy; break;
+				case 0x1: if (known) r = *vx | vy; break;
+				case 0x2: if (known) r = *vx & vy; break;
+				case 0x3: if (known) r = *vx ^ vy; break;
+				case 0x4: if (known){ r = (*vx + vy) & 0xFF; c = *vx + vy > 0xFF; } break;
+				case 0x5: if (known){ r = (*vx - vy) & 0xFF; c = *vx >= vy; } break;
+				case 0x6: if (*vx != CFG_ANY){ r = *vx >> 1; c = *vx & 1; } break;
+				case 0x7: if (known){ r = (vy - *vx) & 0xFF; c = vy >= *vx; } break;
+				case 0xE: if (*vx != CFG_ANY){ r = *vx << 1 & 0xFF; c = *vx >> 7; } break;
+			}
+			*vx = r;
+			if (D(inst) > 3)
+				*vf = c;
+			break;
+		case 0xA: setrange(s, NNN(inst), NNN(inst)); break;
+		case 0xC: *vx = CFG_ANY; break;
+		case 0xD: *vf = CFG_ANY; break;
+		case 0xF:
+			switch (NN(inst)){
+				case 0x07: case 0x0A: *vx = CFG_ANY; break;
+				case 0x1E:
+					if (*vx == CFG_ANY){
+						setrange(s, s->ilo, s->ihi + 0xFF);
+						*vf = CFG_ANY;
+					} else{
+						*vf = s->ilo == s->ihi? s->ilo + *vx > 0xFFF : CFG_ANY;
+						setrange(s, s->ilo + *vx, s->ihi + *vx);
+					}
+					break;
+				case 0x29:
+					if (*vx == CFG_ANY || *vx > 0xF)
+						setrange(s, 0, 15 * 5);
+					else
+						setrange(s, *vx * 5, *vx * 5);
+					break;
+				case 0x65:
+					for (int k = 0; k <= X(inst); k++)
+						s->v[k] = CFG_ANY;
+					break;
+			}
+			break;
+	}
+}
+
+static bool
+meet(REGS in[MEMORY_SIZE], bool seen[MEMORY_SIZE], uint16_t pc, const REGS *s)
+{
+	REGS *t = &in[pc];
+	if (!seen[pc]){
+		seen[pc] = true;
+		*t = *s;
+		return true;
+	}
+	bool changed = false;
+	for (int k = 0; k < 16; k++)
+		if (t->v[k] != CFG_ANY && t->v[k] != s->v[k]){
+			t->v[k] = CFG_ANY;
+			changed = true;
+		}
+	if (s->ilo < t->ilo || s->ihi > t->ihi){
+		setrange(t, s->ilo < t->ilo? s->ilo : t->ilo, s->ihi > t->ihi? s->ihi : t->ihi);
+		changed = true;
+	}
+	return changed;
+}
+
+void
+propagate(const CFG *g, const uint8_t mem[MEMORY_SIZE], REGS in[MEMORY_SIZE], bool seen[MEMORY_SIZE])
+{
+	static uint16_t work[MEMORY_SIZE], out[CFG_MAX_SUCCESSORS];
+	static bool queued[MEMORY_SIZE];
+	int nwork = 0;
+	memset(seen, 0, MEMORY_SIZE * sizeof(seen[0]));
+	memset(queued, 0, sizeof(queued));
+
+	REGS s = {0};
+	meet(in, seen, g->entry, &s);
+	work[nwork++] = g->entry;
+	queued[g->entry] = true;
+	while (nwork){
+		uint16_t pc = work[--nwork];
+		queued[pc] = false;
+		s = in[pc];
+		stepregs(&s, fetchword(mem, pc));
+		int n = successors(g, mem, pc, out);
+		for (int k = 0; k < n; k++)
+			if (meet(in, seen, out[k], &s) && !queued[out[k]]){
+				queued[out[k]] = true;
+				work[nwork++] = out[k];
+			}
+	}
+}
@@ -0,0 +1,87 @@
+/* The control flow of a ROM.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* What buildcfg() found at each address. */
+enum{
+	CFG_CODE = 1,    /* an instruction starts here */
+	CFG_LEADER = 2,  /* and so does a basic block */
+	CFG_CALLED = 4,  /* and a subroutine */
+	CFG_RETURN = 8   /* the instruction after a call, where 00EE goes */
+};
+
+#define CFG_MAX_SUCCESSORS (MEMORY_SIZE / 2)
+
+/* Every instruction reachable from the entry point, found by following
+ * every path: both ways from a skip, into a subroutine and on after it.
+ * 00EE is taken to go back to every call's return, which is more paths
+ * than can happen but never fewer. A BNNN jump goes where V0 says, so
+ * none of its paths are followed and indirect is set; an analysis that
+ * needs every path cannot trust the graph then. Neither can one that
+ * does not know MegaChip, whose instructions set megachip.
+ */
+typedef struct CFG CFG;
+struct CFG{
+	uint8_t flags[MEMORY_SIZE];
+	uint16_t entry;
+	bool indirect, megachip;
+	unsigned ninsts, nblocks;
+};
+
+uint16_t fetchword(const uint8_t mem[MEMORY_SIZE], uint16_t pc);
+void buildcfg(CFG *g, const uint8_t mem[MEMORY_SIZE], uint16_t entry);
+
+/* The addresses the instruction at pc can go to next, into out; returns
+ * how many. An instruction that faults goes nowhere.
+ */
+int successors(const CFG *g, const uint8_t mem[MEMORY_SIZE], uint16_t pc, uint16_t out[CFG_MAX_SUCCESSORS]);
+
+/* Whether an instruction ends a basic block because it may go
+ * somewhere other than the next instruction.
+ */
+bool transfers(uint16_t inst);
+
+/* The address just past the last instruction of the block at leader. */
+uint16_t blockend(const CFG *g, const uint8_t mem[MEMORY_SIZE], uint16_t leader);
+
+/* The registers an instruction reads and writes, a bit each for V0 to
+ * VF and then I. BNNN is taken to read them all, as where it goes next
+ * may read anything.
+ */
+#define CFG_REG_I (1u << 16)
+#define CFG_REG_ALL 0x1FFFFu
+
+uint32_t reads(uint16_t inst);
+uint32_t writes(uint16_t inst);
+
+/* What is known of the registers before an instruction: each V is a
+ * constant or CFG_ANY, and I is somewhere in [ilo, ihi].
+ */
+#define CFG_ANY (-1)
+
+typedef struct REGS REGS;
+struct REGS{
+	int v[16];
+	int ilo, ihi;
+};
+
+/* What the instruction does to what is known. FX29 is taken to point
+ * at one of the 16 digits, as it is meant to.
+ */
+void stepregs(REGS *s, uint16_t inst);
+
+/* Fills in in[] for every instruction reached, marking it in seen[],
+ * starting from the zeroed machine the ROM starts in.
+ */
+void propagate(const CFG *g, const uint8_t mem[MEMORY_SIZE], REGS in[MEMORY_SIZE], bool seen[MEMORY_SIZE]);
+
+#endif
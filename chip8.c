@@ -3,16 +3,30 @@
  * Released under the terms of the GNU General Public License.
  * See LICENSE for details.
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <libgen.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <zlib.h>
 
 #ifndef CURSES_INCLUDE_H
 	#define CURSES_INCLUDE_H <curses.h>
@@ -20,26 +34,165 @@
 
 #include CURSES_INCLUDE_H
 
-#define TICKS_PER_SECOND 60
+#include "audio.h"
+#include "chip8.h"
+#include "migrate.h"
+#include "profile.h"
+#include "record.h"
+#include "trace.h"
+
 #define NANOS_PER_SECOND 1000000000
 #define NANOS_PER_TICK (NANOS_PER_SECOND/60)
-#define STACK_SIZE 5
-#define MEMORY_SIZE 4096
+#define CALIBRATE_NANOS 1500000
+#define CALIBRATE_ROUNDS 3
+#define ENGINE_AUTO -1
+#define SPIN_NANOS 300000
+#define JITTER_BUCKETS 2000
+#define FRAME_CACHE 8
+#define MEGA_IMAGE (FRAME_CACHE + 1)
+#define CUBE 216
+#define KITTY_CHUNK 4096
+#define KEY_QUEUE 64
+#define FRESH 4
+#define PANEL_COLUMN 66
+#define PANEL_HOT 5
+
+#ifdef EMBED_ROM
+	#include "rom.h"
+	#ifndef ROM_ADDR
+		#define ROM_ADDR 512
+	#endif
+	#ifndef ROM_SPEED
+		#define ROM_SPEED 11
+	#endif
+	#ifndef ROM_KEYMAP
+		#define ROM_KEYMAP "x123qweasdzc4rfv"
+	#endif
+	#define ROM_USAGE ""
+	#define ROM_ARGS 0
+#else
+	#define ROM_USAGE " ROM"
+	#define ROM_ARGS 1
+#endif
+
+enum{
+	RENDER_AUTO,
+	RENDER_CELLS,
+	RENDER_KITTY,
+	RENDER_SIXEL
+};
+
+/* The ROM as it was last read from disk, for telling a reload which
+ * bytes of memory the edit actually changed.
+ */
+typedef struct ROMFILE ROMFILE;
+struct ROMFILE{
+	const char *filename;
+	uint16_t addr;
+	uint8_t image[MEMORY_SIZE];
 
-typedef struct CHIP8 CHIP8;
-struct CHIP8{
-	uint8_t mem[MEMORY_SIZE];
-	uint16_t stack[STACK_SIZE];
-	uint16_t pc, sp, i;
+	int watchfd, restart;
+	char *watchname;
+	unsigned snapshots;
+};
 
-	uint8_t delay, sound;
-	uint8_t v[16];
+/* How late each tick started, in microsecond buckets. */
+typedef struct JITTER JITTER;
+struct JITTER{
+	uint64_t ticks, over;
+	long long total, worst;
+	uint32_t buckets[JITTER_BUCKETS];
+};
 
-	bool dirty, display[32][64];
+/* The machine and what this frontend needs to run it. */
+typedef struct HOST HOST;
+struct HOST{
+	CHIP8 vm;
 	bool beep;
 
 	int inspertick;
 	char *keymap;
+	AUDIO *audio;
+	ROMFILE *rom;
+	RECORDER *recorder;
+	TRACER *tracer;
+	uint64_t ticks;
+
+	const char *handoff;    /* socket a successor takes over through */
+	int listener;
+	MIGRATION *migration;
+	unsigned rounds;
+	long long paused;       /* nanoseconds stopped for the final round */
+
+	const char *profile;    /* where samples of the guest are dumped */
+
+	int ahead;              /* frames to run ahead, see runahead() */
+	bool showing;           /* the terminal has shown, run ahead */
+	uint64_t shown[32];
+
+	int priority, cpu;
+	JITTER jitter;
+};
+
+/* Everything the emulation thread shares with the terminal thread. The
+ * terminal thread owns curses and the output device; the emulation thread
+ * only ever publishes frames, queues up beeps and takes keys, none of
+ * which can block it.
+ *
+ * Frames go through a triple buffer: the emulator fills back, the
+ * terminal draws front, and the two swap through shared, which carries
+ * the FRESH bit while it holds a frame the terminal has not seen.
+ */
+/* A frame on its way to the terminal: the CHIP-8 display or, in
+ * MegaChip mode, the MegaChip screen in color.
+ */
+typedef struct PICTURE PICTURE;
+struct PICTURE{
+	bool mega;
+	uint64_t display[32];
+	uint32_t color[MEGA_HEIGHT][MEGA_WIDTH];
+};
+
+/* Counters for the profiling panel. Each is written by one thread only
+ * and read by the terminal thread once a second, so relaxed atomics are
+ * enough; the panel shows how far each moved in that second. Counting
+ * where each instruction ran takes stepping, so only happens while the
+ * panel is up.
+ */
+enum{
+	PHASE_EXECUTE,
+	PHASE_PUBLISH,
+	PHASE_RENDER,
+	PHASE_SLEEP,
+	NPHASES
+};
+
+typedef struct STATS STATS;
+struct STATS{
+	_Atomic uint64_t ticks, cycles, dropped, late;
+	_Atomic uint64_t nanos[NPHASES];
+	_Atomic uint64_t hits[MEMORY_SIZE];
+	atomic_uint inspertick;
+};
+
+typedef struct TERMINAL TERMINAL;
+struct TERMINAL{
+	PICTURE frames[3];
+	atomic_uint shared;
+	unsigned back, front;
+
+	uint8_t keys[KEY_QUEUE];
+	atomic_uint keyhead, keytail;
+
+	atomic_uint beeps;
+	atomic_bool done;
+
+	STATS stats;
+	atomic_bool panel;
+
+	int wakefd, renderer;
+	const char *keymap;
+	pthread_t thread;
 };
 
 static void
@@ -50,187 +203,1055 @@ die(const char *m)
 	exit(EXIT_FAILURE);
 }
 
-static long int
+static long long
 tsdiff(const struct timespec *end, const struct timespec *start)
 {
-	return (end->tv_sec - start->tv_sec) + 
-		(end->tv_nsec - start->tv_nsec) / NANOS_PER_SECOND;
+	return (long long)(end->tv_sec - start->tv_sec) * NANOS_PER_SECOND +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+static void
+tsadd(struct timespec *ts, long long nanos)
+{
+	long long n = ts->tv_nsec + nanos;
+	ts->tv_sec += n / NANOS_PER_SECOND;
+	ts->tv_nsec = n % NANOS_PER_SECOND;
+	if (ts->tv_nsec < 0){
+		ts->tv_nsec += NANOS_PER_SECOND;
+		ts->tv_sec--;
+	}
 }
 
 static void
-sleeptonexttick(const struct timespec *start, const struct timespec *end)
+recordjitter(JITTER *j, long long late)
 {
-	long nanos = NANOS_PER_TICK - tsdiff(end, start);
-	if (nanos > 0){
-		struct timespec rmtp = {0}, rqtp = {
-			.tv_sec = nanos / NANOS_PER_SECOND,
-			.tv_nsec = nanos % NANOS_PER_SECOND
-		};
+	long long us = late / 1000;
+	j->ticks++;
+	j->total += late;
+	if (late > j->worst)
+		j->worst = late;
+	if (us < JITTER_BUCKETS)
+		j->buckets[us]++;
+	else
+		j->over++;
+}
 
-		while (nanosleep(&rqtp, &rmtp) != 0){
-			memcpy(&rqtp, &rmtp, sizeof(struct timespec));
-			memset(&rmtp, 0, sizeof(struct timespec));
-		}
+static long long
+jitterpercentile(const JITTER *j, double p)
+{
+	uint64_t want = (uint64_t)(j->ticks * p), seen = 0;
+	for (int us = 0; us < JITTER_BUCKETS; us++){
+		if ((seen += j->buckets[us]) > want)
+			return us;
 	}
+	return JITTER_BUCKETS;
 }
 
 static void
-loadfonts(uint8_t buf[MEMORY_SIZE], uint16_t addr)
+reportjitter(const JITTER *j)
 {
-	static uint8_t font[] = {
-		0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-		0x20, 0x60, 0x20, 0x20, 0x70, // 1
-		0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-		0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-		0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-		0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-		0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-		0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-		0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-		0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-		0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-		0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-		0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-		0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-		0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-		0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-	};
+	if (!j->ticks)
+		return;
+	fprintf(stderr, "ticks %llu, late by: mean %lldus, p50 %lldus, p99 %lldus, max %lldus; %llu over %dus\n",
+	        (unsigned long long)j->ticks, j->total / (long long)j->ticks / 1000,
+	        jitterpercentile(j, 0.50), jitterpercentile(j, 0.99), j->worst / 1000,
+	        (unsigned long long)j->over, JITTER_BUCKETS);
+}
 
-	if (addr >= MEMORY_SIZE - sizeof(font))
-		die("could not load fonts\n");
-	memcpy(buf + addr, font, sizeof(font));
+/* Ticks are paced against absolute deadlines, so time spent in a tick
+ * never pushes the ones after it back. A tick that ran more than a whole
+ * tick late starts the schedule over rather than trying to catch up.
+ *
+ * Wakeups from a sleep can be late by a millisecond or more under load,
+ * so with a spin time the sleep ends that much early and the rest of
+ * the wait is spent polling the clock. Returns false if the schedule
+ * had to start over.
+ */
+static bool
+sleeptonexttick(struct timespec *deadline, long long spin, JITTER *j)
+{
+	struct timespec now, wake = *deadline;
+	tsadd(deadline, NANOS_PER_TICK);
+	tsadd(&wake, NANOS_PER_TICK - spin);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (tsdiff(&now, deadline) > NANOS_PER_TICK){
+		*deadline = now;
+		return false;
+	}
+	if (tsdiff(&wake, &now) > 0){
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+			;
+	}
+	do
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	while (spin && tsdiff(deadline, &now) > 0);
+	recordjitter(j, tsdiff(&now, deadline));
+	return true;
+}
+
+/* Only the emulation thread runs in real time; the threads it feeds
+ * were started before this and keep the ordinary policy.
+ */
+static void
+enterrealtime(int priority, int cpu)
+{
+	struct sched_param param = {.sched_priority = priority};
+	if (mlockall(MCL_CURRENT|MCL_FUTURE) != 0)
+		die("could not lock memory\n");
+	if (cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			die("could not set cpu affinity\n");
+	}
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+		die("could not enter real-time scheduling\n");
+}
+
+static bool
+readrom(const char *filename, uint8_t buf[MEMORY_SIZE], uint16_t addr, size_t *n)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+
+	*n = fread(buf + addr, 1, MEMORY_SIZE - addr, f);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
 }
 
 static size_t
 loadrom(const char *filename, uint8_t buf[MEMORY_SIZE], uint16_t addr)
+{
+	size_t n = 0;
+	if (!readrom(filename, buf, addr, &n))
+		die("could not read rom\n");
+	return n;
+}
+
+/* A ROM too big for memory, as MegaChip ROMs usually are, is also kept
+ * whole for the machine to read the rest of.
+ */
+static void
+loadextended(CHIP8 *vm, const char *filename, uint16_t addr)
 {
 	FILE *f = fopen(filename, "rb");
-	if (!f)
-		die("could not open rom\n");
+	long size;
+	if (!f || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+		die("could not read rom\n");
+	if (addr + size <= MEMORY_SIZE){
+		fclose(f);
+		return;
+	}
+	if (addr + size > 1 << 24)
+		die("rom too large\n");
 
-	size_t n = fread(buf + addr, 1, MEMORY_SIZE - addr, f);
-	if (ferror(f))
+	uint8_t *image = calloc(addr + size, 1);
+	if (!image)
+		die("out of memory\n");
+	rewind(f);
+	if (fread(image + addr, 1, size, f) != (size_t)size)
 		die("could not read rom\n");
+	fclose(f);
+	vm->xmem = image;
+	vm->xsize = addr + size;
+}
+
+static void
+snapshotname(const ROMFILE *rom, unsigned n, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s.%u.snap", rom->filename, n);
+}
+
+static bool
+savesnapshot(const CHIP8 *vm, const char *filename)
+{
+	uint8_t buf[SNAPSHOT_SIZE];
+	if (!encodesnapshot(vm, buf))
+		return false;
+	FILE *f = fopen(filename, "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(buf, 1, sizeof(buf), f) == sizeof(buf);
+	return fclose(f) == 0 && ok;
+}
 
+static bool
+loadsnapshot(CHIP8 *vm, const char *filename)
+{
+	uint8_t buf[SNAPSHOT_SIZE];
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	bool ok = fread(buf, 1, sizeof(buf), f) == sizeof(buf);
 	fclose(f);
-	return n;
+
+	CHIP8 tmp = *vm;
+	if (!ok || !decodesnapshot(&tmp, buf))
+		return false;
+	*vm = tmp;
+	return true;
 }
 
+/* Editors either rewrite a file in place or write a new one and rename
+ * it over the old, so the watch is on the directory, for both.
+ */
 static void
-cls(CHIP8 *vm)
+watchrom(ROMFILE *rom)
 {
-	memset(vm->display, 0, sizeof(vm->display));
-	clear();
-	vm->dirty = true;
+	char *dir = strdup(rom->filename), *name = strdup(rom->filename);
+	if (!dir || !name)
+		die("out of memory\n");
+	rom->watchname = strdup(basename(name));
+	rom->watchfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (rom->watchfd < 0 || inotify_add_watch(rom->watchfd, dirname(dir), IN_CLOSE_WRITE|IN_MOVED_TO) < 0)
+		die("could not watch rom\n");
+	free(dir);
+	free(name);
 }
 
+static bool
+romchanged(ROMFILE *rom)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t n;
+	while ((n = read(rom->watchfd, buf, sizeof(buf))) > 0){
+		for (char *p = buf; p < buf + n;){
+			const struct inotify_event *e = (const struct inotify_event *)p;
+			if (e->len && strcmp(e->name, rom->watchname) == 0)
+				changed = true;
+			p += sizeof(struct inotify_event) + e->len;
+		}
+	}
+	return changed;
+}
+
+/* Only the bytes that differ between the old and new file are written
+ * to memory. Code that was edited is replaced; everything else, data
+ * the program has since modified included, keeps its current value, as
+ * do the registers and the display. With a restart snapshot selected the
+ * machine is first put back to that snapshot instead, and then gets the
+ * whole of the new file, as the snapshot may be from before any number
+ * of reloads.
+ */
 static void
-refreshscreen(CHIP8 *vm)
+reloadrom(CHIP8 *vm, ROMFILE *rom)
 {
-	if (vm->dirty){
-		refresh();
-		vm->dirty = false;
+	uint8_t fresh[MEMORY_SIZE] = {0};
+	size_t n = 0;
+	char name[4096];
+	if (!readrom(rom->filename, fresh, rom->addr, &n))
+		return;
+
+	if (rom->restart >= 0){
+		snapshotname(rom, (unsigned)rom->restart, name, sizeof(name));
+		loadsnapshot(vm, name);
+	}
+	for (size_t a = rom->addr; a < MEMORY_SIZE; a++){
+		if ((rom->restart >= 0 && a < rom->addr + n) || fresh[a] != rom->image[a]){
+			vm->mem[a] = fresh[a];
+			vm->dirtypages |= 1ull << (a / PAGE_SIZE);
+		}
+	}
+	memcpy(rom->image, fresh, sizeof(fresh));
+}
+
+/* Frames already sent to a graphics terminal, keyed by a hash of the
+ * display. A repeated frame is shown again from this cache instead of
+ * being encoded and uploaded a second time.
+ */
+typedef struct FRAME FRAME;
+struct FRAME{
+	bool used;
+	uint64_t hash;
+	char *data;
+	size_t len;
+};
+
+static FRAME frames[FRAME_CACHE];
+static size_t nextframe;
+
+static uint64_t
+hashframe(const uint64_t display[32])
+{
+	const uint8_t *p = (const uint8_t *)display;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < 32 * sizeof(uint64_t); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static FRAME *
+findframe(uint64_t hash)
+{
+	for (size_t i = 0; i < FRAME_CACHE; i++){
+		if (frames[i].used && frames[i].hash == hash)
+			return &frames[i];
+	}
+	return NULL;
+}
+
+static FRAME *
+newframe(uint64_t hash)
+{
+	FRAME *f = &frames[nextframe++ % FRAME_CACHE];
+	free(f->data);
+	f->data = NULL;
+	f->used = true;
+	f->hash = hash;
+	f->len = 0;
+	return f;
+}
+
+static void
+append(FRAME *f, size_t *cap, const char *s, size_t n)
+{
+	if (f->len + n > *cap){
+		while (f->len + n > *cap)
+			*cap = *cap? *cap * 2 : 4096;
+		if (!(f->data = realloc(f->data, *cap)))
+			die("out of memory\n");
+	}
+	memcpy(f->data + f->len, s, n);
+	f->len += n;
+}
+
+static void
+appendf(FRAME *f, size_t *cap, const char *fmt, ...)
+{
+	char buf[128];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	append(f, cap, buf, (size_t)n);
+}
+
+static void
+showframe(const FRAME *f)
+{
+	fputs("\x1b[H", stdout);
+	fwrite(f->data, 1, f->len, stdout);
+	fflush(stdout);
+}
+
+static void
+rendercells(const uint64_t display[32], bool reset)
+{
+	static uint64_t shown[32];
+	if (reset){
+		clear();
+		memset(shown, 0, sizeof(shown));
+	}
+	for (int row = 0; row < 32; row++){
+		uint64_t changed = display[row] ^ shown[row];
+		for (int col = 0; changed && col < 64; col++){
+			if (changed >> (63 - col) & 1)
+				mvaddch(row, col, (display[row] >> (63 - col) & 1? A_REVERSE : A_NORMAL)|' ');
+		}
+		shown[row] = display[row];
+	}
+	refresh();
+}
+
+/* Each cell stands for 4x6 MegaChip pixels and takes the color of the
+ * one in the middle, reduced to the eight curses colors, or to reverse
+ * video on a terminal without color.
+ */
+static void
+rendercellsmega(const uint32_t color[MEGA_HEIGHT][MEGA_WIDTH], bool reset)
+{
+	static uint8_t shown[32][64];
+	static bool ready, colors;
+	if (!ready){
+		ready = true;
+		if ((colors = has_colors())){
+			start_color();
+			for (short c = 0; c < 8; c++)
+				init_pair(c + 1, COLOR_WHITE, c);
+		}
+	}
+	if (reset){
+		clear();
+		memset(shown, 0xFF, sizeof(shown));
 	}
+	for (int row = 0; row < 32; row++){
+		for (int col = 0; col < 64; col++){
+			uint32_t c = color[row * 6 + 3][col * 4 + 2];
+			uint8_t k = (c >> 23 & 1) | (c >> 14 & 2) | (c >> 5 & 4);
+			if (k == shown[row][col])
+				continue;
+			shown[row][col] = k;
+			if (colors)
+				mvaddch(row, col, COLOR_PAIR(k + 1)|' ');
+			else
+				mvaddch(row, col, (k? A_REVERSE : A_NORMAL)|' ');
+		}
+	}
+	refresh();
 }
 
+/* The part of the MegaChip screen that differs from what the terminal
+ * was last sent, as the smallest rectangle around it.
+ */
+typedef struct RECT RECT;
+struct RECT{
+	int x0, y0, x1, y1;
+};
+
 static bool
-isbitset(int n, uint8_t b)
+changedrect(const uint32_t a[MEGA_HEIGHT][MEGA_WIDTH], const uint32_t b[MEGA_HEIGHT][MEGA_WIDTH], RECT *r)
 {
-	return (b<<n)&0x80;
+	*r = (RECT){MEGA_WIDTH, -1, 0, 0};
+	for (int y = 0; y < MEGA_HEIGHT; y++){
+		if (memcmp(a[y], b[y], sizeof(a[y])) == 0)
+			continue;
+		int x0 = 0, x1 = MEGA_WIDTH;
+		while (a[y][x0] == b[y][x0])
+			x0++;
+		while (a[y][x1 - 1] == b[y][x1 - 1])
+			x1--;
+		if (r->y0 < 0)
+			r->y0 = y;
+		r->y1 = y + 1;
+		r->x0 = x0 < r->x0? x0 : r->x0;
+		r->x1 = x1 > r->x1? x1 : r->x1;
+	}
+	return r->y0 >= 0;
 }
 
 static void
-setpixel(CHIP8 *vm, uint8_t row, uint8_t col)
+keeprect(uint32_t shown[MEGA_HEIGHT][MEGA_WIDTH], const uint32_t color[MEGA_HEIGHT][MEGA_WIDTH], const RECT *r)
 {
-	chtype c;
-	if (vm->display[row][col]){
-		vm->v[0xF] = 1;
-		vm->display[row][col] = false;
-		c = A_NORMAL|' ';
-	} else{
-		vm->display[row][col] = true;
-		c = A_REVERSE|' ';
+	for (int y = r->y0; y < r->y1; y++)
+		memcpy(shown[y] + r->x0, color[y] + r->x0, (r->x1 - r->x0) * sizeof(uint32_t));
+}
+
+static size_t
+base64(char *out, const uint8_t *in, size_t n)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t o = 0;
+	for (size_t i = 0; i < n; i += 3){
+		uint32_t w = (uint32_t)in[i] << 16;
+		if (i + 1 < n) w |= (uint32_t)in[i + 1] << 8;
+		if (i + 2 < n) w |= in[i + 2];
+		out[o++] = digits[(w >> 18) & 0x3F];
+		out[o++] = digits[(w >> 12) & 0x3F];
+		out[o++] = i + 1 < n? digits[(w >> 6) & 0x3F] : '=';
+		out[o++] = i + 2 < n? digits[w & 0x3F] : '=';
 	}
-	mvaddch(row, col, c);
-	vm->dirty = true;
+	return o;
 }
 
+/* The kitty protocol has no 1-bit or palette format, so the frame goes
+ * up as 24-bit RGB; with only two colors zlib shrinks it to a few hundred
+ * bytes anyway. Each cached frame owns an image id, so a repeat is just a
+ * placement of the image the terminal already holds. Images of the same
+ * z-index stack by id, so the last frame's placement is deleted first or
+ * a frame with a lower id would come back underneath it.
+ */
 static void
-draw(CHIP8 *vm, uint16_t inst)
+renderkitty(const uint64_t display[32], bool reset)
 {
-	uint8_t x = vm->v[(inst&0x0F00)>>8] % 64;
-	uint8_t y = vm->v[(inst&0x00F0)>>4] % 32;
-	uint8_t n = inst&0x000F;
+	static const char place[] = "p=1,c=64,r=32,C=1,q=2";
+	static int placed;
+	uint64_t hash = hashframe(display);
+	FRAME *f = findframe(hash);
+	if (reset){
+		printf("\x1b_Ga=d,d=I,i=%d,q=2\x1b\\", MEGA_IMAGE);
+		placed = 0;
+	}
+	bool cached = f;
+	if (!cached)
+		f = newframe(hash);
+	int id = (int)(f - frames) + 1;
+	if (placed && placed != id)
+		printf("\x1b_Ga=d,d=i,i=%d,p=1,q=2\x1b\\", placed);
+	placed = id;
+	if (cached){
+		printf("\x1b[H\x1b_Ga=p,i=%d,%s\x1b\\", id, place);
+		fflush(stdout);
+		return;
+	}
+
+	uint8_t rgb[32 * 64 * 3], z[32 * 64 * 3 + 128];
+	char b64[sizeof(z) / 3 * 4 + 4];
+	uLongf zlen = sizeof(z);
+	for (int row = 0; row < 32; row++){
+		for (int col = 0; col < 64; col++)
+			memset(rgb + (row * 64 + col) * 3, display[row] >> (63 - col) & 1? 0xFF : 0x00, 3);
+	}
+	if (compress2(z, &zlen, rgb, sizeof(rgb), Z_BEST_SPEED) != Z_OK)
+		die("could not compress frame\n");
+	size_t n = base64(b64, z, zlen), cap = 0;
+
+	for (size_t off = 0; off < n; off += KITTY_CHUNK){
+		size_t len = n - off < KITTY_CHUNK? n - off : KITTY_CHUNK;
+		int more = off + len < n;
+		if (!off)
+			appendf(f, &cap, "\x1b_Ga=T,f=24,s=64,v=32,o=z,i=%d,%s,m=%d;",
+			        id, place, more);
+		else
+			appendf(f, &cap, "\x1b_Gm=%d;", more);
+		append(f, &cap, b64 + off, len);
+		append(f, &cap, "\x1b\\", 2);
+	}
+	showframe(f);
 
-	vm->v[0xf] = 0;
-	for (uint8_t row = 0; row < n && y + row < 32 && vm->i + row < MEMORY_SIZE; row++){
-		uint8_t b = vm->mem[vm->i + row];
-		for (uint8_t col = 0; col < 8 && x + col < 64; col++){
-			if (isbitset(col, b))
-				setpixel(vm, y + row, x + col);
+	/* The terminal keeps the image; only the hash is needed from now on. */
+	free(f->data);
+	f->data = NULL;
+	f->len = 0;
+}
+
+/* The MegaChip screen is a single image that is edited in place: after
+ * the first upload only the rectangle that changed is sent, as new data
+ * for that part of the image's root frame.
+ */
+static void
+renderkittymega(const uint32_t color[MEGA_HEIGHT][MEGA_WIDTH], bool reset)
+{
+	static uint32_t shown[MEGA_HEIGHT][MEGA_WIDTH];
+	static uint8_t rgb[MEGA_HEIGHT * MEGA_WIDTH * 3], z[sizeof(rgb) + 1024];
+	static char b64[sizeof(z) / 3 * 4 + 4];
+	RECT r = {0, 0, MEGA_WIDTH, MEGA_HEIGHT};
+	if (!reset && !changedrect(color, shown, &r))
+		return;
+
+	int w = r.x1 - r.x0, h = r.y1 - r.y0;
+	uint8_t *p = rgb;
+	for (int y = r.y0; y < r.y1; y++){
+		for (int x = r.x0; x < r.x1; x++){
+			*p++ = color[y][x] >> 16;
+			*p++ = color[y][x] >> 8;
+			*p++ = color[y][x];
 		}
 	}
+	uLongf zlen = sizeof(z);
+	if (compress2(z, &zlen, rgb, (uLong)(p - rgb), Z_BEST_SPEED) != Z_OK)
+		die("could not compress frame\n");
+	size_t n = base64(b64, z, zlen), cap = 0;
+
+	FRAME f = {0};
+	if (reset)
+		appendf(&f, &cap, "\x1b_Ga=d,d=a,q=2\x1b\\");
+	for (size_t off = 0; off < n; off += KITTY_CHUNK){
+		size_t len = n - off < KITTY_CHUNK? n - off : KITTY_CHUNK;
+		int more = off + len < n;
+		if (off)
+			appendf(&f, &cap, "\x1b_Gm=%d;", more);
+		else if (reset)
+			appendf(&f, &cap, "\x1b_Ga=T,f=24,s=%d,v=%d,o=z,i=%d,p=1,c=64,r=32,C=1,q=2,m=%d;",
+			        MEGA_WIDTH, MEGA_HEIGHT, MEGA_IMAGE, more);
+		else
+			appendf(&f, &cap, "\x1b_Ga=f,r=1,i=%d,x=%d,y=%d,s=%d,v=%d,f=24,o=z,q=2,m=%d;",
+			        MEGA_IMAGE, r.x0, r.y0, w, h, more);
+		append(&f, &cap, b64 + off, len);
+		append(&f, &cap, "\x1b\\", 2);
+	}
+	showframe(&f);
+	free(f.data);
+	keeprect(shown, color, &r);
+}
+
+static void
+cellsize(int *w, int *h)
+{
+	struct winsize ws = {0};
+	*w = 8; *h = 16;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row &&
+	    ws.ws_xpixel && ws.ws_ypixel){
+		*w = ws.ws_xpixel / ws.ws_col;
+		*h = ws.ws_ypixel / ws.ws_row;
+	}
 }
 
 static void
-call(CHIP8 *vm, uint16_t addr)
+sixelrun(FRAME *f, size_t *cap, int n, char c)
 {
-	if (vm->sp >= STACK_SIZE)
-		die("stack overflow\n");
-	vm->stack[vm->sp++] = vm->pc;
-	vm->pc = addr;
+	if (n > 3)
+		appendf(f, cap, "!%d%c", n, c);
+	else while (n--)
+		append(f, cap, &c, 1);
 }
 
+/* Sixel has no notion of cells, so the frame is scaled up to cover the
+ * same 64x32 cells the cell renderer would use. Encoded frames are kept
+ * so that a repeat costs a single write.
+ */
 static void
-rts(CHIP8 *vm)
+rendersixel(const uint64_t display[32])
 {
-	if (!vm->sp)
-		die("stack underflow\n");
-	vm->pc = vm->stack[--vm->sp];
+	uint64_t hash = hashframe(display);
+	FRAME *f = findframe(hash);
+	if (f){
+		showframe(f);
+		return;
+	}
+
+	int cw, ch;
+	size_t cap = 0;
+	cellsize(&cw, &ch);
+	int width = 64 * cw, height = 32 * ch;
+
+	f = newframe(hash);
+	appendf(f, &cap, "\x1bP0;1;0q\"1;1;%d;%d#0;2;0;0;0#1;2;100;100;100", width, height);
+	for (int band = 0; band < height; band += 6){
+		for (int color = 0; color < 2; color++){
+			int run = 0;
+			char prev = 0;
+			appendf(f, &cap, "#%d", color);
+			for (int x = 0; x < width; x++){
+				char six = 0;
+				for (int bit = 0; bit < 6 && band + bit < height; bit++){
+					if ((display[(band + bit) / ch] >> (63 - x / cw) & 1) == (uint64_t)color)
+						six |= 1 << bit;
+				}
+				six += '?';
+				if (run && six != prev){
+					sixelrun(f, &cap, run, prev);
+					run = 0;
+				}
+				prev = six;
+				run++;
+			}
+			sixelrun(f, &cap, run, prev);
+			append(f, &cap, color? "-" : "$", 1);
+		}
+	}
+	append(f, &cap, "\x1b\\", 2);
+	showframe(f);
 }
 
-static uint16_t
-fetch(CHIP8 *vm)
+static int
+cube(uint32_t c)
 {
-	uint16_t i1 = vm->mem[vm->pc++ % MEMORY_SIZE];
-	uint16_t i2 = vm->mem[vm->pc++ % MEMORY_SIZE];
-	return (i1<<8)+i2;
+	int r = ((c >> 16 & 0xFF) * 5 + 127) / 255, g = ((c >> 8 & 0xFF) * 5 + 127) / 255, b = ((c & 0xFF) * 5 + 127) / 255;
+	return r * 36 + g * 6 + b;
+}
+
+/* MegaChip frames go out as sixels in a 6x6x6 color cube. Only the
+ * cells under the rectangle that changed are drawn again, each cell
+ * standing for 4x6 MegaChip pixels.
+ */
+static void
+rendersixelmega(const uint32_t color[MEGA_HEIGHT][MEGA_WIDTH], bool reset)
+{
+	static uint32_t shown[MEGA_HEIGHT][MEGA_WIDTH];
+	RECT r = {0, 0, MEGA_WIDTH, MEGA_HEIGHT};
+	if (!reset && !changedrect(color, shown, &r))
+		return;
+
+	int cw, ch;
+	cellsize(&cw, &ch);
+	r.x0 = r.x0 / 4 * 4; r.x1 = (r.x1 + 3) / 4 * 4;
+	r.y0 = r.y0 / 6 * 6; r.y1 = (r.y1 + 5) / 6 * 6;
+	int col0 = r.x0 / 4, row0 = r.y0 / 6;
+	int width = (r.x1 - r.x0) / 4 * cw, height = (r.y1 - r.y0) / 6 * ch;
+	uint8_t *q = malloc((size_t)width * 6);
+	if (!q)
+		die("out of memory\n");
+
+	FRAME f = {0};
+	size_t cap = 0;
+	appendf(&f, &cap, "\x1b[%d;%dH\x1bP0;1;0q\"1;1;%d;%d", row0 + 1, col0 + 1, width, height);
+	for (int c = 0; c < CUBE; c++)
+		appendf(&f, &cap, "#%d;2;%d;%d;%d", c, c / 36 * 20, c / 6 % 6 * 20, c % 6 * 20);
+	for (int band = 0; band < height; band += 6){
+		bool used[CUBE] = {0};
+		for (int bit = 0; bit < 6; bit++){
+			int y = band + bit;
+			for (int x = 0; x < width; x++){
+				uint8_t *p = q + bit * width + x;
+				*p = CUBE;
+				if (y < height)
+					used[*p = cube(color[(row0 * ch + y) * 6 / ch][(col0 * cw + x) * 4 / cw])] = true;
+			}
+		}
+		for (int c = 0; c < CUBE; c++){
+			if (!used[c])
+				continue;
+			int run = 0;
+			char prev = 0;
+			appendf(&f, &cap, "#%d", c);
+			for (int x = 0; x < width; x++){
+				char six = 0;
+				for (int bit = 0; bit < 6; bit++)
+					six |= (q[bit * width + x] == c) << bit;
+				six += '?';
+				if (run && six != prev){
+					sixelrun(&f, &cap, run, prev);
+					run = 0;
+				}
+				prev = six;
+				run++;
+			}
+			sixelrun(&f, &cap, run, prev);
+			append(&f, &cap, "$", 1);
+		}
+		append(&f, &cap, "-", 1);
+	}
+	append(&f, &cap, "\x1b\\", 2);
+	showframe(&f);
+	free(f.data);
+	free(q);
+	keeprect(shown, color, &r);
+}
+
+static void
+count(_Atomic uint64_t *c, uint64_t n)
+{
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/* Charges the time since mark to a phase and starts the next. */
+static void
+phase(STATS *st, int p, struct timespec *mark)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	count(&st->nanos[p], tsdiff(&now, mark));
+	*mark = now;
+}
+
+static void
+wake(TERMINAL *t)
+{
+	uint64_t one = 1;
+	if (write(t->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		die("could not wake terminal\n");
+}
+
+static void
+publish(TERMINAL *t, const CHIP8 *vm)
+{
+	PICTURE *s = &t->frames[t->back];
+	s->mega = vm->megachip;
+	if (vm->megachip)
+		megaframe(vm->mega, s->color);
+	else
+		memcpy(s->display, vm->display, sizeof(s->display));
+	unsigned old = atomic_exchange(&t->shared, t->back|FRESH);
+	if (old & FRESH)
+		count(&t->stats.dropped, 1);
+	t->back = old & ~FRESH;
+	wake(t);
+}
+
+static bool
+consume(TERMINAL *t)
+{
+	if (!(atomic_load(&t->shared) & FRESH))
+		return false;
+	t->front = atomic_exchange(&t->shared, t->front) & ~FRESH;
+	return true;
+}
+
+static void
+refreshscreen(CHIP8 *vm, TERMINAL *t)
+{
+	if (vm->dirty){
+		publish(t, vm);
+		vm->dirty = false;
+	}
+}
+
+/* Switching between the CHIP-8 and MegaChip displays starts the new
+ * one from a clean slate.
+ */
+static void
+render(TERMINAL *t)
+{
+	static int mode = -1;
+	const PICTURE *s = &t->frames[t->front];
+	bool reset = mode != s->mega;
+	mode = s->mega;
+	if (s->mega) switch (t->renderer){
+		case RENDER_KITTY: renderkittymega(s->color, reset); break;
+		case RENDER_SIXEL: rendersixelmega(s->color, reset); break;
+		default:           rendercellsmega(s->color, reset); break;
+	} else switch (t->renderer){
+		case RENDER_KITTY: renderkitty(s->display, reset); break;
+		case RENDER_SIXEL: rendersixel(s->display);        break;
+		default:           rendercells(s->display, reset); break;
+	}
+}
+
+/* What the panel last saw, to tell how far each counter has moved. */
+typedef struct SAMPLE SAMPLE;
+struct SAMPLE{
+	struct timespec at;
+	uint64_t ticks, cycles, dropped, late;
+	uint64_t nanos[NPHASES];
+	uint64_t hits[MEMORY_SIZE];
+};
+
+static void
+sample(STATS *st, SAMPLE *s)
+{
+	clock_gettime(CLOCK_MONOTONIC, &s->at);
+	s->ticks = atomic_load_explicit(&st->ticks, memory_order_relaxed);
+	s->cycles = atomic_load_explicit(&st->cycles, memory_order_relaxed);
+	s->dropped = atomic_load_explicit(&st->dropped, memory_order_relaxed);
+	s->late = atomic_load_explicit(&st->late, memory_order_relaxed);
+	for (int p = 0; p < NPHASES; p++)
+		s->nanos[p] = atomic_load_explicit(&st->nanos[p], memory_order_relaxed);
+	for (int a = 0; a < MEMORY_SIZE; a++)
+		s->hits[a] = atomic_load_explicit(&st->hits[a], memory_order_relaxed);
+}
+
+/* The panel sits to the right of the display, which every renderer
+ * keeps to 64 columns. The cell renderer draws it through curses like
+ * everything else; the graphics renderers, which bypass curses, write it
+ * straight out. Hidden, it is drawn once more with every line empty.
+ */
+static void
+drawpanel(TERMINAL *t, bool shown)
+{
+	static const char *const phases[NPHASES] = {"execute", "publish", "render", "sleep"};
+	static SAMPLE last, now;
+	static bool primed;
+	char lines[8 + NPHASES + PANEL_HOT][40] = {{0}};
+	int n = 0;
+
+	sample(&t->stats, &now);
+	double secs = tsdiff(&now.at, &last.at) / (double)NANOS_PER_SECOND;
+	uint64_t ticks = now.ticks - last.ticks, cycles = now.cycles - last.cycles;
+	if (shown && primed){
+		snprintf(lines[n++], sizeof(lines[0]), "per tick %6.1f of %u", ticks? cycles / (double)ticks : 0.0,
+		         atomic_load_explicit(&t->stats.inspertick, memory_order_relaxed));
+		for (int p = 0; p < NPHASES; p++)
+			snprintf(lines[n++], sizeof(lines[0]), "%-8s %7.1fms/s", phases[p], (now.nanos[p] - last.nanos[p]) / secs / 1e6);
+		snprintf(lines[n++], sizeof(lines[0]), "dropped  %7.1f/s", (now.dropped - last.dropped) / secs);
+		snprintf(lines[n++], sizeof(lines[0]), "late     %7.1f/s", (now.late - last.late) / secs);
+		snprintf(lines[n++], sizeof(lines[0]), "hot");
+
+		int hot[PANEL_HOT];
+		uint64_t most[PANEL_HOT] = {0};
+		for (int a = 0; a < MEMORY_SIZE; a++){
+			uint64_t d = now.hits[a] - last.hits[a];
+			for (int k = 0; k < PANEL_HOT; k++){
+				if (d <= most[k])
+					continue;
+				memmove(most + k + 1, most + k, (PANEL_HOT - 1 - k) * sizeof(most[0]));
+				memmove(hot + k + 1, hot + k, (PANEL_HOT - 1 - k) * sizeof(hot[0]));
+				most[k] = d;
+				hot[k] = a;
+				break;
+			}
+		}
+		for (int k = 0; k < PANEL_HOT && most[k]; k++)
+			snprintf(lines[n++], sizeof(lines[0]), "  0x%03X %5.1f%%", hot[k], 100.0 * most[k] / cycles);
+	} else if (shown)
+		snprintf(lines[n++], sizeof(lines[0]), "measuring");
+	last = now;
+
+	for (size_t row = 0; row < sizeof(lines) / sizeof(lines[0]); row++){
+		if (t->renderer == RENDER_CELLS){
+			move(row, PANEL_COLUMN);
+			clrtoeol();
+			addstr(lines[row]);
+		} else
+			printf("\x1b[%zu;%dH\x1b[K%s", row + 1, PANEL_COLUMN + 1, lines[row]);
+	}
+	if (t->renderer == RENDER_CELLS)
+		refresh();
+	else
+		fflush(stdout);
+	primed = shown;
 }
 
 #define NOKEY 255
 #define QUIT 254
+#define SNAPSHOT 253
+#define PANEL 252
 static uint8_t
-getkeyboard(const CHIP8 *vm)
+mapkey(const char *keymap, int c)
 {
-	char *o = NULL;
-	int c = getch();
+	const char *o = NULL;
 	if (c == 0x1b)
 		return QUIT;
-	if (c != ERR && (o = strchr(vm->keymap, tolower(c))))
-		return (uint8_t)(o - vm->keymap);
+	if (c == 0x13)
+		return SNAPSHOT;
+	if (c == 0x10)
+		return PANEL;
+	if (c && (o = strchr(keymap, tolower(c))))
+		return (uint8_t)(o - keymap);
 	return NOKEY;
 }
 
 static void
-bcd(CHIP8 *vm, uint8_t vx)
+pushkey(TERMINAL *t, uint8_t k)
 {
-	vm->mem[(vm->i+0)%MEMORY_SIZE] = vx / 100; vx %= 100;
-	vm->mem[(vm->i+1)%MEMORY_SIZE] = vx /  10; vx %=  10;
-	vm->mem[(vm->i+2)%MEMORY_SIZE] = vx /   1; vx %=   1;
+	unsigned head = atomic_load_explicit(&t->keyhead, memory_order_relaxed);
+	if (head - atomic_load_explicit(&t->keytail, memory_order_acquire) < KEY_QUEUE){
+		t->keys[head % KEY_QUEUE] = k;
+		atomic_store_explicit(&t->keyhead, head + 1, memory_order_release);
+	}
+}
+
+static uint8_t
+popkey(TERMINAL *t)
+{
+	unsigned tail = atomic_load_explicit(&t->keytail, memory_order_relaxed);
+	if (tail == atomic_load_explicit(&t->keyhead, memory_order_acquire))
+		return NOKEY;
+	uint8_t k = t->keys[tail % KEY_QUEUE];
+	atomic_store_explicit(&t->keytail, tail + 1, memory_order_release);
+	return k;
+}
+
+/* The terminal thread sleeps until there is a key to read or the
+ * emulator has something for it, and then deals with all of it at once:
+ * if several frames were published meanwhile only the newest is drawn.
+ */
+static void *
+terminalthread(void *arg)
+{
+	TERMINAL *t = arg;
+	struct pollfd fds[] = {
+		{.fd = STDIN_FILENO, .events = POLLIN},
+		{.fd = t->wakefd, .events = POLLIN}
+	};
+
+	bool panel = false;
+	struct timespec due = {0}, now;
+	while (!atomic_load(&t->done)){
+		int timeout = -1;
+		if (panel){
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = tsdiff(&due, &now) > 0? tsdiff(&due, &now) / 1000000 + 1 : 0;
+		}
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+			die("could not poll terminal\n");
+
+		uint64_t n;
+		if (fds[1].revents & POLLIN && read(t->wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+			die("could not read wakeup\n");
+
+		int c;
+		while ((c = getch()) != ERR){
+			uint8_t k = mapkey(t->keymap, c);
+			if (k == PANEL){
+				panel = !panel;
+				atomic_store(&t->panel, panel);
+				clock_gettime(CLOCK_MONOTONIC, &due);
+				drawpanel(t, panel);
+				tsadd(&due, NANOS_PER_SECOND);
+			} else if (k != NOKEY)
+				pushkey(t, k);
+		}
+		if (atomic_exchange(&t->beeps, 0))
+			beep();
+		if (consume(t)){
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			render(t);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			count(&t->stats.nanos[PHASE_RENDER], tsdiff(&end, &start));
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (panel && tsdiff(&now, &due) >= 0){
+			drawpanel(t, true);
+			tsadd(&due, NANOS_PER_SECOND);
+			if (tsdiff(&now, &due) >= 0)
+				due = now;
+		}
+	}
+	return NULL;
 }
 
 static void
-regdmp(CHIP8 *vm, uint8_t vx)
+startterminal(TERMINAL *t, const char *keymap)
 {
-	for (uint8_t i = 0; i <= vx; i++)
-		vm->mem[(vm->i + i)%MEMORY_SIZE] = vm->v[i];
+	t->back = 0;
+	t->front = 1;
+	atomic_init(&t->shared, 2);
+	t->keymap = keymap;
+	if ((t->wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+		die("could not create eventfd\n");
+	if (pthread_create(&t->thread, NULL, terminalthread, t) != 0)
+		die("could not start terminal thread\n");
 }
 
 static void
-regld(CHIP8 *vm, uint8_t vx)
+stopterminal(TERMINAL *t)
+{
+	atomic_store(&t->done, true);
+	wake(t);
+	pthread_join(t->thread, NULL);
+	close(t->wakefd);
+}
+
+/* Ask the terminal for its primary device attributes; a 4 among them
+ * means it can draw sixels. This has to happen before curses takes over
+ * the terminal, and a terminal that never answers costs only the timeout.
+ */
+static bool
+hassixel(void)
+{
+	struct termios old, raw;
+	char buf[64];
+	size_t n = 0;
+	bool found = false;
+
+	int fd = open("/dev/tty", O_RDWR|O_NOCTTY);
+	if (fd < 0)
+		return false;
+	if (tcgetattr(fd, &old) != 0){
+		close(fd);
+		return false;
+	}
+	raw = old;
+	raw.c_lflag &= ~(ICANON|ECHO);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 2;
+	tcsetattr(fd, TCSANOW, &raw);
+
+	if (write(fd, "\x1b[c", 3) == 3){
+		ssize_t r;
+		while (n < sizeof(buf) - 1 && (r = read(fd, buf + n, 1)) == 1 && buf[n++] != 'c')
+			;
+	}
+	buf[n] = 0;
+	tcsetattr(fd, TCSANOW, &old);
+	close(fd);
+
+	for (char *p = strchr(buf, '?'); p && *p && *p != 'c'; p++){
+		if ((*p == '?' || *p == ';') && p[1] == '4' && (p[2] == ';' || p[2] == 'c'))
+			found = true;
+	}
+	return found;
+}
+
+static int
+detectrenderer(void)
+{
+	const char *term = getenv("TERM");
+	if (!isatty(STDOUT_FILENO))
+		return RENDER_CELLS;
+	if (getenv("KITTY_WINDOW_ID") || (term && (strstr(term, "kitty") || strstr(term, "ghostty"))))
+		return RENDER_KITTY;
+	if (hassixel())
+		return RENDER_SIXEL;
+	return RENDER_CELLS;
+}
+
+static int
+parserenderer(const char *s)
 {
-	for (uint8_t i = 0; i <= vx; i++)
-		vm->v[i] = vm->mem[(vm->i + i)%MEMORY_SIZE];
+	if (strcmp(s, "auto") == 0)  return RENDER_AUTO;
+	if (strcmp(s, "cells") == 0) return RENDER_CELLS;
+	if (strcmp(s, "kitty") == 0) return RENDER_KITTY;
+	if (strcmp(s, "sixel") == 0) return RENDER_SIXEL;
+	die("invalid renderer\n");
+	return RENDER_AUTO;
 }
 
 static void
@@ -247,137 +1268,508 @@ initscreen(void)
 	curs_set(0);
 }
 
-#define A    (((inst)>>12)&0x0F)
-#define B    ((inst)&0x0FF)
-#define D    (((inst))&0x0F)
-#define I    vm->i
-#define V(x) vm->v[x]
-#define X    (((inst)>>8)&0x0F)
-#define Y    (((inst)>>4)&0x0F)
-#define Vx   V(X)
-#define Vy   V(((inst)>>4)&0xF)
-#define VF   V(0xf)
-#define VAL  (inst&0x0FFF)
-#define LH   (inst&0x00FF)
-#define PC   vm->pc
-#define DEQ(op, action) if (inst == (op)) { action ; continue;}
-#define DAA(a, action) if (A == a) { action ; continue;}
-#define DAD(a, d, action) if (A == a && D == d) { action ; continue;}
-#define DAB(a, b, action) if (A == a && B == b) { action ; continue;}
-
-static void
-run(CHIP8 *vm)
-{
-	uint8_t keyreg = 17;
-	uint8_t pressed = NOKEY;
-	while (pressed != QUIT){
-		pressed = getkeyboard(vm);
-		if (keyreg < 16 && pressed != NOKEY){
-			vm->v[keyreg] = pressed;
-			keyreg = 17;
-			PC += 2;
-		}
+/* While a successor takes over, each tick starts by sending it what it
+ * can of what has changed, until little enough is left that the machine
+ * can stop here for the rest. The socket is given up for as long as the
+ * successor is connected, and listened on again if it goes away.
+ */
+static bool
+handoff(HOST *h)
+{
+	struct timespec start, end;
+	if (!h->migration){
+		if (!(h->migration = acceptmigration(h->listener)))
+			return false;
+		close(h->listener);
+		unlink(h->handoff);
+		h->listener = -1;
+	}
 
-		struct timespec start = {0}, end = {0};
+	long n = sendround(h->migration, &h->vm);
+	if (n == MIGRATE_BUSY || (n > MIGRATE_FINAL && ++h->rounds < MIGRATE_ROUNDS))
+		return false;
+	if (n >= 0){
 		clock_gettime(CLOCK_MONOTONIC, &start);
+		bool done = finishmigration(h->migration, &h->vm, h->ticks);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (done){
+			h->paused = (end.tv_sec - start.tv_sec) * NANOS_PER_SECOND + end.tv_nsec - start.tv_nsec;
+			return true;
+		}
+	} else
+		abandonmigration(h->migration);
+
+	h->migration = NULL;
+	h->rounds = 0;
+	if ((h->listener = listenmigration(h->handoff)) < 0)
+		die("could not listen for a successor\n");
+	return false;
+}
 
-		for (int i = 0; i < vm->inspertick; i++){
-			uint16_t inst = fetch(vm);
-			DEQ(0x00E0,    cls(vm))
-			DEQ(0x00EE,    rts(vm))
-			DAA(0x1,       PC = VAL)
-			DAA(0x2,       call(vm, VAL))
-			DAA(0x3,       PC += (Vx == LH) * 2)
-			DAA(0x4,       PC += (Vx != LH) * 2)
-			DAD(0x5, 0x00, PC += (Vx == Vy) * 2)
-			DAA(0x6,       Vx = LH)
-			DAA(0x7,       Vx += LH)
-			DAD(0x8, 0x00, Vx = Vy)
-			DAD(0x8, 0x01, Vx |= Vy)
-			DAD(0x8, 0x02, Vx &= Vy)
-			DAD(0x8, 0x03, Vx ^= Vy)
-			DAD(0x8, 0x04, Vx += Vy; VF = (int)Vx + Vy > 0xFF)
-			DAD(0x8, 0x05, Vx -= Vy; VF = (int)Vx > Vy)
-			DAD(0x8, 0x06, VF = Vx&1; Vx >>= 1)
-			DAD(0x8, 0x07, Vx = Vy - Vx)
-			DAD(0x8, 0x0E, VF = isbitset(0, Vx); Vx <<= 1)
-			DAD(0x9, 0x00, PC += (Vx != Vy) * 2)
-			DAA(0xA,       I = VAL)
-			DAA(0xB,       PC = VAL + V(0))
-			DAA(0xC,       Vx = (rand()%255)&LH)
-			DAA(0xD,       draw(vm, inst))
-			DAB(0xE, 0x9E, PC += (Vx == pressed) * 2)
-			DAB(0xE, 0xA1, PC += (Vx != pressed) * 2)
-			DAB(0xF, 0x07, Vx = vm->delay)
-			DAB(0xF, 0x0A, PC -= 2; keyreg = X)
-			DAB(0xF, 0x15, vm->delay = Vx)
-			DAB(0xF, 0x18, vm->sound = Vx)
-			DAB(0xF, 0x1E, I += Vx; VF = (int)Vx + I > 0xFFF)
-			DAB(0xF, 0x29, I = Vx * 5)
-			DAB(0xF, 0x33, bcd(vm, Vx))
-			DAB(0xF, 0x55, regdmp(vm, X))
-			DAB(0xF, 0x65, regld(vm, X))
-			die("invalid instruction\n");
+/* With run-ahead the frame shown is the one h->ahead frames on from
+ * the machine's, run on a scratch copy with the keys held as they are
+ * now, so a ROM that answers a key a frame or more after reading it is
+ * seen to answer at once. The copy is thrown away each tick: sound,
+ * recordings, traces and snapshots all follow the machine itself.
+ * MegaChip frames are shown as they come, and a copy that faults or
+ * enters MegaChip mode leaves the machine's own frame to be shown.
+ */
+static CHIP8 *
+runahead(HOST *h, uint8_t pressed)
+{
+	static CHIP8 future;
+	CHIP8 *vm = &h->vm;
+	if (vm->megachip){
+		h->showing = false;
+		return vm;
+	}
+
+	releasemega(&future);
+	future = *vm;
+	for (int f = 0; f < h->ahead; f++){
+		presskey(&future, pressed);
+		for (uint64_t left = h->inspertick; left;){
+			uint64_t before = future.cycles;
+			int e = rununtil(&future, left);
+			left -= future.cycles - before;
+			if (e == EVENT_FAULT || future.megachip){
+				vm->dirty |= h->showing;
+				h->showing = false;
+				return vm;
+			}
+			if (e == EVENT_KEYWAIT)
+				break;
+		}
+		ticktimers(&future);
+	}
+
+	/* the copy is new every tick, so whether it needs showing is a
+	 * matter of whether it differs from the last one shown */
+	future.dirty = !h->showing || memcmp(future.display, h->shown, sizeof(h->shown)) != 0;
+	memcpy(h->shown, future.display, sizeof(h->shown));
+	h->showing = true;
+	vm->dirty = false;
+	return &future;
+}
+
+static void
+run(HOST *h, TERMINAL *t)
+{
+	CHIP8 *vm = &h->vm;
+	STATS *st = &t->stats;
+	uint8_t pressed = NOKEY;
+	uint64_t slot = 0;
+	struct timespec deadline, mark;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	mark = deadline;
+	atomic_store(&st->inspertick, h->inspertick);
+	while ((pressed = popkey(t)) != QUIT){
+		bool profiling = atomic_load_explicit(&t->panel, memory_order_relaxed);
+		uint64_t before = vm->cycles;
+		if (h->handoff && handoff(h))
+			break;
+		if (pressed == SNAPSHOT){
+			char name[4096];
+			snapshotname(h->rom, h->rom->snapshots++, name, sizeof(name));
+			savesnapshot(vm, name);
+			pressed = NOKEY;
+		}
+		if (h->rom->watchfd >= 0 && romchanged(h->rom))
+			reloadrom(vm, h->rom);
+		if (h->profile && profilerequested() && !dumpprofile(h->profile))
+			die("could not write profile\n");
+		vm->keys = pressed < 16? 1 << pressed : 0;
+		presskey(vm, pressed);
+
+		/* Tracing takes one instruction at a time, so that each can be
+		 * written out with the state it left behind, and so does
+		 * counting where they ran for the panel. */
+		for (int left = h->inspertick; left > 0;){
+			uint64_t start = vm->cycles;
+			uint16_t pc = vm->pc;
+			uint16_t inst = vm->mem[pc % MEMORY_SIZE] << 8 | vm->mem[(pc + 1) % MEMORY_SIZE];
+			int e = rununtil(vm, h->tracer || profiling? 1 : left);
+			left -= vm->cycles - start;
+			if (profiling && vm->cycles != start)
+				count(&st->hits[pc % MEMORY_SIZE], 1);
+			if (h->tracer && vm->cycles != start && !tracestep(h->tracer, vm, h->ticks, pc, inst))
+				die("could not write trace\n");
+			if (e == EVENT_FAULT){
+				char m[64];
+				snprintf(m, sizeof(m), "%s\n", vm->fault);
+				if (h->tracer)
+					closetrace(h->tracer);
+				die(m);
+			}
+			if (e == EVENT_SOUND && h->audio)
+				settone(h->audio, slot + h->inspertick - left - 1, vm->sound);
+			if (e == EVENT_DRAW && vm->megachip)
+				refreshscreen(vm, t);
+			if (e == EVENT_KEYWAIT)
+				break;
 		}
 
-		if (vm->delay)
-			vm->delay--;
 		if (vm->sound){
-			if (vm->beep)
-				beep();
-			vm->sound--;
+			if (h->beep && !atomic_exchange(&t->beeps, 1))
+				wake(t);
+			if (vm->sound == 1 && h->audio)
+				settone(h->audio, slot + h->inspertick, false);
 		}
+		ticktimers(vm);
+		slot += h->inspertick;
+		if (h->audio)
+			advanceaudio(h->audio, slot);
 
-		clock_gettime(CLOCK_MONOTONIC, &end);
-		sleeptonexttick(&start, &end);
-		refreshscreen(vm);
+		if (vm->dirty && h->recorder && !vm->megachip && !recordframe(h->recorder, h->ticks, vm->display))
+			die("could not write recording\n");
+		CHIP8 *shown = h->ahead? runahead(h, pressed) : vm;
+		count(&st->cycles, vm->cycles - before);
+		phase(st, PHASE_EXECUTE, &mark);
+		refreshscreen(shown, t);
+		phase(st, PHASE_PUBLISH, &mark);
+		h->ticks++;
+		count(&st->ticks, 1);
+		if (!sleeptonexttick(&deadline, h->priority? SPIN_NANOS : 0, &h->jitter))
+			count(&st->late, 1);
+		phase(st, PHASE_SLEEP, &mark);
+	}
+}
+
+/* Engine choice is a matter of measurement: the ROM itself is run on a
+ * scratch copy of the machine under each engine in turn, a few rounds
+ * of a millisecond or two each, pressing keys and restarting as needed
+ * to keep it busy. The winner is remembered per CPU model and per class
+ * of ROM, so that only the first run of its kind pays for this.
+ */
+static double
+measure(const CHIP8 *initial, int engine, long long nanos)
+{
+	CHIP8 vm = *initial;
+	uint64_t total = 0;
+	struct timespec start, now;
+	vm.engine = engine;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do{
+		for (int i = 0; i < 16; i++){
+			uint64_t before = vm.cycles;
+			int e = rununtil(&vm, 1000);
+			total += vm.cycles - before;
+			vm.keys = 1 << (total >> 10 & 15);
+			if (e == EVENT_KEYWAIT)
+				presskey(&vm, total & 15);
+			else if (e == EVENT_FAULT){
+				releasemega(&vm);
+				vm = *initial;
+				vm.engine = engine;
+			} else if (e == EVENT_BUDGET)
+				ticktimers(&vm);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (tsdiff(&now, &start) < nanos);
+	releasemega(&vm);
+	return total / (double)tsdiff(&now, &start);
+}
+
+static int
+fastestengine(const CHIP8 *vm)
+{
+	double best[NENGINES] = {0};
+	int fastest = ENGINE_IFCHAIN;
+	for (int round = 0; round < CALIBRATE_ROUNDS; round++){
+		for (int e = 0; e < NENGINES; e++){
+			double speed = measure(vm, e, CALIBRATE_NANOS);
+			if (speed > best[e])
+				best[e] = speed;
+		}
+	}
+	for (int e = 0; e < NENGINES; e++){
+		if (best[e] > best[fastest])
+			fastest = e;
+	}
+	releasecode();
+	return fastest;
+}
+
+static void
+cpumodel(char *buf, size_t len)
+{
+	char line[256];
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	snprintf(buf, len, "unknown");
+	while (f && fgets(line, sizeof(line), f)){
+		char *colon = strchr(line, ':');
+		if (strncmp(line, "model name", 10) == 0 && colon){
+			colon += strspn(colon, ": \t");
+			colon[strcspn(colon, "\t\n")] = 0;
+			snprintf(buf, len, "%s", colon);
+			break;
+		}
+	}
+	if (f)
+		fclose(f);
+}
+
+/* A ROM's class is whichever kind of instruction dominates its code:
+ * drawing, branching, arithmetic or memory access. ROMs in the same
+ * class stress the dispatcher in much the same way.
+ */
+static const char *
+romclass(const CHIP8 *vm)
+{
+	static const char *const names[] = {"draw", "branch", "alu", "mem"};
+	static const uint8_t kinds[16] = {1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 3, 1, 2, 0, 1, 3};
+	unsigned counts[4] = {0}, best = 0;
+	for (size_t a = vm->pc; a + 1 < MEMORY_SIZE; a += 2){
+		if (vm->mem[a] || vm->mem[a + 1])
+			counts[kinds[vm->mem[a] >> 4]]++;
+	}
+	for (unsigned k = 1; k < 4; k++){
+		if (counts[k] > counts[best])
+			best = k;
+	}
+	return names[best];
+}
+
+static void
+enginecache(char *buf, size_t len)
+{
+	const char *dir = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+	if (dir && *dir)
+		snprintf(buf, len, "%s/chip8-engines", dir);
+	else
+		snprintf(buf, len, "%s/.cache/chip8-engines", home? home : ".");
+}
+
+static int
+chooseengine(const CHIP8 *vm)
+{
+	char path[4096], cpu[128], line[512];
+	const char *class = romclass(vm);
+	enginecache(path, sizeof(path));
+	cpumodel(cpu, sizeof(cpu));
+
+	FILE *f = fopen(path, "r");
+	while (f && fgets(line, sizeof(line), f)){
+		char *c = strchr(line, '\t'), *e = c? strchr(c + 1, '\t') : NULL;
+		if (!e)
+			continue;
+		*c++ = *e++ = 0;
+		e[strcspn(e, "\n")] = 0;
+		if (strcmp(line, cpu) != 0 || strcmp(c, class) != 0)
+			continue;
+		for (int i = 0; i < NENGINES; i++){
+			if (strcmp(e, enginenames[i]) == 0){
+				fclose(f);
+				return i;
+			}
+		}
+	}
+	if (f)
+		fclose(f);
+
+	int engine = fastestengine(vm);
+	if ((f = fopen(path, "a"))){
+		fprintf(f, "%s\t%s\t%s\n", cpu, class, enginenames[engine]);
+		fclose(f);
+	}
+	return engine;
+}
+
+static int
+parseengine(const char *s)
+{
+	if (strcmp(s, "auto") == 0)
+		return ENGINE_AUTO;
+	for (int e = 0; e < NENGINES; e++){
+		if (strcmp(s, enginenames[e]) == 0)
+			return e;
 	}
+	die("invalid engine\n");
+	return ENGINE_AUTO;
 }
 
-#define USAGE "usage: chip8 [-b] [-a ADDR] [-k KEYMAP] [-r SEED] [-s SPEED] ROM\n"
+static int
+parseperf(const char *s)
+{
+	if (strcmp(s, "map") == 0)     return PERF_MAP;
+	if (strcmp(s, "jitdump") == 0) return PERF_JITDUMP;
+	die("invalid profiler output\n");
+	return 0;
+}
+
+#define USAGE "usage: chip8 [-bH] [-a ADDR] [-A FRAMES] [-c CPU] [-e auto|ifchain|table|cached|jit] [-g auto|cells|kitty|sixel]\n" \
+              "             [-k KEYMAP] [-p PROFILE [-F HZ]] [-P map|jitdump] [-r SEED] [-R PRIORITY] [-s SPEED] [-S SNAPSHOT]\n" \
+              "             [-D RECORDING] [-L SOCKET] [-m SOCKET] [-t TRACE] [-w WAVFILE | -W PCMFILE]" ROM_USAGE "\n"
 int
 main(int argc, char **argv)
 {
-	CHIP8 vm = {.pc = 512, .inspertick = 11, .keymap = "x123qweasdzc4rfv", .beep = false};
-	int ch = 0;
-	uint16_t addr = vm.pc;
-	while ((ch = getopt(argc, argv, "hba:k:r:s:")) != -1) switch (ch){
+#ifdef EMBED_ROM
+	/* The initial machine is laid out entirely by the compiler. Being
+	 * writable data it is mapped copy-on-write straight out of the
+	 * executable, so startup does no file I/O and no copying, and only
+	 * the pages the ROM actually touches are ever faulted in.
+	 */
+	static HOST host = {
+		.vm = {.mem = {FONT, [ROM_ADDR] = ROM_DATA}, .pc = ROM_ADDR},
+		.inspertick = ROM_SPEED, .keymap = ROM_KEYMAP, .cpu = -1, .listener = -1
+	};
+#else
+	static HOST host = {.vm = {.pc = 512}, .inspertick = 11, .keymap = "x123qweasdzc4rfv", .beep = false, .cpu = -1, .listener = -1};
+#endif
+	static TERMINAL term;
+	static ROMFILE rom = {.filename = "chip8", .watchfd = -1, .restart = -1};
+	bool hotreload = false;
+	int ch = 0, engine = ENGINE_IFCHAIN, perf = 0;
+	uint16_t addr = host.vm.pc;
+	const char *audiofile = NULL, *recording = NULL, *trace = NULL, *takeover = NULL;
+	bool raw = false;
+	long hz = PROFILE_HZ;
+	while ((ch = getopt(argc, argv, "hbHa:A:c:D:e:F:g:k:L:m:p:P:r:R:s:S:t:w:W:")) != -1) switch (ch){
 		case 'b':
-			vm.beep = true;
+			host.beep = true;
+			break;
+		case 'H':
+			if (ROM_ARGS == 0)
+				die("an embedded rom cannot be reloaded\n");
+			hotreload = true;
 			break;
 
 		case 'a':
-			addr = vm.pc = atoi(optarg);
+			if (ROM_ARGS == 0)
+				die("load address is fixed by the embedded rom\n");
+			addr = host.vm.pc = atoi(optarg);
 			if (addr < 0 || addr >= MEMORY_SIZE)
 				die("invalid load address\n");
 			break;
+		case 'A':
+			if ((host.ahead = atoi(optarg)) <= 0)
+				die("invalid run-ahead\n");
+			break;
+		case 'c':
+			host.cpu = atoi(optarg);
+			if (host.cpu < 0 || host.cpu >= CPU_SETSIZE)
+				die("invalid cpu\n");
+			break;
+		case 'D':
+			recording = optarg;
+			break;
+		case 'e':
+			engine = parseengine(optarg);
+			break;
+		case 'F':
+			if ((hz = atol(optarg)) <= 0 || hz > 100000)
+				die("invalid sampling rate\n");
+			break;
+		case 'g':
+			term.renderer = parserenderer(optarg);
+			break;
 		case 'k':
 			if (strlen(optarg) != 16)
 				die("invalid keymap\n");
-			vm.keymap = optarg;
+			host.keymap = optarg;
+			break;
+		case 'L':
+			host.handoff = optarg;
+			break;
+		case 'm':
+			takeover = optarg;
+			break;
+		case 'p':
+			host.profile = optarg;
+			break;
+		case 'P':
+			perf |= parseperf(optarg);
 			break;
 		case 'r':
-			srand(atoi(optarg));
+			host.vm.seed = atoi(optarg);
+			break;
+		case 'R':
+			host.priority = atoi(optarg);
+			if (host.priority < sched_get_priority_min(SCHED_FIFO) ||
+			    host.priority > sched_get_priority_max(SCHED_FIFO))
+				die("invalid real-time priority\n");
 			break;
 		case 's':
-			vm.inspertick = atoi(optarg);
-			if (vm.inspertick <= 0)
+			host.inspertick = atoi(optarg);
+			if (host.inspertick <= 0)
 				die("invalid instructions per tick\n");
 			break;
+		case 'S':
+			rom.restart = atoi(optarg);
+			if (rom.restart < 0)
+				die("invalid snapshot\n");
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'w':
+		case 'W':
+			audiofile = optarg;
+			raw = ch == 'W';
+			break;
 		default:
 			die(USAGE);
 			break;
 	}
 	argc -= optind; argv += optind;
 
-	if (argc != 1)
+	if (argc != ROM_ARGS)
 		die(USAGE);
+	if (rom.restart >= 0 && !hotreload)
+		die("a restart snapshot needs -H\n");
 
+	if (term.renderer == RENDER_AUTO)
+		term.renderer = detectrenderer();
+#ifndef EMBED_ROM
+	if (!loadfonts(host.vm.mem, 0))
+		die("could not load fonts\n");
+	rom.filename = argv[0];
+	rom.addr = addr;
+	loadrom(rom.filename, rom.image, addr);
+	memcpy(host.vm.mem + addr, rom.image + addr, MEMORY_SIZE - addr);
+	loadextended(&host.vm, rom.filename, addr);
+	if (hotreload)
+		watchrom(&rom);
+#endif
+	host.rom = &rom;
+	if (perf && !perfcode(perf))
+		die("could not open profiler output\n");
+	host.vm.engine = engine == ENGINE_AUTO? chooseengine(&host.vm) : engine;
+	if (takeover && !receivemigration(takeover, &host.vm, &host.ticks))
+		die("could not take over\n");
+	if (host.handoff && (host.listener = listenmigration(host.handoff)) < 0)
+		die("could not listen for a successor\n");
+	if (audiofile && !(host.audio = openaudio(audiofile, raw, (uint64_t)host.inspertick * TICKS_PER_SECOND)))
+		die("could not open audio output\n");
+	if (recording && !(host.recorder = openrecording(recording)))
+		die("could not open recording\n");
+	if (trace && !(host.tracer = opentrace(trace)))
+		die("could not open trace\n");
 	initscreen();
-	loadfonts(vm.mem, 0);
-	loadrom(argv[0], vm.mem, addr);
-	run(&vm);
+	startterminal(&term, host.keymap);
+	if (host.priority)
+		enterrealtime(host.priority, host.cpu);
+	if (host.profile && !startprofile(&host.vm, hz))
+		die("could not start profiler\n");
+	run(&host, &term);
+	if (host.profile)
+		stopprofile();
+	stopterminal(&term);
+	if (host.audio && !closeaudio(host.audio))
+		die("could not write audio output\n");
+	if (host.recorder && !closerecording(host.recorder, host.ticks))
+		die("could not write recording\n");
+	if (host.tracer && !closetrace(host.tracer))
+		die("could not write trace\n");
+	if (host.profile && !dumpprofile(host.profile))
+		die("could not write profile\n");
 
 	endwin();
+	if (host.listener >= 0)
+		unlink(host.handoff);
+	if (host.paused)
+		fprintf(stderr, "handed over after %u rounds, stopped for %lldus\n", host.rounds + 1, host.paused / 1000);
+	if (host.priority)
+		reportjitter(&host.jitter);
 	return EXIT_SUCCESS;
 }
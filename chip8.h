@@ -0,0 +1,214 @@
+/* A CHIP-8 emulator.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * The machine itself, with no terminal, timing or file I/O, for hosts
+ * that want to drive it themselves.
+ */
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TICKS_PER_SECOND 60
+#define STACK_SIZE 5
+#define MEMORY_SIZE 4096
+#define SNAPSHOT_MAGIC "C8SN\x01"
+#define SNAPSHOT_SIZE (5 + MEMORY_SIZE + STACK_SIZE * 2 + 6 + 2 + 16 + 32 * 64)
+#define MEGA_WIDTH 256
+#define MEGA_HEIGHT 192
+#define PAGE_SIZE 64
+
+#define FONT \
+	0xF0, 0x90, 0x90, 0x90, 0xF0, /* 0 */ \
+	0x20, 0x60, 0x20, 0x20, 0x70, /* 1 */ \
+	0xF0, 0x10, 0xF0, 0x80, 0xF0, /* 2 */ \
+	0xF0, 0x10, 0xF0, 0x10, 0xF0, /* 3 */ \
+	0x90, 0x90, 0xF0, 0x10, 0x10, /* 4 */ \
+	0xF0, 0x80, 0xF0, 0x10, 0xF0, /* 5 */ \
+	0xF0, 0x80, 0xF0, 0x90, 0xF0, /* 6 */ \
+	0xF0, 0x10, 0x20, 0x40, 0x40, /* 7 */ \
+	0xF0, 0x90, 0xF0, 0x90, 0xF0, /* 8 */ \
+	0xF0, 0x90, 0xF0, 0x10, 0xF0, /* 9 */ \
+	0xF0, 0x90, 0xF0, 0x90, 0x90, /* A */ \
+	0xE0, 0x90, 0xE0, 0x90, 0xE0, /* B */ \
+	0xF0, 0x80, 0x80, 0x80, 0xF0, /* C */ \
+	0xE0, 0x90, 0x90, 0x90, 0xE0, /* D */ \
+	0xF0, 0x80, 0xF0, 0x80, 0xF0, /* E */ \
+	0xF0, 0x80, 0xF0, 0x80, 0x80  /* F */
+
+/* Why rununtil() came back. */
+enum{
+	EVENT_NONE,
+	EVENT_DRAW,    /* 00E0 or DXYN changed the display, or MegaChip updated */
+	EVENT_KEYWAIT, /* FX0A is waiting for presskey() */
+	EVENT_SOUND,   /* FX18 started or stopped the sound timer */
+	EVENT_BREAK,   /* pc reached a breakpoint; not yet executed */
+	EVENT_BUDGET,  /* the cycle budget ran out */
+	EVENT_FAULT    /* the instruction at pc cannot run; see fault */
+};
+
+/* How instructions are dispatched. They all behave identically; which
+ * one is fastest depends on the host CPU and on the ROM.
+ */
+enum{
+	ENGINE_IFCHAIN, /* decode every instruction through a chain of tests */
+	ENGINE_TABLE,   /* dispatch through tables indexed by opcode fields */
+	ENGINE_CACHED,  /* decode each address once and keep the handler */
+	ENGINE_JIT,     /* compile straight-line runs into native calls */
+	NENGINES
+};
+
+extern const char *const enginenames[NENGINES];
+
+/* How MegaChip sprites are combined with what is under them. */
+enum{
+	BLEND_NORMAL,
+	BLEND_25,
+	BLEND_50,
+	BLEND_75,
+	BLEND_ADD,
+	BLEND_MULTIPLY
+};
+
+/* The MegaChip display. Sprites are drawn into index, one palette entry
+ * per pixel, which is also what collisions are tested against; color is
+ * brought in only once a frame uses a blend mode or changes the palette
+ * under pixels already drawn, since until then it follows from index.
+ * 00E0 shows the frame, and the planes are cleared at the first drawing
+ * after it, so the host can take the frame when EVENT_DRAW comes back.
+ */
+typedef struct MEGACHIP MEGACHIP;
+struct MEGACHIP{
+	uint16_t width, height; /* of sprites, from 03NN and 04NN */
+	uint8_t blend, collide, alpha;
+	bool shown;             /* the planes hold a frame already updated */
+	bool truecolor;         /* color holds this frame's pixels */
+	uint32_t palette[256];  /* ARGB; entry 0 is transparent */
+	uint8_t index[MEGA_HEIGHT][MEGA_WIDTH];
+	uint32_t color[MEGA_HEIGHT][MEGA_WIDTH];
+};
+
+/* A zeroed CHIP8 with fonts and a ROM in mem and pc at the entry point
+ * is ready to run. Everything here is plain machine state, so outside
+ * MegaChip mode a struct copy is a complete save state. The MegaChip
+ * display is too large to carry in every copy: 0011 allocates it and
+ * 0010 frees it, and copymachine() and releasemega() handle machines
+ * that may have one.
+ */
+typedef struct CHIP8 CHIP8;
+struct CHIP8{
+	uint8_t mem[MEMORY_SIZE];
+	uint16_t stack[STACK_SIZE];
+	uint16_t pc, sp, i;
+
+	uint8_t delay, sound;
+	uint8_t v[16];
+
+	bool dirty;
+	uint64_t display[32];   /* a row each, column 0 in the top bit */
+	bool observing;         /* see observe() */
+
+	/* What has been written since the host last cleared these: a bit
+	 * per PAGE_SIZE bytes of mem, per display row and per MegaChip row,
+	 * so that a copy of the machine elsewhere can be kept up to date.
+	 */
+	uint64_t dirtypages;
+	uint32_t dirtyrows;
+	uint64_t dirtymega[MEGA_HEIGHT / 64];
+
+	bool megachip;          /* 0011 switched to the MegaChip display */
+	uint8_t ihigh;          /* bits 16-23 of I, from 01NN */
+
+	uint16_t keys;          /* bit n set while key n is held */
+	bool waiting;           /* FX0A is waiting on a key for waitreg */
+	uint8_t waitreg;
+
+	uint32_t seed;          /* for CXNN */
+	uint8_t engine;
+
+	uint64_t cycles;        /* instructions executed */
+	int event;
+	const char *fault;
+
+	unsigned nbreaks;
+	uint16_t resume;        /* breakpoint to step over, plus one */
+	uint8_t breaks[MEMORY_SIZE / 8];
+
+	/* Memory past the first 4K, such as the sprites and palettes of a
+	 * large MegaChip ROM, is read-only and read from the ROM image, which
+	 * copies of the machine share.
+	 */
+	const uint8_t *xmem;
+	uint32_t xsize;
+
+	MEGACHIP *mega;         /* while megachip */
+};
+
+bool loadfonts(uint8_t buf[MEMORY_SIZE], uint16_t addr);
+
+/* Execute at most budget instructions, stopping early after the first
+ * that raises an event. Calling again after EVENT_BREAK executes the
+ * instruction at the breakpoint; while FX0A is waiting nothing runs.
+ */
+int rununtil(CHIP8 *vm, uint64_t budget);
+void presskey(CHIP8 *vm, uint8_t key);
+void ticktimers(CHIP8 *vm);
+void setbreak(CHIP8 *vm, uint16_t addr, bool on);
+
+/* A host that only looks at the display now and then, rather than
+ * showing it, can set observing: DXYN and 00E0 then still change the
+ * display and set VF but neither mark it nor return EVENT_DRAW, so a
+ * frame runs through in one call. observe() reads the w by h pixels at
+ * x, y straight from the rows into out, scale by scale pixels to a byte
+ * of 0 to 255 for how many are lit, and returns the bytes written, or 0
+ * if the view is empty or does not fit the CHIP-8 display. The MegaChip
+ * screen is not observed.
+ */
+typedef struct VIEW VIEW;
+struct VIEW{
+	uint8_t x, y, w, h, scale;
+};
+size_t observe(const CHIP8 *vm, const VIEW *view, uint8_t *out);
+
+/* Copy a whole machine over another, returning false if there is no
+ * memory for the MegaChip display; and free the display of one that is
+ * about to be dropped or cleared.
+ */
+bool copymachine(CHIP8 *to, const CHIP8 *from);
+void releasemega(CHIP8 *vm);
+
+/* The MegaChip screen in ARGB as it stands, which after the EVENT_DRAW
+ * from 00E0 is the frame just updated.
+ */
+void megaframe(const MEGACHIP *m, uint32_t out[MEGA_HEIGHT][MEGA_WIDTH]);
+
+/* The cached and JIT engines keep decoded and compiled code per thread,
+ * shared by every machine the thread runs and checked against memory
+ * before use, so self-modifying code, reloads and restored snapshots
+ * need no explicit invalidation. A thread that is done running machines
+ * can give the memory back.
+ */
+void releasecode(void);
+
+/* Name compiled blocks for host profilers, as chip8_block_0xADDR:
+ * PERF_MAP appends to /tmp/perf-PID.map, PERF_JITDUMP writes
+ * /tmp/jit-PID.dump for perf inject. Without the JIT there is nothing
+ * to name and this does nothing.
+ */
+enum{
+	PERF_MAP = 1,
+	PERF_JITDUMP = 2
+};
+bool perfcode(int what);
+
+/* Snapshots hold the plain CHIP-8 machine. One cannot be taken in
+ * MegaChip mode, and restoring one leaves MegaChip mode.
+ */
+bool encodesnapshot(const CHIP8 *vm, uint8_t buf[SNAPSHOT_SIZE]);
+bool decodesnapshot(CHIP8 *vm, const uint8_t buf[SNAPSHOT_SIZE]);
+
+#endif
@@ -0,0 +1,1146 @@
+/* A CHIP-8 emulator.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#include "chip8.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+	#define HAVE_JIT
+#endif
+
+#define JIT_BLOCK 32
+#define JIT_SIZE (1 << 20)
+#define JITDUMP_MAGIC 0x4A695444
+#define EM_X86_64 62
+
+const char *const enginenames[NENGINES] = {"ifchain", "table", "cached", "jit"};
+
+typedef void (*OPFN)(CHIP8 *vm, uint16_t inst);
+
+/* A compiled run of instructions, and the bytes it was compiled from. */
+typedef struct BLOCK BLOCK;
+struct BLOCK{
+	void (*fn)(CHIP8 *vm);
+	uint16_t n;
+	uint8_t bytes[JIT_BLOCK * 2];
+};
+
+typedef struct CODE CODE;
+struct CODE{
+	OPFN ops[MEMORY_SIZE];
+	uint16_t insts[MEMORY_SIZE];
+
+	BLOCK *blocks[MEMORY_SIZE];
+	uint8_t *text;
+	size_t used;
+	bool nojit;
+};
+
+static _Thread_local CODE *code;
+
+bool
+loadfonts(uint8_t buf[MEMORY_SIZE], uint16_t addr)
+{
+	static const uint8_t font[] = {FONT};
+
+	if (addr >= MEMORY_SIZE - sizeof(font))
+		return false;
+	memcpy(buf + addr, font, sizeof(font));
+	return true;
+}
+
+static void
+touch(CHIP8 *vm, uint16_t addr)
+{
+	vm->dirtypages |= 1ull << (addr / PAGE_SIZE);
+}
+
+static void
+touchmega(CHIP8 *vm, int from, int n)
+{
+	for (int y = from; y < from + n; y++)
+		vm->dirtymega[y / 64] |= 1ull << (y % 64);
+}
+
+static void
+fault(CHIP8 *vm, const char *m)
+{
+	vm->fault = m;
+	vm->event = EVENT_FAULT;
+}
+
+/* In MegaChip mode 00E0 is the update: it shows the frame drawn since
+ * the last one, which is cleared away only when drawing starts again.
+ */
+static void
+cls(CHIP8 *vm)
+{
+	if (vm->megachip)
+		vm->mega->shown = true;
+	else{
+		memset(vm->display, 0, sizeof(vm->display));
+		vm->dirtyrows |= vm->observing? 0 : UINT32_MAX;
+	}
+	if (vm->observing)
+		return;
+	vm->dirty = true;
+	vm->event = EVENT_DRAW;
+}
+
+static bool
+isbitset(int n, uint8_t b)
+{
+	return (b<<n)&0x80;
+}
+
+/* Memory as MegaChip sprites and palettes see it: the first 4K as the
+ * machine has it, then the ROM image.
+ */
+static uint8_t
+xread(const CHIP8 *vm, uint32_t addr)
+{
+	return addr < MEMORY_SIZE? vm->mem[addr] : addr < vm->xsize? vm->xmem[addr] : 0;
+}
+
+static const uint8_t *
+xspan(const CHIP8 *vm, uint32_t addr, size_t n, uint8_t *buf)
+{
+	if (addr + n <= MEMORY_SIZE)
+		return vm->mem + addr;
+	if (addr >= MEMORY_SIZE && addr + n <= vm->xsize)
+		return vm->xmem + addr;
+	for (size_t k = 0; k < n; k++)
+		buf[k] = xread(vm, addr + k);
+	return buf;
+}
+
+static uint32_t
+xaddr(const CHIP8 *vm)
+{
+	return (uint32_t)vm->ihigh << 16 | vm->i;
+}
+
+static void
+megaclear(CHIP8 *vm)
+{
+	MEGACHIP *m = vm->mega;
+	if (!m->shown)
+		return;
+	touchmega(vm, 0, MEGA_HEIGHT);
+	memset(m->index, 0, sizeof(m->index));
+	m->shown = false;
+	m->truecolor = false;
+}
+
+static void
+truecolor(CHIP8 *vm)
+{
+	MEGACHIP *m = vm->mega;
+	if (m->truecolor)
+		return;
+	touchmega(vm, 0, MEGA_HEIGHT);
+	for (int y = 0; y < MEGA_HEIGHT; y++)
+		for (int x = 0; x < MEGA_WIDTH; x++)
+			m->color[y][x] = m->palette[m->index[y][x]];
+	m->truecolor = true;
+}
+
+static uint32_t
+blend(int mode, uint32_t s, uint32_t d)
+{
+	uint32_t out = 0xFF000000;
+	for (int shift = 0; shift < 24; shift += 8){
+		unsigned a = s >> shift & 0xFF, b = d >> shift & 0xFF, c;
+		switch (mode){
+			case BLEND_25:       c = (a + 3 * b) / 4;         break;
+			case BLEND_50:       c = (a + b) / 2;             break;
+			case BLEND_75:       c = (3 * a + b) / 4;         break;
+			case BLEND_ADD:      c = a + b > 255? 255 : a + b; break;
+			case BLEND_MULTIPLY: c = a * b / 255;             break;
+			default:             c = a;                       break;
+		}
+		out |= c << shift;
+	}
+	return out;
+}
+
+/* The opaque pixels of a sprite row replace the indexes under them; the
+ * result is whether any of them landed on the collision color. Sixteen
+ * pixels go at a time where the host has SSE2.
+ */
+static bool
+blitindex(uint8_t *dst, const uint8_t *src, int n, uint8_t collide)
+{
+	bool hit = false;
+	int k = 0;
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128(), target = _mm_set1_epi8((char)collide);
+	int hits = 0;
+	for (; k + 16 <= n; k += 16){
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + k));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + k));
+		__m128i clear = _mm_cmpeq_epi8(s, zero);
+		hits |= _mm_movemask_epi8(_mm_andnot_si128(clear, _mm_cmpeq_epi8(d, target)));
+		_mm_storeu_si128((__m128i *)(dst + k), _mm_or_si128(s, _mm_and_si128(clear, d)));
+	}
+	hit = hits != 0;
+#endif
+	for (; k < n; k++){
+		if (src[k]){
+			hit |= dst[k] == collide;
+			dst[k] = src[k];
+		}
+	}
+	return hit;
+}
+
+static void
+blitcolor(const MEGACHIP *m, uint32_t *dst, const uint8_t *src, int n)
+{
+	for (int k = 0; k < n; k++){
+		if (!src[k])
+			continue;
+		uint32_t c = m->palette[src[k]];
+		dst[k] = m->blend == BLEND_NORMAL? c : blend(m->blend, c, dst[k]);
+	}
+}
+
+/* A MegaChip sprite is width by height palette indexes at I, zero being
+ * transparent, clipped at the edges of the screen; N is not used.
+ */
+static void
+megadraw(CHIP8 *vm, uint16_t inst)
+{
+	MEGACHIP *m = vm->mega;
+	uint8_t x = vm->v[(inst&0x0F00)>>8];
+	uint8_t y = vm->v[(inst&0x00F0)>>4];
+	int w = m->width < MEGA_WIDTH - x? m->width : MEGA_WIDTH - x;
+	int h = y >= MEGA_HEIGHT? 0 : m->height < MEGA_HEIGHT - y? m->height : MEGA_HEIGHT - y;
+	uint32_t addr = xaddr(vm);
+	uint8_t buf[MEGA_WIDTH];
+	bool hit = false;
+
+	megaclear(vm);
+	if (m->blend != BLEND_NORMAL)
+		truecolor(vm);
+	touchmega(vm, y, h);
+	for (int row = 0; row < h; row++){
+		const uint8_t *src = xspan(vm, addr + (uint32_t)row * m->width, w, buf);
+		hit |= blitindex(m->index[y + row] + x, src, w, m->collide);
+		if (m->truecolor)
+			blitcolor(m, m->color[y + row] + x, src, w);
+	}
+	vm->v[0xF] = hit;
+}
+
+static void
+draw(CHIP8 *vm, uint16_t inst)
+{
+	if (vm->megachip){
+		megadraw(vm, inst);
+		return;
+	}
+
+	uint8_t x = vm->v[(inst&0x0F00)>>8] % 64;
+	uint8_t y = vm->v[(inst&0x00F0)>>4] % 32;
+	uint8_t n = inst&0x000F;
+	uint64_t hit = 0;
+
+	for (uint8_t row = 0; row < n && y + row < 32 && vm->i + row < MEMORY_SIZE; row++){
+		uint64_t sprite = (uint64_t)vm->mem[vm->i + row] << 56 >> x;
+		if (!sprite)
+			continue;
+		hit |= vm->display[y + row] & sprite;
+		vm->display[y + row] ^= sprite;
+		if (vm->observing)
+			continue;
+		vm->dirtyrows |= 1u << (y + row);
+		vm->dirty = true;
+		vm->event = EVENT_DRAW;
+	}
+	vm->v[0xf] = hit != 0;
+}
+
+/* Scroll the MegaChip screen down n rows, or up for negative n. */
+static void
+megascroll(CHIP8 *vm, int n)
+{
+	MEGACHIP *m = vm->mega;
+	int keep = MEGA_HEIGHT - abs(n), from = n < 0? -n : 0, to = n > 0? n : 0, gap = n > 0? 0 : keep;
+	megaclear(vm);
+	touchmega(vm, 0, MEGA_HEIGHT);
+	memmove(m->index[to], m->index[from], (size_t)keep * MEGA_WIDTH);
+	memset(m->index[gap], 0, (size_t)abs(n) * MEGA_WIDTH);
+	if (m->truecolor){
+		memmove(m->color[to], m->color[from], (size_t)keep * sizeof(m->color[0]));
+		for (int y = gap; y < gap + abs(n); y++)
+			for (int x = 0; x < MEGA_WIDTH; x++)
+				m->color[y][x] = m->palette[0];
+	}
+}
+
+/* 02NN loads NN ARGB colors from I into entries 1 to NN. Pixels already
+ * drawn this frame keep the colors they were drawn in.
+ */
+static void
+megapalette(CHIP8 *vm, uint8_t n)
+{
+	MEGACHIP *m = vm->mega;
+	uint8_t buf[256 * 4];
+	const uint8_t *p = xspan(vm, xaddr(vm), n * 4u, buf);
+	if (!m->shown)
+		truecolor(vm);
+	for (int k = 0; k < n; k++, p += 4)
+		m->palette[k + 1] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* The rest of the 0NNN space holds the MegaChip instructions, of which
+ * only 0011, which enters MegaChip mode, is valid outside it. Sampled
+ * sound is accepted and not played.
+ */
+static void
+megaop(CHIP8 *vm, uint16_t inst)
+{
+	MEGACHIP *m = vm->mega;
+	uint8_t nn = inst & 0xFF;
+	if (inst == 0x0011){
+		if (!m && !(m = vm->mega = malloc(sizeof(*m)))){
+			fault(vm, "out of memory");
+			return;
+		}
+		memset(m, 0, sizeof(*m));
+		touchmega(vm, 0, MEGA_HEIGHT);
+		m->shown = true;
+		vm->megachip = true;
+		vm->dirty = true;
+		vm->event = EVENT_DRAW;
+		return;
+	}
+	if (!vm->megachip){
+		fault(vm, "invalid instruction");
+		return;
+	}
+
+	switch (inst >> 8){
+		case 0x00:
+			if (inst == 0x0010){
+				releasemega(vm);
+				vm->megachip = false;
+				vm->ihigh = 0;
+				vm->dirty = true;
+				vm->event = EVENT_DRAW;
+				return;
+			}
+			if ((nn & 0xF0) == 0xB0 || (nn & 0xF0) == 0xC0){
+				megascroll(vm, (nn & 0xF0) == 0xB0? -(nn & 0xF) : nn & 0xF);
+				return;
+			}
+			break;
+		case 0x01:
+			vm->ihigh = nn;
+			vm->i = vm->mem[vm->pc % MEMORY_SIZE] << 8 | vm->mem[(vm->pc + 1) % MEMORY_SIZE];
+			vm->pc += 2;
+			return;
+		case 0x02: megapalette(vm, nn);           return;
+		case 0x03: m->width = nn? nn : 256;       return;
+		case 0x04: m->height = nn? nn : 256;      return;
+		case 0x05: m->alpha = nn;                 return;
+		case 0x06: if (nn <= 1) return;           break;
+		case 0x07: if (nn == 0) return;           break;
+		case 0x08:
+			if (nn > BLEND_MULTIPLY)
+				break;
+			m->blend = nn;
+			return;
+		case 0x09: m->collide = nn;               return;
+	}
+	fault(vm, "invalid instruction");
+}
+
+static void
+call(CHIP8 *vm, uint16_t addr)
+{
+	if (vm->sp >= STACK_SIZE){
+		fault(vm, "stack overflow");
+		return;
+	}
+	vm->stack[vm->sp++] = vm->pc;
+	vm->pc = addr;
+}
+
+static void
+rts(CHIP8 *vm)
+{
+	if (!vm->sp){
+		fault(vm, "stack underflow");
+		return;
+	}
+	vm->pc = vm->stack[--vm->sp];
+}
+
+static uint16_t
+fetch(CHIP8 *vm)
+{
+	uint16_t i1 = vm->mem[vm->pc++ % MEMORY_SIZE];
+	uint16_t i2 = vm->mem[vm->pc++ % MEMORY_SIZE];
+	return (i1<<8)+i2;
+}
+
+static void
+waitkey(CHIP8 *vm, uint8_t vx)
+{
+	vm->pc -= 2;
+	vm->waiting = true;
+	vm->waitreg = vx;
+	vm->event = EVENT_KEYWAIT;
+}
+
+static void
+bcd(CHIP8 *vm, uint8_t vx)
+{
+	for (int k = 0; k < 3; k++)
+		touch(vm, (vm->i + k) % MEMORY_SIZE);
+	vm->mem[(vm->i+0)%MEMORY_SIZE] = vx / 100; vx %= 100;
+	vm->mem[(vm->i+1)%MEMORY_SIZE] = vx /  10; vx %=  10;
+	vm->mem[(vm->i+2)%MEMORY_SIZE] = vx /   1; vx %=   1;
+}
+
+/* In MegaChip mode I has 24 bits, so FX1E carries into the top 8. */
+static void
+addi(CHIP8 *vm, uint8_t vx)
+{
+	bool c = vm->i + vx > 0xFFF;
+	vm->ihigh += vm->megachip && vm->i + vx > 0xFFFF;
+	vm->i += vx;
+	vm->v[0xf] = c;
+}
+
+static void
+setsound(CHIP8 *vm, uint8_t vx)
+{
+	if (!vm->sound != !vx)
+		vm->event = EVENT_SOUND;
+	vm->sound = vx;
+}
+
+static void
+regdmp(CHIP8 *vm, uint8_t vx)
+{
+	for (uint8_t i = 0; i <= vx; i++){
+		touch(vm, (vm->i + i) % MEMORY_SIZE);
+		vm->mem[(vm->i + i)%MEMORY_SIZE] = vm->v[i];
+	}
+}
+
+static void
+regld(CHIP8 *vm, uint8_t vx)
+{
+	for (uint8_t i = 0; i <= vx; i++)
+		vm->v[i] = vm->mem[(vm->i + i)%MEMORY_SIZE];
+}
+
+#define A    (((inst)>>12)&0x0F)
+#define B    ((inst)&0x0FF)
+#define D    (((inst))&0x0F)
+#define I    vm->i
+#define V(x) vm->v[x]
+#define X    (((inst)>>8)&0x0F)
+#define Y    (((inst)>>4)&0x0F)
+#define Vx   V(X)
+#define Vy   V(((inst)>>4)&0xF)
+#define VF   V(0xf)
+#define VAL  (inst&0x0FFF)
+#define LH   (inst&0x00FF)
+#define PC   vm->pc
+#define KEY(k) ((k) < 16 && (vm->keys >> (k) & 1))
+#define OP(name, action) static void name(CHIP8 *vm, uint16_t inst){ (void)vm; (void)inst; action; }
+#define DEQ(op, action) if (inst == (op)) { action ; return;}
+#define DAA(a, action) if (A == a) { action ; return;}
+#define DAD(a, d, action) if (A == a && D == d) { action ; return;}
+#define DAB(a, b, action) if (A == a && B == b) { action ; return;}
+
+static uint8_t
+rnd(CHIP8 *vm)
+{
+	vm->seed = vm->seed * 1103515245 + 12345;
+	return vm->seed >> 16;
+}
+
+static void
+execute(CHIP8 *vm, uint16_t inst)
+{
+	DEQ(0x00E0,    cls(vm))
+	DEQ(0x00EE,    rts(vm))
+	DAA(0x0,       megaop(vm, inst))
+	DAA(0x1,       PC = VAL)
+	DAA(0x2,       call(vm, VAL))
+	DAA(0x3,       PC += (Vx == LH) * 2)
+	DAA(0x4,       PC += (Vx != LH) * 2)
+	DAD(0x5, 0x00, PC += (Vx == Vy) * 2)
+	DAA(0x6,       Vx = LH)
+	DAA(0x7,       Vx += LH)
+	DAD(0x8, 0x00, Vx = Vy)
+	DAD(0x8, 0x01, Vx |= Vy)
+	DAD(0x8, 0x02, Vx &= Vy)
+	DAD(0x8, 0x03, Vx ^= Vy)
+	DAD(0x8, 0x04, bool c = Vx + Vy > 0xFF; Vx += Vy; VF = c)
+	DAD(0x8, 0x05, bool c = Vx >= Vy; Vx -= Vy; VF = c)
+	DAD(0x8, 0x06, bool c = Vx&1; Vx >>= 1; VF = c)
+	DAD(0x8, 0x07, bool c = Vy >= Vx; Vx = Vy - Vx; VF = c)
+	DAD(0x8, 0x0E, bool c = isbitset(0, Vx); Vx <<= 1; VF = c)
+	DAD(0x9, 0x00, PC += (Vx != Vy) * 2)
+	DAA(0xA,       I = VAL; vm->ihigh = 0)
+	DAA(0xB,       PC = VAL + V(0))
+	DAA(0xC,       Vx = (rnd(vm)%255)&LH)
+	DAA(0xD,       draw(vm, inst))
+	DAB(0xE, 0x9E, PC += KEY(Vx) * 2)
+	DAB(0xE, 0xA1, PC += !KEY(Vx) * 2)
+	DAB(0xF, 0x07, Vx = vm->delay)
+	DAB(0xF, 0x0A, waitkey(vm, X))
+	DAB(0xF, 0x15, vm->delay = Vx)
+	DAB(0xF, 0x18, setsound(vm, Vx))
+	DAB(0xF, 0x1E, addi(vm, Vx))
+	DAB(0xF, 0x29, I = Vx * 5; vm->ihigh = 0)
+	DAB(0xF, 0x33, bcd(vm, Vx))
+	DAB(0xF, 0x55, regdmp(vm, X))
+	DAB(0xF, 0x65, regld(vm, X))
+	fault(vm, "invalid instruction");
+}
+
+/* The same instructions again, one handler each, for the engines that
+ * pick a handler once and call it directly.
+ */
+OP(opcls,    cls(vm))
+OP(oprts,    rts(vm))
+OP(opjp,     PC = VAL)
+OP(opcall,   call(vm, VAL))
+OP(opse,     PC += (Vx == LH) * 2)
+OP(opsne,    PC += (Vx != LH) * 2)
+OP(opsexy,   PC += (Vx == Vy) * 2)
+OP(opld,     Vx = LH)
+OP(opadd,    Vx += LH)
+OP(opmov,    Vx = Vy)
+OP(opor,     Vx |= Vy)
+OP(opand,    Vx &= Vy)
+OP(opxor,    Vx ^= Vy)
+OP(opaddxy,  bool c = Vx + Vy > 0xFF; Vx += Vy; VF = c)
+OP(opsubxy,  bool c = Vx >= Vy; Vx -= Vy; VF = c)
+OP(opshr,    bool c = Vx&1; Vx >>= 1; VF = c)
+OP(opsubn,   bool c = Vy >= Vx; Vx = Vy - Vx; VF = c)
+OP(opshl,    bool c = isbitset(0, Vx); Vx <<= 1; VF = c)
+OP(opsnexy,  PC += (Vx != Vy) * 2)
+OP(opldi,    I = VAL; vm->ihigh = 0)
+OP(opjpv0,   PC = VAL + V(0))
+OP(oprnd,    Vx = (rnd(vm)%255)&LH)
+OP(opdrw,    draw(vm, inst))
+OP(opskp,    PC += KEY(Vx) * 2)
+OP(opsknp,   PC += !KEY(Vx) * 2)
+OP(opgetdt,  Vx = vm->delay)
+OP(opwait,   waitkey(vm, X))
+OP(opsetdt,  vm->delay = Vx)
+OP(opsetst,  setsound(vm, Vx))
+OP(opaddi,   addi(vm, Vx))
+OP(opfont,   I = Vx * 5; vm->ihigh = 0)
+OP(opbcd,    bcd(vm, Vx))
+OP(opdump,   regdmp(vm, X))
+OP(opload,   regld(vm, X))
+OP(opmega,   megaop(vm, inst))
+OP(opbad,    fault(vm, "invalid instruction"))
+
+static const OPFN alu[16] = {
+	opmov, opor, opand, opxor, opaddxy, opsubxy, opshr, opsubn,
+	opbad, opbad, opbad, opbad, opbad, opbad, opshl, opbad
+};
+
+OP(group0,   (inst == 0x00E0? opcls : inst == 0x00EE? oprts : opmega)(vm, inst))
+OP(group5,   (D? opbad : opsexy)(vm, inst))
+OP(group8,   alu[D](vm, inst))
+OP(group9,   (D? opbad : opsnexy)(vm, inst))
+OP(groupE,   (B == 0x9E? opskp : B == 0xA1? opsknp : opbad)(vm, inst))
+
+static void
+groupF(CHIP8 *vm, uint16_t inst)
+{
+	switch (B){
+		case 0x07: opgetdt(vm, inst); break;
+		case 0x0A: opwait(vm, inst);  break;
+		case 0x15: opsetdt(vm, inst); break;
+		case 0x18: opsetst(vm, inst); break;
+		case 0x1E: opaddi(vm, inst);  break;
+		case 0x29: opfont(vm, inst);  break;
+		case 0x33: opbcd(vm, inst);   break;
+		case 0x55: opdump(vm, inst);  break;
+		case 0x65: opload(vm, inst);  break;
+		default:   opbad(vm, inst);   break;
+	}
+}
+
+static const OPFN groups[16] = {
+	group0, opjp,  opcall, opse,  opsne, group5, opld,  opadd,
+	group8, group9, opldi, opjpv0, oprnd, opdrw, groupE, groupF
+};
+
+#define CEQ(op, fn)       if (inst == (op)) return fn;
+#define CAA(a, fn)        if (A == a) return fn;
+#define CAD(a, d, fn)     if (A == a && D == d) return fn;
+#define CAB(a, b, fn)     if (A == a && B == b) return fn;
+
+static OPFN
+decode(uint16_t inst)
+{
+	CEQ(0x00E0,    opcls)
+	CEQ(0x00EE,    oprts)
+	CAA(0x0,       opmega)
+	CAA(0x1,       opjp)
+	CAA(0x2,       opcall)
+	CAA(0x3,       opse)
+	CAA(0x4,       opsne)
+	CAD(0x5, 0x00, opsexy)
+	CAA(0x6,       opld)
+	CAA(0x7,       opadd)
+	CAD(0x8, 0x00, opmov)
+	CAD(0x8, 0x01, opor)
+	CAD(0x8, 0x02, opand)
+	CAD(0x8, 0x03, opxor)
+	CAD(0x8, 0x04, opaddxy)
+	CAD(0x8, 0x05, opsubxy)
+	CAD(0x8, 0x06, opshr)
+	CAD(0x8, 0x07, opsubn)
+	CAD(0x8, 0x0E, opshl)
+	CAD(0x9, 0x00, opsnexy)
+	CAA(0xA,       opldi)
+	CAA(0xB,       opjpv0)
+	CAA(0xC,       oprnd)
+	CAA(0xD,       opdrw)
+	CAB(0xE, 0x9E, opskp)
+	CAB(0xE, 0xA1, opsknp)
+	CAB(0xF, 0x07, opgetdt)
+	CAB(0xF, 0x0A, opwait)
+	CAB(0xF, 0x15, opsetdt)
+	CAB(0xF, 0x18, opsetst)
+	CAB(0xF, 0x1E, opaddi)
+	CAB(0xF, 0x29, opfont)
+	CAB(0xF, 0x33, opbcd)
+	CAB(0xF, 0x55, opdump)
+	CAB(0xF, 0x65, opload)
+	return opbad;
+}
+
+static CODE *
+getcode(void)
+{
+	if (code || !(code = calloc(1, sizeof(CODE))))
+		return code;
+
+	code->nojit = true;
+#ifdef HAVE_JIT
+	void *p = mmap(NULL, JIT_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED){
+		code->text = p;
+		code->nojit = false;
+	}
+#endif
+	return code;
+}
+
+static void
+flushblocks(CODE *c)
+{
+	for (size_t i = 0; i < MEMORY_SIZE; i++){
+		free(c->blocks[i]);
+		c->blocks[i] = NULL;
+	}
+	c->used = 0;
+}
+
+void
+releasecode(void)
+{
+	if (!code)
+		return;
+	flushblocks(code);
+	if (code->text)
+		munmap(code->text, JIT_SIZE);
+	free(code);
+	code = NULL;
+}
+
+static void
+cached(CHIP8 *vm, CODE *c)
+{
+	uint16_t pc = vm->pc % MEMORY_SIZE;
+	uint16_t inst = fetch(vm);
+	if (!c->ops[pc] || c->insts[pc] != inst){
+		c->ops[pc] = decode(inst);
+		c->insts[pc] = inst;
+	}
+	c->ops[pc](vm, inst);
+}
+
+/* Whether an instruction has to be the last of a compiled block: it
+ * transfers control, raises an event, or writes memory that the rest of
+ * the block may have been compiled from.
+ */
+static bool
+endsblock(uint16_t inst)
+{
+	OPFN fn = decode(inst);
+	switch (A){
+		case 0x0: case 0x1: case 0x2: case 0x3: case 0x4: case 0x5:
+		case 0x9: case 0xB: case 0xD: case 0xE:
+			return true;
+	}
+	return fn == opbad || fn == opwait || fn == opsetst || fn == opbcd || fn == opdump;
+}
+
+#ifdef HAVE_JIT
+static void
+emit(CODE *c, const void *p, size_t n)
+{
+	memcpy(c->text + c->used, p, n);
+	c->used += n;
+}
+
+static void
+emitpc(CODE *c, uint16_t pc)
+{
+	uint8_t op[] = {0x66, 0xC7, 0x83, 0, 0, 0, 0, pc & 0xFF, pc >> 8};
+	uint32_t off = offsetof(CHIP8, pc);
+	memcpy(op + 3, &off, 4);
+	emit(c, op, sizeof(op));
+}
+
+/* Compiled blocks are described to perf as they are made, shared by
+ * every thread that compiles. Text is reused after a flush, so the map
+ * file may name an address more than once; the jitdump records carry
+ * timestamps and let perf inject tell the generations apart.
+ */
+static struct{
+	pthread_mutex_t lock;
+	FILE *map, *dump;
+	uint64_t index;
+} perf = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t
+perfclock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+openjitdump(void)
+{
+	struct{
+		uint32_t magic, version, size, mach, pad, pid;
+		uint64_t timestamp, flags;
+	} h = {JITDUMP_MAGIC, 1, sizeof(h), EM_X86_64, 0, getpid(), perfclock(), 0};
+	char name[64];
+	snprintf(name, sizeof(name), "/tmp/jit-%d.dump", (int)getpid());
+	int fd = open(name, O_CREAT|O_TRUNC|O_RDWR, 0666);
+	if (fd < 0)
+		return false;
+
+	/* perf record finds the dump by an executable mapping of it */
+	void *marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ|PROT_EXEC, MAP_PRIVATE, fd, 0);
+	if (marker == MAP_FAILED || !(perf.dump = fdopen(fd, "wb"))){
+		close(fd);
+		return false;
+	}
+	return fwrite(&h, sizeof(h), 1, perf.dump) == 1 && fflush(perf.dump) == 0;
+}
+
+static void
+perfblock(uint16_t addr, const uint8_t *start, size_t size)
+{
+	pthread_mutex_lock(&perf.lock);
+	char name[32];
+	snprintf(name, sizeof(name), "chip8_block_0x%03X", addr);
+	if (perf.map){
+		fprintf(perf.map, "%lx %zx %s\n", (unsigned long)(uintptr_t)start, size, name);
+		fflush(perf.map);
+	}
+	if (perf.dump){
+		struct{
+			uint32_t id, size;
+			uint64_t timestamp;
+			uint32_t pid, tid;
+			uint64_t vma, addr, len, index;
+		} load = {
+			0, sizeof(load) + strlen(name) + 1 + size, perfclock(),
+			getpid(), syscall(SYS_gettid),
+			(uintptr_t)start, (uintptr_t)start, size, perf.index++
+		};
+		fwrite(&load, sizeof(load), 1, perf.dump);
+		fwrite(name, strlen(name) + 1, 1, perf.dump);
+		fwrite(start, size, 1, perf.dump);
+		fflush(perf.dump);
+	}
+	pthread_mutex_unlock(&perf.lock);
+}
+
+/* Each instruction becomes a direct call to its handler with the opcode
+ * as an immediate: no fetch, no decode and no dispatch loop in between.
+ * Only the last instruction of a block can look at pc, so pc is stored
+ * just before it.
+ */
+static BLOCK *
+compile(CODE *c, const CHIP8 *vm, uint16_t addr)
+{
+	static const uint8_t prologue[] = {0x53, 0x48, 0x89, 0xFB};
+	static const uint8_t epilogue[] = {0x5B, 0xC3};
+	BLOCK *b = calloc(1, sizeof(BLOCK));
+	if (!b)
+		return NULL;
+
+	bool ended = false;
+	while (!ended && b->n < JIT_BLOCK && addr + 2 * b->n + 1 < MEMORY_SIZE){
+		uint16_t a = addr + 2 * b->n;
+		uint16_t inst = vm->mem[a] << 8 | vm->mem[a + 1];
+		b->bytes[b->n * 2] = vm->mem[a];
+		b->bytes[b->n * 2 + 1] = vm->mem[a + 1];
+		b->n++;
+		ended = endsblock(inst);
+	}
+	if (!b->n){
+		free(b);
+		return NULL;
+	}
+
+	size_t need = sizeof(prologue) + sizeof(epilogue) + 9 + b->n * 20;
+	if (c->used + need > JIT_SIZE)
+		flushblocks(c);
+
+	b->fn = (void (*)(CHIP8 *))(c->text + c->used);
+	emit(c, prologue, sizeof(prologue));
+	for (uint16_t k = 0; k < b->n; k++){
+		uint16_t inst = b->bytes[k * 2] << 8 | b->bytes[k * 2 + 1];
+		uint64_t fn = (uint64_t)(uintptr_t)decode(inst);
+		uint32_t imm = inst;
+		uint8_t op[] = {
+			0x48, 0x89, 0xDF,               /* mov rdi, rbx */
+			0xBE, 0, 0, 0, 0,               /* mov esi, inst */
+			0x48, 0xB8, 0, 0, 0, 0, 0, 0, 0, 0, /* mov rax, fn */
+			0xFF, 0xD0                      /* call rax */
+		};
+		memcpy(op + 4, &imm, 4);
+		memcpy(op + 10, &fn, 8);
+		if (ended && k == b->n - 1)
+			emitpc(c, addr + 2 * k + 2);
+		emit(c, op, sizeof(op));
+	}
+	if (!ended)
+		emitpc(c, addr + 2 * b->n);
+	emit(c, epilogue, sizeof(epilogue));
+	if (perf.map || perf.dump)
+		perfblock(addr, (const uint8_t *)b->fn, c->text + c->used - (const uint8_t *)b->fn);
+	return b;
+}
+#endif
+
+bool
+perfcode(int what)
+{
+#ifdef HAVE_JIT
+	bool ok = true;
+	pthread_mutex_lock(&perf.lock);
+	if (what & PERF_MAP && !perf.map){
+		char name[64];
+		snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+		ok = (perf.map = fopen(name, "a")) != NULL;
+	}
+	if (what & PERF_JITDUMP && !perf.dump)
+		ok = openjitdump() && ok;
+	pthread_mutex_unlock(&perf.lock);
+	return ok;
+#else
+	(void)what;
+	return true;
+#endif
+}
+
+/* Runs one compiled block if one fits in the budget, returning how many
+ * instructions it ran, or 0 if the caller should step instead.
+ */
+static uint64_t
+jit(CHIP8 *vm, CODE *c, uint64_t budget)
+{
+#ifdef HAVE_JIT
+	uint16_t pc = vm->pc;
+	if (c->nojit || pc >= MEMORY_SIZE)
+		return 0;
+
+	BLOCK *b = c->blocks[pc];
+	if (!b || memcmp(b->bytes, vm->mem + pc, b->n * 2) != 0){
+		free(b);
+		c->blocks[pc] = NULL;
+		if (!(b = c->blocks[pc] = compile(c, vm, pc)))
+			return 0;
+	}
+	if (b->n > budget)
+		return 0;
+	b->fn(vm);
+	if (vm->event == EVENT_FAULT)
+		vm->pc = pc + 2 * (b->n - 1);
+	return b->n;
+#else
+	(void)vm; (void)c; (void)budget;
+	return 0;
+#endif
+}
+
+static bool
+isbreak(const CHIP8 *vm, uint16_t addr)
+{
+	addr %= MEMORY_SIZE;
+	return vm->breaks[addr / 8] >> (addr % 8) & 1;
+}
+
+/* One loop per engine, so that none of them pays for choosing. */
+#define LOOP(step) \
+	while (budget--){ \
+		uint16_t pc = vm->pc; \
+		if (vm->nbreaks && isbreak(vm, pc) && vm->resume != pc + 1){ \
+			vm->resume = pc + 1; \
+			return EVENT_BREAK; \
+		} \
+		vm->resume = 0; \
+		step; \
+		if (vm->event == EVENT_FAULT){ \
+			vm->pc = pc; \
+			return EVENT_FAULT; \
+		} \
+		vm->cycles++; \
+		if (vm->event) \
+			return vm->event; \
+	} \
+	return EVENT_BUDGET;
+
+int
+rununtil(CHIP8 *vm, uint64_t budget)
+{
+	if (vm->waiting)
+		return EVENT_KEYWAIT;
+
+	vm->event = EVENT_NONE;
+	CODE *c = vm->engine >= ENGINE_CACHED? getcode() : NULL;
+	if (vm->engine >= ENGINE_CACHED && !c){
+		fault(vm, "out of memory");
+		return EVENT_FAULT;
+	}
+
+	switch (vm->engine){
+		case ENGINE_TABLE:
+			LOOP(uint16_t inst = fetch(vm); groups[A](vm, inst))
+		case ENGINE_CACHED:
+			LOOP(cached(vm, c))
+		case ENGINE_JIT:
+			/* Blocks skip breakpoint checks, so breakpoints mean stepping. */
+			if (vm->nbreaks){
+				LOOP(cached(vm, c))
+			}
+			while (budget){
+				uint16_t pc = vm->pc;
+				uint64_t n = jit(vm, c, budget);
+				if (!n){
+					cached(vm, c);
+					n = 1;
+					if (vm->event == EVENT_FAULT)
+						vm->pc = pc;
+				}
+				if (vm->event == EVENT_FAULT){
+					vm->cycles += n - 1;
+					return EVENT_FAULT;
+				}
+				vm->cycles += n;
+				budget -= n;
+				if (vm->event)
+					return vm->event;
+			}
+			return EVENT_BUDGET;
+		default:
+			LOOP(execute(vm, fetch(vm)))
+	}
+}
+
+/* Lit pixels in a byte, for observe(). */
+#define B2(n) n, n + 1, n + 1, n + 2
+#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
+#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
+static const uint8_t ones[256] = {B6(0), B6(1), B6(1), B6(2)};
+
+size_t
+observe(const CHIP8 *vm, const VIEW *view, uint8_t *out)
+{
+	if (!view->scale || view->scale > 8 || !view->w || !view->h || view->x >= 64 || view->y >= 32 ||
+	    view->x + view->w > 64 || view->y + view->h > 32)
+		return 0;
+
+	int scale = view->scale, cols = view->w / scale, rows = view->h / scale;
+	uint8_t level[65];
+	for (int n = 0; n <= scale * scale; n++)
+		level[n] = n * 255 / (scale * scale);
+	for (int r = 0; r < rows; r++, out += cols){
+		uint8_t lit[64] = {0};
+		for (int k = 0; k < scale; k++){
+			uint64_t bits = vm->display[view->y + r * scale + k] << view->x;
+			for (int c = 0; c < cols; c++, bits <<= scale)
+				lit[c] += ones[bits >> (64 - scale)];
+		}
+		for (int c = 0; c < cols; c++)
+			out[c] = level[lit[c]];
+	}
+	return (size_t)rows * cols;
+}
+
+void
+presskey(CHIP8 *vm, uint8_t key)
+{
+	if (vm->waiting && key < 16){
+		vm->v[vm->waitreg] = key;
+		vm->waiting = false;
+		vm->pc += 2;
+	}
+}
+
+void
+ticktimers(CHIP8 *vm)
+{
+	if (vm->delay)
+		vm->delay--;
+	if (vm->sound)
+		vm->sound--;
+}
+
+void
+setbreak(CHIP8 *vm, uint16_t addr, bool on)
+{
+	addr %= MEMORY_SIZE;
+	if (isbreak(vm, addr) == on)
+		return;
+	vm->breaks[addr / 8] ^= 1 << (addr % 8);
+	vm->nbreaks += on? 1 : -1;
+}
+
+void
+releasemega(CHIP8 *vm)
+{
+	free(vm->mega);
+	vm->mega = NULL;
+}
+
+bool
+copymachine(CHIP8 *to, const CHIP8 *from)
+{
+	MEGACHIP *m = to->mega;
+	if (from->mega && !m && !(m = malloc(sizeof(*m))))
+		return false;
+	if (!from->mega){
+		free(m);
+		m = NULL;
+	}
+	*to = *from;
+	to->mega = m;
+	if (m)
+		memcpy(m, from->mega, sizeof(*m));
+	return true;
+}
+
+void
+megaframe(const MEGACHIP *m, uint32_t out[MEGA_HEIGHT][MEGA_WIDTH])
+{
+	if (m->truecolor){
+		memcpy(out, m->color, sizeof(m->color));
+		return;
+	}
+	for (int y = 0; y < MEGA_HEIGHT; y++)
+		for (int x = 0; x < MEGA_WIDTH; x++)
+			out[y][x] = m->palette[m->index[y][x]];
+}
+
+static void
+put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static uint16_t
+get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+/* A snapshot is the machine state alone, in a fixed little-endian
+ * layout, so that it survives rebuilds and can be read by other tools.
+ */
+bool
+encodesnapshot(const CHIP8 *vm, uint8_t buf[SNAPSHOT_SIZE])
+{
+	uint8_t *p = buf;
+	if (vm->megachip)
+		return false;
+	memcpy(p, SNAPSHOT_MAGIC, 5);                p += 5;
+	memcpy(p, vm->mem, MEMORY_SIZE);             p += MEMORY_SIZE;
+	for (int i = 0; i < STACK_SIZE; i++, p += 2)
+		put16(p, vm->stack[i]);
+	put16(p, vm->pc);                            p += 2;
+	put16(p, vm->sp);                            p += 2;
+	put16(p, vm->i);                             p += 2;
+	*p++ = vm->delay;
+	*p++ = vm->sound;
+	memcpy(p, vm->v, 16);                        p += 16;
+	for (int row = 0; row < 32; row++)
+		for (int col = 0; col < 64; col++)
+			*p++ = vm->display[row] >> (63 - col) & 1;
+	return true;
+}
+
+bool
+decodesnapshot(CHIP8 *vm, const uint8_t buf[SNAPSHOT_SIZE])
+{
+	const uint8_t *p = buf;
+	if (memcmp(p, SNAPSHOT_MAGIC, 5) != 0)
+		return false;
+	p += 5;
+	memcpy(vm->mem, p, MEMORY_SIZE);             p += MEMORY_SIZE;
+	for (int i = 0; i < STACK_SIZE; i++, p += 2)
+		vm->stack[i] = get16(p);
+	vm->pc = get16(p);                           p += 2;
+	vm->sp = get16(p);                           p += 2;
+	vm->i = get16(p);                            p += 2;
+	vm->delay = *p++;
+	vm->sound = *p++;
+	memcpy(vm->v, p, 16);                        p += 16;
+	for (int row = 0; row < 32; row++){
+		vm->display[row] = 0;
+		for (int col = 0; col < 64; col++)
+			vm->display[row] |= (uint64_t)(*p++ & 1) << (63 - col);
+	}
+	vm->dirty = true;
+	vm->dirtypages = UINT64_MAX;
+	vm->dirtyrows = UINT32_MAX;
+	vm->waiting = false;
+	if (vm->sp > STACK_SIZE)
+		return false;
+	releasemega(vm);
+	vm->megachip = false;
+	vm->ihigh = 0;
+	return true;
+}
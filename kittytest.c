@@ -0,0 +1,54 @@
+/* Check that a frame shown again with kitty comes out on top.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * The renderer is static in chip8.c, so that is built in here with its
+ * main renamed. Frames A, B and A again are rendered into memory; the
+ * second A is a placement of the image A was uploaded as, which must
+ * come after B's placement is deleted.
+ */
+#define main chip8main
+#include "chip8.c"
+#undef main
+
+static const char *
+expect(const char *out, const char *want)
+{
+	const char *at = strstr(out, want);
+	if (!at){
+		fprintf(stderr, "kittytest: missing %s\n", want + 2);
+		exit(EXIT_FAILURE);
+	}
+	return at + strlen(want);
+}
+
+int
+main(void)
+{
+	uint64_t a[32] = {0}, b[32] = {0};
+	char *out = NULL;
+	size_t len = 0;
+	b[0] = 1ULL << 63;
+
+	FILE *mem = open_memstream(&out, &len), *tty = stdout;
+	if (!mem)
+		die("out of memory\n");
+	stdout = mem;
+	renderkitty(a, true);
+	renderkitty(b, false);
+	fflush(mem);
+	size_t again = len;
+	renderkitty(a, false);
+	fclose(mem);
+	stdout = tty;
+
+	const char *p = expect(out, "\x1b_Ga=T,f=24,s=64,v=32,o=z,i=1,");
+	p = expect(p, "\x1b_Ga=d,d=i,i=1,p=1,q=2\x1b\\");
+	p = expect(p, "\x1b_Ga=T,f=24,s=64,v=32,o=z,i=2,");
+	p = expect(out + again, "\x1b_Ga=d,d=i,i=2,p=1,q=2\x1b\\");
+	expect(p, "\x1b_Ga=p,i=1,p=1,");
+	free(out);
+	puts("kittytest: ok");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,376 @@
+/* Moving a running machine to another process.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "migrate.h"
+
+#define MIGRATE_ACK 0x06
+
+enum{
+	MIGRATE_PAGE,    /* page number, PAGE_SIZE bytes of mem */
+	MIGRATE_ROW,     /* row number, the row */
+	MIGRATE_MEGAROW, /* row number, MEGA_WIDTH indexes and as many colors */
+	MIGRATE_STATE    /* everything else; the last record */
+};
+
+/* A round is laid out in buf when it starts and goes out as fast as
+ * the socket takes it, over as many ticks as that needs, so the machine
+ * only waits on the other side for the last one.
+ */
+struct MIGRATION{
+	int fd;
+	unsigned rounds;
+	bool failed;
+	uint8_t *buf;
+	size_t len, cap, sent;
+};
+
+static uint8_t *
+reserve(MIGRATION *m, size_t n)
+{
+	if (m->len + n > m->cap){
+		size_t cap = m->cap? m->cap : 65536;
+		while (m->len + n > cap)
+			cap *= 2;
+		uint8_t *buf = realloc(m->buf, cap);
+		if (!buf){
+			m->failed = true;
+			return NULL;
+		}
+		m->buf = buf;
+		m->cap = cap;
+	}
+	m->len += n;
+	return m->buf + m->len - n;
+}
+
+static void
+put(MIGRATION *m, const void *p, size_t n)
+{
+	uint8_t *at = reserve(m, n);
+	if (at)
+		memcpy(at, p, n);
+}
+
+static void
+putle(uint8_t *at, uint64_t v, int n)
+{
+	for (int k = 0; k < n; k++)
+		at[k] = v >> 8 * k & 0xFF;
+}
+
+static void
+putnum(MIGRATION *m, uint64_t v, int n)
+{
+	uint8_t *at = reserve(m, n);
+	if (at)
+		putle(at, v, n);
+}
+
+static bool
+getle(FILE *f, uint64_t *v, int n)
+{
+	*v = 0;
+	for (int k = 0; k < n; k++){
+		int c = fgetc(f);
+		if (c == EOF)
+			return false;
+		*v |= (uint64_t)c << 8 * k;
+	}
+	return true;
+}
+
+static bool
+address(const char *path, struct sockaddr_un *sa)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa->sun_path))
+		return false;
+	strcpy(sa->sun_path, path);
+	return true;
+}
+
+int
+listenmigration(const char *path)
+{
+	struct sockaddr_un sa;
+	if (!address(path, &sa))
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 1) != 0){
+		close(fd);
+		return -1;
+	}
+
+	/* a successor going away mid-way is an error to report, not a signal */
+	signal(SIGPIPE, SIG_IGN);
+	return fd;
+}
+
+/* Sends what the socket takes without waiting; false once the other
+ * side has gone away.
+ */
+static bool
+push(MIGRATION *m)
+{
+	while (!m->failed && m->sent < m->len){
+		ssize_t n = write(m->fd, m->buf + m->sent, m->len - m->sent);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n <= 0)
+			m->failed = true;
+		else
+			m->sent += n;
+	}
+	return !m->failed;
+}
+
+MIGRATION *
+acceptmigration(int listener)
+{
+	int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	MIGRATION *m = calloc(1, sizeof(MIGRATION));
+	if (!m){
+		close(fd);
+		return NULL;
+	}
+	m->fd = fd;
+	put(m, MIGRATE_MAGIC, 5);
+	if (!push(m)){
+		abandonmigration(m);
+		return NULL;
+	}
+	return m;
+}
+
+/* Lays out what has changed since the last round. */
+static long
+collect(MIGRATION *m, CHIP8 *vm)
+{
+	size_t before = m->len;
+	if (!m->rounds++){
+		vm->dirtypages = UINT64_MAX;
+		vm->dirtyrows = UINT32_MAX;
+		memset(vm->dirtymega, 0xFF, sizeof(vm->dirtymega));
+	}
+
+	for (int p = 0; p < MEMORY_SIZE / PAGE_SIZE; p++){
+		if (!(vm->dirtypages >> p & 1))
+			continue;
+		put(m, (uint8_t[]){MIGRATE_PAGE, p}, 2);
+		put(m, vm->mem + p * PAGE_SIZE, PAGE_SIZE);
+	}
+	for (int row = 0; row < 32; row++){
+		if (!(vm->dirtyrows >> row & 1))
+			continue;
+		put(m, (uint8_t[]){MIGRATE_ROW, row}, 2);
+		putnum(m, vm->display[row], 8);
+	}
+
+	/* the MegaChip planes mean nothing outside MegaChip mode, and 0011
+	 * marks all of them when it comes back */
+	for (int y = 0; vm->megachip && y < MEGA_HEIGHT; y++){
+		if (!(vm->dirtymega[y / 64] >> y % 64 & 1))
+			continue;
+		put(m, (uint8_t[]){MIGRATE_MEGAROW, y}, 2);
+		put(m, vm->mega->index[y], MEGA_WIDTH);
+		uint8_t *at = reserve(m, MEGA_WIDTH * 4);
+		for (int x = 0; at && x < MEGA_WIDTH; x++)
+			putle(at + 4 * x, vm->mega->color[y][x], 4);
+	}
+
+	vm->dirtypages = 0;
+	vm->dirtyrows = 0;
+	memset(vm->dirtymega, 0, sizeof(vm->dirtymega));
+	return m->len - before;
+}
+
+long
+sendround(MIGRATION *m, CHIP8 *vm)
+{
+	long n = MIGRATE_BUSY;
+	if (m->sent == m->len){
+		m->len = m->sent = 0;
+		n = collect(m, vm);
+	}
+	return push(m)? n : -1;
+}
+
+bool
+finishmigration(MIGRATION *m, CHIP8 *vm, uint64_t ticks)
+{
+	static const MEGACHIP none;
+	const MEGACHIP *mega = vm->mega? vm->mega : &none;
+	uint8_t ack = 0;
+	collect(m, vm);
+	put(m, (uint8_t[]){MIGRATE_STATE}, 1);
+	for (int k = 0; k < STACK_SIZE; k++)
+		putnum(m, vm->stack[k], 2);
+	putnum(m, vm->pc, 2);
+	putnum(m, vm->sp, 2);
+	putnum(m, vm->i, 2);
+	put(m, (uint8_t[]){vm->ihigh, vm->delay, vm->sound}, 3);
+	put(m, vm->v, 16);
+	put(m, (uint8_t[]){vm->waiting, vm->waitreg}, 2);
+	putnum(m, vm->keys, 2);
+	putnum(m, vm->seed, 4);
+	putnum(m, vm->cycles, 8);
+	putnum(m, ticks, 8);
+	put(m, (uint8_t[]){vm->megachip}, 1);
+	putnum(m, mega->width, 2);
+	putnum(m, mega->height, 2);
+	put(m, (uint8_t[]){mega->blend, mega->collide, mega->alpha, mega->shown, mega->truecolor}, 5);
+	for (int k = 0; k < 256; k++)
+		putnum(m, mega->palette[k], 4);
+
+	/* the machine is stopped now, so the rest is waited for */
+	struct pollfd pfd = {.fd = m->fd, .events = POLLOUT};
+	while (push(m) && m->sent < m->len && poll(&pfd, 1, MIGRATE_TIMEOUT) == 1)
+		;
+	bool ok = !m->failed && m->sent == m->len;
+	pfd.events = POLLIN;
+	ok = ok && poll(&pfd, 1, MIGRATE_TIMEOUT) == 1 && read(m->fd, &ack, 1) == 1 && ack == MIGRATE_ACK;
+	abandonmigration(m);
+	return ok;
+}
+
+void
+abandonmigration(MIGRATION *m)
+{
+	close(m->fd);
+	free(m->buf);
+	free(m);
+}
+
+static uint64_t
+take(FILE *f, int n, bool *ok)
+{
+	uint64_t v;
+	if (!getle(f, &v, n)){
+		*ok = false;
+		return 0;
+	}
+	return v;
+}
+
+/* The MegaChip display, allocated when the first of it arrives. */
+static MEGACHIP *
+needmega(CHIP8 *vm)
+{
+	if (!vm->mega)
+		vm->mega = calloc(1, sizeof(*vm->mega));
+	return vm->mega;
+}
+
+static bool
+receivestate(FILE *f, CHIP8 *vm, uint64_t *ticks)
+{
+	static MEGACHIP scratch;
+	MEGACHIP *mega = &scratch;
+	bool ok = true;
+	for (int k = 0; k < STACK_SIZE; k++)
+		vm->stack[k] = take(f, 2, &ok);
+	vm->pc = take(f, 2, &ok);
+	vm->sp = take(f, 2, &ok);
+	vm->i = take(f, 2, &ok);
+	vm->ihigh = take(f, 1, &ok);
+	vm->delay = take(f, 1, &ok);
+	vm->sound = take(f, 1, &ok);
+	for (int r = 0; r < 16; r++)
+		vm->v[r] = take(f, 1, &ok);
+	vm->waiting = take(f, 1, &ok);
+	vm->waitreg = take(f, 1, &ok);
+	vm->keys = take(f, 2, &ok);
+	vm->seed = take(f, 4, &ok);
+	vm->cycles = take(f, 8, &ok);
+	*ticks = take(f, 8, &ok);
+	vm->megachip = take(f, 1, &ok);
+	if (!vm->megachip)
+		releasemega(vm);
+	else if (!(mega = needmega(vm)))
+		return false;
+	mega->width = take(f, 2, &ok);
+	mega->height = take(f, 2, &ok);
+	mega->blend = take(f, 1, &ok);
+	mega->collide = take(f, 1, &ok);
+	mega->alpha = take(f, 1, &ok);
+	mega->shown = take(f, 1, &ok);
+	mega->truecolor = take(f, 1, &ok);
+	for (int k = 0; k < 256; k++)
+		mega->palette[k] = take(f, 4, &ok);
+	return ok && vm->sp <= STACK_SIZE && vm->waitreg < 16 && mega->blend <= BLEND_MULTIPLY;
+}
+
+bool
+receivemigration(const char *path, CHIP8 *vm, uint64_t *ticks)
+{
+	struct sockaddr_un sa;
+	char magic[5];
+	if (!address(path, &sa))
+		return false;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	FILE *f = NULL;
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || !(f = fdopen(fd, "r"))){
+		close(fd);
+		return false;
+	}
+
+	bool ok = fread(magic, 1, 5, f) == 5 && memcmp(magic, MIGRATE_MAGIC, 5) == 0;
+	for (int type; ok && (type = fgetc(f)) != MIGRATE_STATE;){
+		int at = fgetc(f);
+		switch (type){
+			case MIGRATE_PAGE:
+				ok = at >= 0 && at < MEMORY_SIZE / PAGE_SIZE &&
+				     fread(vm->mem + at * PAGE_SIZE, 1, PAGE_SIZE, f) == PAGE_SIZE;
+				break;
+			case MIGRATE_ROW:
+				ok = at >= 0 && at < 32;
+				if (ok)
+					vm->display[at] = take(f, 8, &ok);
+				break;
+			case MIGRATE_MEGAROW:
+				ok = at >= 0 && at < MEGA_HEIGHT && needmega(vm) &&
+				     fread(vm->mega->index[at], 1, MEGA_WIDTH, f) == MEGA_WIDTH;
+				for (int x = 0; ok && x < MEGA_WIDTH; x++)
+					vm->mega->color[at][x] = take(f, 4, &ok);
+				break;
+			default:
+				ok = false;
+				break;
+		}
+	}
+	ok = ok && receivestate(f, vm, ticks);
+	if (ok){
+		uint8_t ack = MIGRATE_ACK;
+		ok = write(fd, &ack, 1) == 1;
+	}
+	vm->dirty = true;
+	vm->fault = NULL;
+	fclose(f);
+	return ok;
+}
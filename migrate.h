@@ -0,0 +1,53 @@
+/* Moving a running machine to another process.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef MIGRATE_H
+#define MIGRATE_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* A machine moves over a Unix socket while it keeps running. The first
+ * round sends all of it; every later round sends only the pages of mem,
+ * display rows and MegaChip rows written since the round before. Each
+ * round goes out a piece a tick, as much as the socket takes without
+ * waiting, and the next starts once it has all gone. Once a round comes
+ * to no more than MIGRATE_FINAL bytes, or after MIGRATE_ROUNDS rounds,
+ * the machine stops, the last changes go across with the registers, and
+ * the other side answers once it has everything. Nothing on the wire
+ * depends on how either side lays out a CHIP8, so a newer build can take
+ * over from an older one.
+ */
+#define MIGRATE_MAGIC "C8MG\x01"
+#define MIGRATE_FINAL 1024
+#define MIGRATE_ROUNDS 60
+#define MIGRATE_TIMEOUT 1000 /* milliseconds to wait for the answer */
+
+typedef struct MIGRATION MIGRATION;
+
+/* The sending side. acceptmigration() returns NULL when nobody is
+ * waiting; sendround() returns the bytes of the round it started,
+ * MIGRATE_BUSY while the round before is still going out, or -1 if the
+ * other side went away. finishmigration() returns whether the other side
+ * took over, and like abandonmigration() is done with the migration
+ * either way.
+ */
+#define MIGRATE_BUSY LONG_MAX
+
+int listenmigration(const char *path);
+MIGRATION *acceptmigration(int listener);
+long sendround(MIGRATION *m, CHIP8 *vm);
+bool finishmigration(MIGRATION *m, CHIP8 *vm, uint64_t ticks);
+void abandonmigration(MIGRATION *m);
+
+/* The receiving side, which leaves the engine and the ROM image as they
+ * were and replaces everything else.
+ */
+bool receivemigration(const char *path, CHIP8 *vm, uint64_t *ticks);
+
+#endif
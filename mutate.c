@@ -0,0 +1,232 @@
+/* Mutating ROMs an instruction at a time.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ *
+ * A byte-level mutation almost always turns a ROM into one that faults
+ * at the first instruction it breaks, so every mutation here goes by
+ * the encoding instead: the opcodes below are every instruction that
+ * runs outside MegaChip mode, with the bits of each that are operands,
+ * and anything put into a ROM is built from them.
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#include "mutate.h"
+
+#define MAX_SPLICE 16
+
+enum{
+	OPERAND_FIELDS, /* registers and constants, any value runs */
+	OPERAND_CODE,   /* NNN is the address of an instruction */
+	OPERAND_DATA    /* NNN is where I points */
+};
+
+typedef struct OPCODE OPCODE;
+struct OPCODE{
+	uint16_t base, operands;
+	uint8_t kind;
+};
+
+static const OPCODE opcodes[] = {
+	{0x00E0, 0x000, OPERAND_FIELDS}, {0x00EE, 0x000, OPERAND_FIELDS},
+	{0x1000, 0xFFF, OPERAND_CODE},   {0x2000, 0xFFF, OPERAND_CODE},
+	{0x3000, 0xFFF, OPERAND_FIELDS}, {0x4000, 0xFFF, OPERAND_FIELDS},
+	{0x5000, 0xFF0, OPERAND_FIELDS}, {0x6000, 0xFFF, OPERAND_FIELDS},
+	{0x7000, 0xFFF, OPERAND_FIELDS}, {0x8000, 0xFF0, OPERAND_FIELDS},
+	{0x8001, 0xFF0, OPERAND_FIELDS}, {0x8002, 0xFF0, OPERAND_FIELDS},
+	{0x8003, 0xFF0, OPERAND_FIELDS}, {0x8004, 0xFF0, OPERAND_FIELDS},
+	{0x8005, 0xFF0, OPERAND_FIELDS}, {0x8006, 0xFF0, OPERAND_FIELDS},
+	{0x8007, 0xFF0, OPERAND_FIELDS}, {0x800E, 0xFF0, OPERAND_FIELDS},
+	{0x9000, 0xFF0, OPERAND_FIELDS}, {0xA000, 0xFFF, OPERAND_DATA},
+	{0xB000, 0xFFF, OPERAND_CODE},   {0xC000, 0xFFF, OPERAND_FIELDS},
+	{0xD000, 0xFFF, OPERAND_FIELDS}, {0xE09E, 0xF00, OPERAND_FIELDS},
+	{0xE0A1, 0xF00, OPERAND_FIELDS}, {0xF007, 0xF00, OPERAND_FIELDS},
+	{0xF00A, 0xF00, OPERAND_FIELDS}, {0xF015, 0xF00, OPERAND_FIELDS},
+	{0xF018, 0xF00, OPERAND_FIELDS}, {0xF01E, 0xF00, OPERAND_FIELDS},
+	{0xF029, 0xF00, OPERAND_FIELDS}, {0xF033, 0xF00, OPERAND_FIELDS},
+	{0xF055, 0xF00, OPERAND_FIELDS}, {0xF065, 0xF00, OPERAND_FIELDS}
+};
+#define NOPCODES (sizeof(opcodes) / sizeof(opcodes[0]))
+
+enum{
+	MUTATE_INSERT,
+	MUTATE_DELETE,
+	MUTATE_REPLACE,
+	MUTATE_OPERANDS,
+	MUTATE_RETARGET,
+	MUTATE_SPLICE,
+	NMUTATIONS
+};
+
+/* A number below n. */
+static uint32_t
+below(uint32_t *seed, uint32_t n)
+{
+	*seed = *seed * 1664525 + 1013904223;
+	return (uint64_t)*seed * n >> 32;
+}
+
+static uint16_t
+getword(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static void
+putword(uint8_t *p, uint16_t w)
+{
+	p[0] = w >> 8;
+	p[1] = w & 0xFF;
+}
+
+static const OPCODE *
+classify(uint16_t w)
+{
+	for (size_t k = 0; k < NOPCODES; k++){
+		if ((w & ~opcodes[k].operands) == opcodes[k].base)
+			return &opcodes[k];
+	}
+	return NULL;
+}
+
+static bool
+addressed(const OPCODE *op)
+{
+	return op && op->kind != OPERAND_FIELDS;
+}
+
+/* An address for op in a ROM of size bytes: an instruction for
+ * code, and for data a byte of the ROM or a font character.
+ */
+static uint16_t
+target(const OPCODE *op, size_t size, uint32_t *seed)
+{
+	size_t nwords = size / 2;
+	if (op->kind == OPERAND_CODE || !size)
+		return MUTATE_LOAD_ADDR + 2 * below(seed, nwords? nwords : 1);
+	if (below(seed, 4) == 0)
+		return below(seed, 16) * 5;
+	return MUTATE_LOAD_ADDR + below(seed, size);
+}
+
+static uint16_t
+instruction(size_t size, uint32_t *seed)
+{
+	const OPCODE *op = &opcodes[below(seed, NOPCODES)];
+	if (addressed(op))
+		return op->base | target(op, size, seed);
+	return op->base | (below(seed, 0x10000) & op->operands);
+}
+
+static bool
+inside(const OPCODE *op, uint16_t t, size_t size)
+{
+	if (op->kind == OPERAND_DATA)
+		return (size_t)t < MUTATE_LOAD_ADDR + size;
+	return t >= MUTATE_LOAD_ADDR && (size_t)t + 1 < MUTATE_LOAD_ADDR + size && !(t & 1);
+}
+
+/* Adds delta to every address past after, for an instruction inserted
+ * or deleted there. A jump to the last instruction, deleted, goes to
+ * the one before.
+ */
+static void
+move(uint8_t *rom, size_t size, uint16_t after, int delta)
+{
+	for (size_t at = 0; at + 1 < size; at += 2){
+		uint16_t w = getword(rom + at), t = w & 0xFFF;
+		const OPCODE *op = classify(w);
+		if (!addressed(op) || t <= after)
+			continue;
+		t += delta;
+		if (!inside(op, t, size) && inside(op, t - 2, size))
+			t -= 2;
+		putword(rom + at, (w & 0xF000) | (t & 0xFFF));
+	}
+}
+
+/* Copies a run of instructions from other over rom at an instruction
+ * boundary. Addresses into the run move with it, and those elsewhere
+ * that do not land in rom are retargeted.
+ */
+static void
+splice(uint8_t *rom, size_t size, const uint8_t *other, size_t othersize, uint32_t *seed)
+{
+	size_t from = 2 * below(seed, othersize / 2), to = 2 * below(seed, size / 2);
+	size_t n = 2 * (1 + below(seed, MAX_SPLICE));
+	if (n > othersize - from)
+		n = (othersize - from) & ~(size_t)1;
+	if (n > size - to)
+		n = (size - to) & ~(size_t)1;
+
+	uint16_t lo = MUTATE_LOAD_ADDR + from, hi = lo + n;
+	for (size_t k = 0; k < n; k += 2){
+		uint16_t w = getword(other + from + k), t = w & 0xFFF;
+		const OPCODE *op = classify(w);
+		if (addressed(op) && t >= lo && t < hi)
+			w = op->base | (t - lo + MUTATE_LOAD_ADDR + to);
+		else if (addressed(op) && !inside(op, t, size) && (op->kind == OPERAND_CODE || t >= MUTATE_LOAD_ADDR))
+			w = op->base | target(op, size, seed);
+		putword(rom + to + k, w);
+	}
+}
+
+size_t
+mutaterom(uint8_t *rom, size_t size, size_t max, const uint8_t *other, size_t othersize, uint32_t *seed)
+{
+	size_t nwords = size / 2;
+	int kind = nwords? below(seed, NMUTATIONS) : MUTATE_INSERT;
+	if (kind == MUTATE_SPLICE && (!other || othersize < 2))
+		kind = MUTATE_INSERT;
+	if (kind == MUTATE_INSERT && size + 2 > max)
+		kind = nwords? MUTATE_REPLACE : -1;
+	if (kind == MUTATE_DELETE && nwords < 2)
+		kind = MUTATE_REPLACE;
+
+	size_t at = 2 * below(seed, nwords? nwords : 1);
+	uint16_t w = nwords? getword(rom + at) : 0;
+	const OPCODE *op = classify(w);
+	if (kind == MUTATE_RETARGET){
+		/* a few tries to find something to retarget */
+		for (int tries = 0; tries < 8 && !addressed(op); tries++){
+			at = 2 * below(seed, nwords);
+			op = classify(w = getword(rom + at));
+		}
+		if (!addressed(op))
+			kind = MUTATE_REPLACE;
+	}
+	if (kind == MUTATE_OPERANDS && (!op || !op->operands))
+		kind = MUTATE_REPLACE;
+
+	switch (kind){
+		case MUTATE_INSERT:
+			at = 2 * below(seed, nwords + 1);
+			memmove(rom + at + 2, rom + at, size - at);
+			size += 2;
+			move(rom, size, MUTATE_LOAD_ADDR + at - 1, 2);
+			putword(rom + at, instruction(size, seed));
+			break;
+		case MUTATE_DELETE:
+			memmove(rom + at, rom + at + 2, size - at - 2);
+			size -= 2;
+			move(rom, size, MUTATE_LOAD_ADDR + at, -2);
+			break;
+		case MUTATE_REPLACE:
+			putword(rom + at, instruction(size, seed));
+			break;
+		case MUTATE_OPERANDS:
+			if (addressed(op))
+				putword(rom + at, op->base | target(op, size, seed));
+			else
+				putword(rom + at, op->base | (below(seed, 0x10000) & op->operands));
+			break;
+		case MUTATE_RETARGET:
+			putword(rom + at, op->base | target(op, size, seed));
+			break;
+		case MUTATE_SPLICE:
+			splice(rom, size, other, othersize, seed);
+			break;
+	}
+	return size;
+}
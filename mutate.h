@@ -0,0 +1,25 @@
+/* Mutating ROMs an instruction at a time.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef MUTATE_H
+#define MUTATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MUTATE_LOAD_ADDR 512
+
+/* Changes the size bytes of rom, loaded at MUTATE_LOAD_ADDR, in one of
+ * the ways that keep it a program: inserting, deleting or replacing an
+ * instruction with a valid one, changing one's registers or constant,
+ * retargeting a jump, call or load of I to another instruction in the
+ * ROM, or splicing in a run of instructions from other, if given, with
+ * the addresses in it moved along with it. Inserting and deleting move
+ * the addresses of the instructions after the edit, so every address
+ * into them is moved to match. Returns the new size, at most max.
+ */
+size_t mutaterom(uint8_t *rom, size_t size, size_t max, const uint8_t *other, size_t othersize, uint32_t *seed);
+
+#endif
@@ -0,0 +1,448 @@
+/* Writing files without blocking the threads that produce them.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "output.h"
+
+#define OUTPUT_MAX (OUTPUT_POOL / OUTPUT_DEPTH)
+
+enum{
+	MODE_FIXED,  /* io_uring, from the registered pool */
+	MODE_PLAIN,  /* io_uring, the pool could not be registered */
+	MODE_PWRITE  /* no io_uring */
+};
+
+/* A buffer handed over, and how much of it is written. */
+typedef struct PENDING PENDING;
+struct PENDING{
+	OUTPUT *owner;
+	size_t len, done;
+	uint64_t offset;
+};
+
+/* Buffers go to the writer through full and come back through empty,
+ * each ring written by one side only. An output has OUTPUT_DEPTH
+ * buffers in all, so neither ring can overflow.
+ */
+struct OUTPUT{
+	int fd, slot;
+	bool stream;
+
+	int cur;                /* the producer's buffer, or -1 */
+	size_t used;
+	unsigned emptyhead;
+
+	struct{int buf; size_t len;} full[OUTPUT_DEPTH];
+	atomic_uint fulltail;
+	unsigned fullhead;
+
+	int empty[OUTPUT_DEPTH];
+	atomic_uint emptytail;
+
+	uint64_t offset;        /* the writer's, for the next buffer */
+	int inflight;
+	atomic_bool failed, closing, closed;
+};
+
+typedef struct RING RING;
+struct RING{
+	int fd;
+	unsigned *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned pending;       /* entries not yet submitted */
+};
+
+static struct{
+	int mode, wakefd;
+	uint8_t *pool;
+	PENDING pending[OUTPUT_POOL];
+	RING ring;
+	unsigned inflight;
+	_Atomic(OUTPUT *) outputs[OUTPUT_MAX];
+	atomic_bool asleep;
+	atomic_int waiters;
+	pthread_mutex_t lock;
+	pthread_cond_t returned;
+	bool started;
+} writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .returned = PTHREAD_COND_INITIALIZER};
+
+static uint8_t *
+buffer(int b)
+{
+	return writer.pool + (size_t)b * OUTPUT_BUFFER_SIZE;
+}
+
+/* The rings are mapped by hand rather than through liburing, which
+ * this would be the only user of.
+ */
+static bool
+setupring(RING *r)
+{
+	struct io_uring_params p = {0};
+	r->fd = syscall(__NR_io_uring_setup, OUTPUT_POOL, &p);
+	if (r->fd < 0)
+		return false;
+
+	size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sqsize = cqsize = sqsize > cqsize? sqsize : cqsize;
+	uint8_t *sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	uint8_t *cq = sq;
+	if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+		cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED){
+		close(r->fd);
+		return false;
+	}
+
+	r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sqarray = (unsigned *)(sq + p.sq_off.array);
+	r->cqhead = (unsigned *)(cq + p.cq_off.head);
+	r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+static bool
+registerpool(RING *r)
+{
+	struct iovec iov[OUTPUT_POOL];
+	for (int b = 0; b < OUTPUT_POOL; b++)
+		iov[b] = (struct iovec){buffer(b), OUTPUT_BUFFER_SIZE};
+	return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, OUTPUT_POOL) == 0;
+}
+
+static void
+giveback(OUTPUT *o, int b, bool ok)
+{
+	if (!ok)
+		atomic_store(&o->failed, true);
+	o->inflight--;
+	unsigned tail = atomic_load_explicit(&o->emptytail, memory_order_relaxed);
+	o->empty[tail % OUTPUT_DEPTH] = b;
+	atomic_store(&o->emptytail, tail + 1);
+	if (atomic_load(&writer.waiters)){
+		pthread_mutex_lock(&writer.lock);
+		pthread_cond_broadcast(&writer.returned);
+		pthread_mutex_unlock(&writer.lock);
+	}
+}
+
+static void
+issue(int b)
+{
+	PENDING *p = &writer.pending[b];
+	OUTPUT *o = p->owner;
+	if (writer.mode == MODE_PWRITE){
+		while (p->done < p->len){
+			ssize_t n = o->stream? write(o->fd, buffer(b) + p->done, p->len - p->done)
+			                     : pwrite(o->fd, buffer(b) + p->done, p->len - p->done, p->offset + p->done);
+			if (n <= 0 && errno != EINTR)
+				break;
+			p->done += n > 0? n : 0;
+		}
+		giveback(o, b, p->done == p->len);
+		return;
+	}
+
+	RING *r = &writer.ring;
+	unsigned tail = *r->sqtail, at = tail & *r->sqmask;
+	struct io_uring_sqe *sqe = &r->sqes[at];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = writer.mode == MODE_FIXED? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+	sqe->fd = o->fd;
+	sqe->addr = (uintptr_t)(buffer(b) + p->done);
+	sqe->len = p->len - p->done;
+	sqe->off = o->stream? (uint64_t)-1 : p->offset + p->done;
+	sqe->buf_index = b;
+	sqe->user_data = b;
+	r->sqarray[at] = at;
+	atomic_store_explicit((_Atomic unsigned *)r->sqtail, tail + 1, memory_order_release);
+	r->pending++;
+	writer.inflight++;
+}
+
+/* Takes up what o has handed over. */
+static bool
+drain(OUTPUT *o)
+{
+	bool any = false;
+	while (o->fullhead != atomic_load_explicit(&o->fulltail, memory_order_acquire) && !(o->stream && o->inflight)){
+		int b = o->full[o->fullhead % OUTPUT_DEPTH].buf;
+		writer.pending[b] = (PENDING){o, o->full[o->fullhead % OUTPUT_DEPTH].len, 0, o->offset};
+		o->offset += writer.pending[b].len;
+		o->fullhead++;
+		o->inflight++;
+		issue(b);
+		any = true;
+	}
+	return any;
+}
+
+/* Takes up what has completed; false if nothing had. */
+static bool
+complete(void)
+{
+	RING *r = &writer.ring;
+	unsigned head = *r->cqhead, first = head;
+	while (head != atomic_load_explicit((_Atomic unsigned *)r->cqtail, memory_order_acquire)){
+		struct io_uring_cqe *cqe = &r->cqes[head++ & *r->cqmask];
+		int b = cqe->user_data, res = cqe->res;
+		PENDING *p = &writer.pending[b];
+		writer.inflight--;
+		if (res == -EINTR || res == -EAGAIN || (res > 0 && (p->done += res) < p->len))
+			issue(b);
+		else
+			giveback(p->owner, b, res > 0);
+	}
+	atomic_store_explicit((_Atomic unsigned *)r->cqhead, head, memory_order_release);
+	return head != first;
+}
+
+/* The ring has failed for good: the entries it has not taken are taken
+ * back and written with pwrite, as is everything from now on. What it
+ * has taken still completes through it.
+ */
+static void
+abandon(void)
+{
+	RING *r = &writer.ring;
+	unsigned tail = *r->sqtail, from = tail - r->pending;
+	writer.mode = MODE_PWRITE;
+	r->pending = 0;
+	atomic_store_explicit((_Atomic unsigned *)r->sqtail, from, memory_order_release);
+	for (unsigned k = from; k != tail; k++){
+		writer.inflight--;
+		issue(r->sqes[k & *r->sqmask].user_data);
+	}
+}
+
+static void
+reap(bool wait)
+{
+	RING *r = &writer.ring;
+	for (;;){
+		int n = syscall(__NR_io_uring_enter, r->fd, r->pending, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n >= 0){
+			r->pending -= n;
+			break;
+		}
+		if (errno == EINTR)
+			continue;
+		/* out of room until the kernel finishes some of what it has */
+		if ((errno == EBUSY || errno == EAGAIN) && (complete() || writer.inflight > r->pending)){
+			wait = false;
+			continue;
+		}
+		abandon();
+		break;
+	}
+	complete();
+}
+
+/* An output that is closing is let go once everything it handed over is
+ * written; the thread closing it frees it.
+ */
+static void
+retire(OUTPUT *o)
+{
+	if (!atomic_load(&o->closing) || o->inflight ||
+	    o->fullhead != atomic_load_explicit(&o->fulltail, memory_order_acquire))
+		return;
+	atomic_store(&writer.outputs[o->slot], NULL);
+	pthread_mutex_lock(&writer.lock);
+	atomic_store(&o->closed, true);
+	pthread_cond_broadcast(&writer.returned);
+	pthread_mutex_unlock(&writer.lock);
+}
+
+static bool
+handedover(void)
+{
+	for (int k = 0; k < OUTPUT_MAX; k++){
+		OUTPUT *o = atomic_load(&writer.outputs[k]);
+		if (o && (atomic_load(&o->closing) || o->fullhead != atomic_load(&o->fulltail)))
+			return true;
+	}
+	return false;
+}
+
+static void *
+writethread(void *arg)
+{
+	(void)arg;
+	for (;;){
+		bool busy = false;
+		for (int k = 0; k < OUTPUT_MAX; k++){
+			OUTPUT *o = atomic_load(&writer.outputs[k]);
+			if (o){
+				busy |= drain(o);
+				retire(o);
+			}
+		}
+		if (writer.inflight || writer.ring.pending){
+			reap(!busy);
+			continue;
+		}
+		if (busy)
+			continue;
+
+		/* a producer that sees asleep after handing over wakes us */
+		atomic_store(&writer.asleep, true);
+		uint64_t n;
+		if (!handedover() && read(writer.wakefd, &n, sizeof(n)) < 0 && errno != EINTR)
+			abort();
+		atomic_store(&writer.asleep, false);
+	}
+	return NULL;
+}
+
+static bool
+startwriter(void)
+{
+	pthread_t thread;
+	size_t size = (size_t)OUTPUT_POOL * OUTPUT_BUFFER_SIZE;
+	writer.pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (writer.pool == MAP_FAILED || (writer.wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
+		return false;
+
+	writer.mode = MODE_PWRITE;
+	if (!getenv("C8_NO_URING") && setupring(&writer.ring))
+		writer.mode = registerpool(&writer.ring)? MODE_FIXED : MODE_PLAIN;
+	if (pthread_create(&thread, NULL, writethread, NULL) != 0)
+		return false;
+	pthread_detach(thread);
+	return writer.started = true;
+}
+
+static void
+wakewriter(void)
+{
+	uint64_t one = 1;
+	if (atomic_load(&writer.asleep) && write(writer.wakefd, &one, sizeof(one)) < 0)
+		abort();
+}
+
+OUTPUT *
+openoutput(const char *filename)
+{
+	OUTPUT *o = calloc(1, sizeof(OUTPUT));
+	if (!o)
+		return NULL;
+	pthread_mutex_lock(&writer.lock);
+	o->slot = -1;
+	for (int k = 0; k < OUTPUT_MAX && o->slot < 0; k++){
+		if (!atomic_load(&writer.outputs[k]))
+			o->slot = k;
+	}
+	if (o->slot < 0 || (!writer.started && !startwriter()) ||
+	    (o->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0){
+		pthread_mutex_unlock(&writer.lock);
+		free(o);
+		return NULL;
+	}
+
+	o->stream = lseek(o->fd, 0, SEEK_CUR) < 0;
+	o->cur = -1;
+	for (int k = 0; k < OUTPUT_DEPTH; k++)
+		o->empty[k] = o->slot * OUTPUT_DEPTH + k;
+	atomic_store(&o->emptytail, OUTPUT_DEPTH);
+	atomic_store(&writer.outputs[o->slot], o);
+	pthread_mutex_unlock(&writer.lock);
+	return o;
+}
+
+static void
+waitfor(OUTPUT *o, bool closing)
+{
+	pthread_mutex_lock(&writer.lock);
+	atomic_fetch_add(&writer.waiters, 1);
+	while (closing? !atomic_load(&o->closed) : o->emptyhead == atomic_load(&o->emptytail)){
+		wakewriter();
+		pthread_cond_wait(&writer.returned, &writer.lock);
+	}
+	atomic_fetch_sub(&writer.waiters, 1);
+	pthread_mutex_unlock(&writer.lock);
+}
+
+static void
+handover(OUTPUT *o)
+{
+	if (o->cur < 0 || !o->used)
+		return;
+	unsigned tail = atomic_load_explicit(&o->fulltail, memory_order_relaxed);
+	o->full[tail % OUTPUT_DEPTH].buf = o->cur;
+	o->full[tail % OUTPUT_DEPTH].len = o->used;
+	atomic_store(&o->fulltail, tail + 1);
+	wakewriter();
+	o->cur = -1;
+}
+
+void *
+reserveoutput(OUTPUT *o, size_t n)
+{
+	if (atomic_load_explicit(&o->failed, memory_order_relaxed) || n > OUTPUT_BUFFER_SIZE)
+		return NULL;
+	if (o->cur >= 0 && o->used + n > OUTPUT_BUFFER_SIZE)
+		handover(o);
+	if (o->cur < 0){
+		if (o->emptyhead == atomic_load_explicit(&o->emptytail, memory_order_acquire))
+			waitfor(o, false);
+		o->cur = o->empty[o->emptyhead++ % OUTPUT_DEPTH];
+		o->used = 0;
+	}
+	void *p = buffer(o->cur) + o->used;
+	o->used += n;
+	return p;
+}
+
+bool
+writeoutput(OUTPUT *o, const void *p, size_t n)
+{
+	while (n){
+		size_t chunk = n < OUTPUT_BUFFER_SIZE? n : OUTPUT_BUFFER_SIZE;
+		void *at = reserveoutput(o, chunk);
+		if (!at)
+			return false;
+		memcpy(at, p, chunk);
+		p = (const uint8_t *)p + chunk;
+		n -= chunk;
+	}
+	return true;
+}
+
+bool
+closeoutput(OUTPUT *o)
+{
+	handover(o);
+	atomic_store(&o->closing, true);
+	wakewriter();
+	waitfor(o, true);
+	bool ok = !atomic_load(&o->failed);
+	if (close(o->fd) != 0)
+		ok = false;
+	free(o);
+	return ok;
+}
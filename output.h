@@ -0,0 +1,46 @@
+/* Writing files without blocking the threads that produce them.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Every output is written by one thread shared by all of them, from
+ * buffers taken from a fixed pool, OUTPUT_DEPTH to an output, so the
+ * memory spent on output is bounded however many are open and however
+ * far behind the disk is. The thread producing an output fills its
+ * current buffer in place and hands it over when it is full, which
+ * takes a store and, only if the writer is asleep, a wakeup; it waits
+ * only when all of its buffers are still being written.
+ *
+ * The writer batches what it has been handed into an io_uring set up
+ * by hand, with the pool registered so the kernel need not map the
+ * buffers for every write. Where io_uring is unavailable, or the pool
+ * cannot be registered, it falls back to unregistered buffers and then
+ * to plain pwrite(), which it also switches to if the ring later stops
+ * taking writes. Pipes and other outputs that cannot seek are written
+ * one buffer at a time, in order.
+ *
+ * Each output is for one thread at a time. A failed write is reported
+ * by the calls after it and by closeoutput().
+ */
+#define OUTPUT_BUFFER_SIZE 65536
+#define OUTPUT_DEPTH 4
+#define OUTPUT_POOL 32
+
+typedef struct OUTPUT OUTPUT;
+
+OUTPUT *openoutput(const char *filename);
+
+/* n bytes, at most OUTPUT_BUFFER_SIZE, to be filled in before the next
+ * call; NULL once a write has failed.
+ */
+void *reserveoutput(OUTPUT *o, size_t n);
+bool writeoutput(OUTPUT *o, const void *p, size_t n);
+bool closeoutput(OUTPUT *o);
+
+#endif
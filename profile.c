@@ -0,0 +1,142 @@
+/* Sampling where the guest spends its time.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "profile.h"
+
+/* A stack is the pc and up to STACK_SIZE return addresses of twelve
+ * bits each, with the depth in the low three bits of frames. Only the
+ * signal handler writes a slot; it fills in the key before setting used,
+ * so a reader that sees used sees the key.
+ */
+typedef struct SLOT SLOT;
+struct SLOT{
+	uint64_t frames;
+	uint16_t pc;
+	atomic_bool used;
+	_Atomic uint64_t count;
+};
+
+static struct{
+	const CHIP8 *vm;
+	timer_t timer;
+	bool running;
+	atomic_bool requested;
+	_Atomic uint64_t lost;  /* samples for which the table had no room */
+	SLOT slots[PROFILE_SLOTS];
+} profile;
+
+static void
+onsample(int sig)
+{
+	const CHIP8 *vm = profile.vm;
+	uint16_t pc = vm->pc % MEMORY_SIZE;
+	uint64_t depth = vm->sp <= STACK_SIZE? vm->sp : STACK_SIZE, frames = depth;
+	(void)sig;
+	for (uint64_t k = 0; k < depth; k++)
+		frames |= (uint64_t)(vm->stack[k] % MEMORY_SIZE) << (3 + 12 * k);
+
+	uint64_t h = (frames ^ (uint64_t)pc << 52) * 0x9E3779B97F4A7C15ull;
+	for (unsigned probe = 0; probe < PROFILE_SLOTS; probe++){
+		SLOT *s = &profile.slots[((h >> 52) + probe) & (PROFILE_SLOTS - 1)];
+		if (!atomic_load_explicit(&s->used, memory_order_relaxed)){
+			s->frames = frames;
+			s->pc = pc;
+			atomic_store_explicit(&s->used, true, memory_order_release);
+		} else if (s->frames != frames || s->pc != pc)
+			continue;
+		atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+		return;
+	}
+	atomic_fetch_add_explicit(&profile.lost, 1, memory_order_relaxed);
+}
+
+static void
+ondump(int sig)
+{
+	(void)sig;
+	atomic_store(&profile.requested, true);
+}
+
+bool
+startprofile(const CHIP8 *vm, unsigned hz)
+{
+	clockid_t clock;
+	struct sigaction sa = {.sa_flags = SA_RESTART};
+	struct sigevent ev = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGPROF};
+	struct itimerspec every = {0};
+	if (!hz || hz > 1000000)
+		return false;
+
+	profile.vm = vm;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = onsample;
+	if (sigaction(SIGPROF, &sa, NULL) != 0)
+		return false;
+	sa.sa_handler = ondump;
+	if (sigaction(SIGUSR1, &sa, NULL) != 0)
+		return false;
+
+	ev._sigev_un._tid = syscall(SYS_gettid);
+	every.it_interval.tv_sec = 1 / hz;
+	every.it_interval.tv_nsec = 1000000000 / hz % 1000000000;
+	every.it_value = every.it_interval;
+	if (pthread_getcpuclockid(pthread_self(), &clock) != 0 ||
+	    timer_create(clock, &ev, &profile.timer) != 0)
+		return false;
+	if (timer_settime(profile.timer, 0, &every, NULL) != 0){
+		timer_delete(profile.timer);
+		return false;
+	}
+	profile.running = true;
+	return true;
+}
+
+bool
+profilerequested(void)
+{
+	return atomic_exchange(&profile.requested, false);
+}
+
+bool
+dumpprofile(const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if (!f)
+		return false;
+	for (int k = 0; k < PROFILE_SLOTS; k++){
+		SLOT *s = &profile.slots[k];
+		if (!atomic_load_explicit(&s->used, memory_order_acquire))
+			continue;
+
+		/* a return address is the instruction after the call */
+		int depth = s->frames & 7;
+		for (int d = 0; d < depth; d++)
+			fprintf(f, "0x%03X;", (unsigned)((s->frames >> (3 + 12 * d) & 0xFFF) - 2) & 0xFFF);
+		fprintf(f, "0x%03X %llu\n", s->pc, (unsigned long long)atomic_load_explicit(&s->count, memory_order_relaxed));
+	}
+	uint64_t lost = atomic_load(&profile.lost);
+	if (lost)
+		fprintf(f, "lost %llu\n", (unsigned long long)lost);
+	return fclose(f) == 0;
+}
+
+void
+stopprofile(void)
+{
+	if (profile.running)
+		timer_delete(profile.timer);
+	profile.running = false;
+	signal(SIGPROF, SIG_IGN);
+}
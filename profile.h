@@ -0,0 +1,35 @@
+/* Sampling where the guest spends its time.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/* A timer on the CPU clock of the thread that called startprofile()
+ * raises SIGPROF on that thread hz times a second of its running time.
+ * The handler takes the machine's pc and the return addresses on its
+ * stack and counts them in a fixed table, which takes no locks and
+ * allocates nothing, so sampling can be left on. A sample lands where
+ * the thread happens to be, so one taken partway through fetching an
+ * instruction sees the pc between its two bytes.
+ *
+ * dumpprofile() writes what has been counted so far in the folded
+ * format flame graph tools read, one line per distinct stack: the call
+ * sites outermost first, then the pc, then the count. It can be called
+ * from any thread. SIGUSR1 asks for a dump; profilerequested() says
+ * whether one has been asked for since it last said so.
+ */
+#define PROFILE_HZ 1000
+#define PROFILE_SLOTS 4096
+
+bool startprofile(const CHIP8 *vm, unsigned hz);
+bool profilerequested(void);
+bool dumpprofile(const char *filename);
+void stopprofile(void);
+
+#endif
@@ -0,0 +1,262 @@
+/* Display-only session recordings.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+#include "record.h"
+
+enum{
+	RECORD_KEY,
+	RECORD_DELTA,
+	RECORD_END
+};
+
+struct RECORDER{
+	OUTPUT *out;
+	uint64_t rows[32], tick;
+	unsigned count;
+	bool failed;
+};
+
+struct PLAYER{
+	FILE *f;
+	uint64_t rows[32], tick;
+};
+
+static void
+putvarint(RECORDER *r, uint64_t v)
+{
+	do{
+		uint8_t b = v & 0x7F;
+		v >>= 7;
+		b |= v? 0x80 : 0;
+		if (!writeoutput(r->out, &b, 1))
+			r->failed = true;
+	} while (v);
+}
+
+static bool
+getvarint(FILE *f, uint64_t *v)
+{
+	int c, shift = 0;
+	*v = 0;
+	do{
+		if ((c = fgetc(f)) == EOF || shift > 63)
+			return false;
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return true;
+}
+
+/* PackBits: a control byte below 128 is followed by that many plus one
+ * literal bytes, one above is followed by a byte repeated that many
+ * minus 125 times.
+ */
+static size_t
+pack(uint8_t *out, const uint8_t *in, size_t n)
+{
+	size_t o = 0, i = 0;
+	while (i < n){
+		size_t run = 1;
+		while (i + run < n && run < 130 && in[i + run] == in[i])
+			run++;
+		if (run >= 3){
+			out[o++] = (uint8_t)(run + 125);
+			out[o++] = in[i];
+			i += run;
+			continue;
+		}
+
+		size_t lit = 0;
+		while (i + lit < n && lit < 128){
+			if (i + lit + 2 < n && in[i + lit] == in[i + lit + 1] && in[i + lit] == in[i + lit + 2])
+				break;
+			lit++;
+		}
+		out[o++] = (uint8_t)(lit - 1);
+		memcpy(out + o, in + i, lit);
+		o += lit;
+		i += lit;
+	}
+	return o;
+}
+
+static bool
+unpack(FILE *f, uint8_t *out, size_t n)
+{
+	size_t o = 0;
+	while (o < n){
+		int c = fgetc(f);
+		if (c == EOF)
+			return false;
+		if (c < 128){
+			size_t lit = (size_t)c + 1;
+			if (o + lit > n || fread(out + o, 1, lit, f) != lit)
+				return false;
+			o += lit;
+		} else{
+			size_t run = (size_t)c - 125;
+			int b = fgetc(f);
+			if (b == EOF || o + run > n)
+				return false;
+			memset(out + o, b, run);
+			o += run;
+		}
+	}
+	return true;
+}
+
+static void
+putrows(uint8_t *buf, const uint64_t *rows, unsigned n)
+{
+	for (unsigned r = 0; r < n; r++)
+		for (int b = 0; b < 8; b++)
+			buf[r * 8 + b] = rows[r] >> (56 - 8 * b);
+}
+
+static void
+getrows(uint64_t *rows, const uint8_t *buf, unsigned n)
+{
+	for (unsigned r = 0; r < n; r++){
+		rows[r] = 0;
+		for (int b = 0; b < 8; b++)
+			rows[r] |= (uint64_t)buf[r * 8 + b] << (56 - 8 * b);
+	}
+}
+
+RECORDER *
+openrecording(const char *filename)
+{
+	RECORDER *r = calloc(1, sizeof(RECORDER));
+	if (!r)
+		return NULL;
+	if (!(r->out = openoutput(filename)) || !writeoutput(r->out, RECORD_MAGIC, 5)){
+		if (r->out)
+			closeoutput(r->out);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+bool
+recordframe(RECORDER *r, uint64_t tick, const uint64_t rows[32])
+{
+	uint64_t changed[32];
+	uint8_t raw[32 * 8], packed[5 + 32 * 8 * 2];
+	uint32_t mask = 0;
+	unsigned n = 0;
+
+	for (int row = 0; row < 32; row++){
+		if (rows[row] != r->rows[row]){
+			mask |= 1u << row;
+			changed[n++] = rows[row] ^ r->rows[row];
+		}
+	}
+	if (!mask && r->count)
+		return !r->failed;
+
+	putvarint(r, tick - r->tick);
+	size_t len = 1;
+	if (r->count++ % RECORD_KEYFRAME == 0){
+		packed[0] = RECORD_KEY;
+		putrows(raw, rows, 32);
+		n = 32;
+	} else{
+		uint8_t m[5] = {RECORD_DELTA, mask, mask >> 8, mask >> 16, mask >> 24};
+		memcpy(packed, m, 5);
+		len = 5;
+		putrows(raw, changed, n);
+	}
+	len += pack(packed + len, raw, n * 8);
+	if (!writeoutput(r->out, packed, len))
+		r->failed = true;
+
+	memcpy(r->rows, rows, sizeof(r->rows));
+	r->tick = tick;
+	return !r->failed;
+}
+
+bool
+closerecording(RECORDER *r, uint64_t tick)
+{
+	uint8_t end = RECORD_END;
+	putvarint(r, tick - r->tick);
+	bool ok = writeoutput(r->out, &end, 1) && !r->failed;
+	if (!closeoutput(r->out))
+		ok = false;
+	free(r);
+	return ok;
+}
+
+PLAYER *
+openplayback(const char *filename)
+{
+	char magic[5];
+	PLAYER *p = calloc(1, sizeof(PLAYER));
+	if (!p)
+		return NULL;
+	if (!(p->f = fopen(filename, "rb")) || fread(magic, 1, 5, p->f) != 5 ||
+	    memcmp(magic, RECORD_MAGIC, 5) != 0){
+		if (p->f)
+			fclose(p->f);
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+int
+readframe(PLAYER *p, uint64_t *tick, uint64_t rows[32])
+{
+	uint8_t raw[32 * 8], m[4];
+	uint64_t delta, changed[32];
+	int type;
+
+	if (!getvarint(p->f, &delta) || (type = fgetc(p->f)) == EOF)
+		return -1;
+	*tick = p->tick += delta;
+	switch (type){
+		case RECORD_END:
+			return 0;
+
+		case RECORD_KEY:
+			if (!unpack(p->f, raw, sizeof(raw)))
+				return -1;
+			getrows(p->rows, raw, 32);
+			break;
+
+		case RECORD_DELTA:{
+			if (fread(m, 1, 4, p->f) != 4)
+				return -1;
+			uint32_t mask = m[0] | m[1] << 8 | m[2] << 16 | (uint32_t)m[3] << 24;
+			unsigned n = (unsigned)__builtin_popcount(mask);
+			if (!unpack(p->f, raw, n * 8))
+				return -1;
+			getrows(changed, raw, n);
+			for (unsigned row = 0, k = 0; row < 32; row++){
+				if (mask >> row & 1)
+					p->rows[row] ^= changed[k++];
+			}
+			break;
+		}
+
+		default:
+			return -1;
+	}
+	memcpy(rows, p->rows, sizeof(p->rows));
+	return 1;
+}
+
+void
+closeplayback(PLAYER *p)
+{
+	fclose(p->f);
+	free(p);
+}
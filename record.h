@@ -0,0 +1,36 @@
+/* Display-only session recordings.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A recording holds nothing but what was on the display and when, so
+ * it plays back without the ROM or the emulator. Each record is the tick
+ * it was shown on, as a delta from the previous record, and either a
+ * keyframe or the XOR of the rows that changed, run-length encoded.
+ * Keyframes come every RECORD_KEYFRAME records so a player can start
+ * from any of them.
+ */
+#define RECORD_MAGIC "C8DR\x01"
+#define RECORD_KEYFRAME 300
+
+typedef struct RECORDER RECORDER;
+typedef struct PLAYER PLAYER;
+
+RECORDER *openrecording(const char *filename);
+bool recordframe(RECORDER *r, uint64_t tick, const uint64_t rows[32]);
+bool closerecording(RECORDER *r, uint64_t tick);
+
+/* readframe() returns 1 with the next frame, 0 at the end, -1 if the
+ * file is damaged. The end record carries the final tick and no frame.
+ */
+PLAYER *openplayback(const char *filename);
+int readframe(PLAYER *p, uint64_t *tick, uint64_t rows[32]);
+void closeplayback(PLAYER *p);
+
+#endif
@@ -0,0 +1,55 @@
+/* Per-instruction execution traces.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+#include "trace.h"
+
+/* Records are built straight in the output's buffers. */
+struct TRACER{
+	OUTPUT *out;
+};
+
+TRACER *
+opentrace(const char *filename)
+{
+	TRACER *t = calloc(1, sizeof(TRACER));
+	if (!t)
+		return NULL;
+	if (!(t->out = openoutput(filename)) || !writeoutput(t->out, TRACE_MAGIC, TRACE_HEADER)){
+		if (t->out)
+			closeoutput(t->out);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+bool
+tracestep(TRACER *t, const CHIP8 *vm, uint64_t frame, uint16_t pc, uint16_t inst)
+{
+	TRACEREC *r = reserveoutput(t->out, sizeof(TRACEREC));
+	if (!r)
+		return false;
+	r->cycle = vm->cycles - 1;
+	r->frame = frame;
+	r->pc = pc;
+	r->inst = inst;
+	r->i = vm->i;
+	r->sp = vm->sp;
+	r->pad = 0;
+	memcpy(r->v, vm->v, sizeof(r->v));
+	return true;
+}
+
+bool
+closetrace(TRACER *t)
+{
+	bool ok = closeoutput(t->out);
+	free(t);
+	return ok;
+}
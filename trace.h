@@ -0,0 +1,38 @@
+/* Per-instruction execution traces.
+ * Copyright 2022 Rob King
+ * Released under the terms of the GNU General Public License.
+ * See LICENSE for details.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* A trace is TRACE_MAGIC followed by one fixed-size record per
+ * instruction executed, in host byte order, so that a reader can map the
+ * file and index straight into it. Each record holds the address and
+ * word of the instruction and the registers as it left them. Memory is
+ * not recorded; what an instruction wrote follows from its word and I.
+ */
+#define TRACE_MAGIC "C8TR\x01\0\0\0"
+#define TRACE_HEADER 8
+
+typedef struct TRACEREC TRACEREC;
+struct TRACEREC{
+	uint64_t cycle, frame;
+	uint16_t pc, inst, i;
+	uint8_t sp, pad;
+	uint8_t v[16];
+};
+_Static_assert(sizeof(TRACEREC) == 40, "trace records must be packed");
+
+typedef struct TRACER TRACER;
+
+TRACER *opentrace(const char *filename);
+bool tracestep(TRACER *t, const CHIP8 *vm, uint64_t frame, uint16_t pc, uint16_t inst);
+bool closetrace(TRACER *t);
+
+#endif